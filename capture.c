@@ -0,0 +1,469 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "global.h"
+#include "pipe.h"
+#include "capture.h"
+
+#define CAPTURE_MAX_CAMS 64
+#define CAPTURE_BURST 4 // frames from a camera per wakeup, none starves
+
+struct cam {
+	struct context* ctxt;
+	struct pipe* p;
+	int fd;               // from vid_nonblock
+	int zc;               // zero-copy, else copied into pipe buffers
+	int loop;
+	int seq;              // pushed
+	unsigned int drv_seq; // of the last frame, if there was one
+	int n_seen;
+	struct capture_stats st; // written by its loop only
+};
+
+struct loop {
+	pthread_t thread;
+	int epfd;
+	int stop_fd;          // eventfd, its epoll data is NULL
+	int cpu;              // pinned to, -1 if not
+	int started;
+	struct capture_priv* cp;
+};
+
+struct capture_priv {
+	struct loop* loops;
+	int n_loops;
+	struct cam cams[CAPTURE_MAX_CAMS];
+	int n_cams;
+	int running;          // cameras not done
+};
+
+static void stat_add(unsigned int* stat, unsigned int n)
+{
+	__atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + n,
+		__ATOMIC_RELAXED);
+}
+
+static void cam_done(struct loop* l, struct cam* cam)
+{
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+	__atomic_store_n(&cam->st.done, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&l->cp->running, 1, __ATOMIC_RELEASE);
+}
+
+// driver sequence gaps are frames lost before they reached us
+static void count_drops(struct cam* cam, const struct frame_info* info)
+{
+	if (cam->n_seen++)
+		stat_add(&cam->st.drops, info->sequence - cam->drv_seq - 1);
+	cam->drv_seq = info->sequence;
+}
+
+// what main.c does for a frame, without waiting for anything
+static void capture_frames(struct loop* l, struct cam* cam)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < CAPTURE_BURST; i++) {
+		unsigned char* map = NULL;
+		void* buf;
+		void* h;
+
+		if (cam->zc) {
+			if ((ret = vid_next_ref(cam->ctxt, &map)))
+				break;
+			h = get_buf_zc(cam->p, map, vid_release, cam->ctxt);
+		} else if ((h = get_buf(cam->p, &buf))) {
+			// broken (e.g. corrupt jpeg) frames give the buffer back
+			if ((ret = vid_next(cam->ctxt, (unsigned char*)buf))) {
+				drop_buf(cam->p, h);
+				break;
+			}
+		} else if ((ret = vid_next_ref(cam->ctxt, &map))) {
+			break;
+		}
+
+		// no room in the pipe, dequeued anyway so the driver goes on
+		if (!h) {
+			struct frame_info info;
+
+			vid_frame_info(cam->ctxt, &info);
+			count_drops(cam, &info);
+			vid_release(cam->ctxt, map);
+			stat_add(&cam->st.skipped, 1);
+			continue;
+		}
+
+		vid_frame_info(cam->ctxt, buf_info(h));
+		count_drops(cam, buf_info(h));
+
+		push_buf(cam->p, h, ++cam->seq);
+		stat_add(&cam->st.frames, 1);
+	}
+
+	// 1 is no frame yet (or a broken one), the rest don't get better
+	if (ret == VID_END || ret < 0)
+		cam_done(l, cam);
+}
+
+static void* loop_thread(void* argv)
+{
+	struct loop* l = (struct loop*)argv;
+	struct epoll_event evs[16];
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(l->epfd, evs, 16, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (!evs[i].data.ptr) // close_capture
+				return NULL;
+			capture_frames(l, (struct cam*)evs[i].data.ptr);
+		}
+	}
+
+	return NULL;
+}
+
+int init_capture(struct capture* c, int n_loops, int pin)
+{
+	struct capture_priv* cp;
+	int i, n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n_cpus <= 0)
+		n_cpus = 1;
+	if (n_loops <= 0)
+		n_loops = n_cpus;
+
+	cp = (struct capture_priv*)calloc(1, sizeof(*cp));
+	if (!cp)
+		return -1;
+	cp->loops = (struct loop*)calloc(n_loops, sizeof(cp->loops[0]));
+	if (!cp->loops) {
+		free(cp);
+		return -1;
+	}
+	cp->n_loops = n_loops;
+	c->priv = (void*)cp;
+
+	for (i = 0; i < n_loops; i++) {
+		struct loop* l = &cp->loops[i];
+		struct epoll_event ev;
+
+		l->cp = cp;
+		l->cpu = pin ? i % n_cpus : -1;
+		l->stop_fd = -1;
+		l->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (l->epfd < 0)
+			goto err;
+		l->stop_fd = eventfd(0, EFD_CLOEXEC);
+		if (l->stop_fd < 0)
+			goto err;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->stop_fd, &ev))
+			goto err;
+	}
+
+	return 0;
+
+err:
+	cp->n_loops = i + 1;
+	close_capture(c);
+	return -1;
+}
+
+int capture_add(struct capture* c, struct context* ctxt, struct pipe* p)
+{
+	struct capture_priv* cp = (struct capture_priv*)c->priv;
+	struct cam* cam = &cp->cams[cp->n_cams];
+	struct epoll_event ev;
+
+	// USERPTR needs pipe buffers queued ahead, not done here
+	if (cp->n_cams == CAPTURE_MAX_CAMS ||
+		ctxt->conf.io_method == IO_METHOD_USERPTR)
+		return -1;
+
+	cam->ctxt = ctxt;
+	cam->p = p;
+	cam->zc = ctxt->conf.io_method == IO_METHOD_MMAP_ZC;
+	cam->loop = cp->n_cams % cp->n_loops;
+	if ((cam->fd = vid_nonblock(ctxt)) < 0)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = cam;
+	if (epoll_ctl(cp->loops[cam->loop].epfd, EPOLL_CTL_ADD, cam->fd, &ev))
+		return -1;
+
+	cp->running++;
+	return cp->n_cams++;
+}
+
+int capture_start(struct capture* c)
+{
+	struct capture_priv* cp = (struct capture_priv*)c->priv;
+	int i;
+
+	for (i = 0; i < cp->n_loops; i++) {
+		struct loop* l = &cp->loops[i];
+
+		if (pthread_create(&l->thread, NULL, loop_thread, l))
+			return -1;
+		l->started = 1;
+
+		if (l->cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(l->cpu, &set);
+			// runs unpinned if it can't be
+			pthread_setaffinity_np(l->thread, sizeof(set), &set);
+		}
+	}
+
+	return 0;
+}
+
+int capture_running(struct capture* c)
+{
+	struct capture_priv* cp = (struct capture_priv*)c->priv;
+
+	return __atomic_load_n(&cp->running, __ATOMIC_ACQUIRE);
+}
+
+void capture_stats(struct capture* c, int cam, struct capture_stats* st)
+{
+	struct capture_priv* cp = (struct capture_priv*)c->priv;
+	struct capture_stats* s = &cp->cams[cam].st;
+
+	st->frames = __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+	st->drops = __atomic_load_n(&s->drops, __ATOMIC_RELAXED);
+	st->skipped = __atomic_load_n(&s->skipped, __ATOMIC_RELAXED);
+	st->done = __atomic_load_n(&s->done, __ATOMIC_RELAXED);
+}
+
+void close_capture(struct capture* c)
+{
+	struct capture_priv* cp = (struct capture_priv*)c->priv;
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < cp->n_loops; i++) {
+		struct loop* l = &cp->loops[i];
+
+		if (l->started) {
+			if (write(l->stop_fd, &one, sizeof(one)) != sizeof(one))
+				perror("close_capture");
+			pthread_join(l->thread, NULL);
+		}
+		if (l->stop_fd >= 0)
+			close(l->stop_fd);
+		if (l->epfd >= 0)
+			close(l->epfd);
+	}
+
+	free(cp->loops);
+	free(cp);
+}
+
+#ifdef CAPTURE_TEST
+#include <assert.h>
+#include <time.h>
+#include "replay.h"
+
+unsigned short int debug_level;
+
+#define N_CAMS 8
+#define N_FRAMES 30
+#define W 64
+#define H 48
+#define FRAME_SZ (W * H * 3 / 2)
+
+static char paths[N_CAMS][64];
+static struct context ctxts[N_CAMS];
+static struct pipe pipes[N_CAMS];
+static int ids[N_CAMS];
+static int received[N_CAMS];
+static int stop;
+
+// frame i of camera c is all (c * 31 + i) & 0xff
+static void write_files(void)
+{
+	static unsigned char frame[FRAME_SZ];
+	int c, i;
+
+	for (c = 0; c < N_CAMS; c++) {
+		FILE* f;
+
+		sprintf(paths[c], "file:/tmp/capture_test_%d.y4m", c);
+		f = fopen(paths[c] + 5, "w");
+		assert(f);
+		fprintf(f, "YUV4MPEG2 W%d H%d F30:1 C420jpeg\n", W, H);
+		for (i = 0; i < N_FRAMES; i++) {
+			memset(frame, (c * 31 + i) & 0xff, FRAME_SZ);
+			fprintf(f, "FRAME\n");
+			fwrite(frame, FRAME_SZ, 1, f);
+		}
+		fclose(f);
+	}
+}
+
+// every frame as it was in the file, in order
+static void* consumer(void* argv)
+{
+	int last[N_CAMS];
+	int c;
+
+	memset(last, 0, sizeof(last));
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (c = 0; c < N_CAMS; c++) {
+			const void* buf;
+			int seq;
+			void* h;
+
+			while ((h = pull_buf(&pipes[c], ids[c], &buf, &seq))) {
+				const unsigned char* b = (const unsigned char*)buf;
+				struct frame_info* info = buf_info(h);
+
+				assert(seq > last[c]);
+				last[c] = seq;
+				assert(info->width == W && info->height == H);
+				assert(b[0] == ((c * 31 + info->sequence) & 0xff));
+				assert(b[FRAME_SZ - 1] == b[0]);
+				received[c]++;
+				put_buf(&pipes[c], h);
+			}
+		}
+		usleep(1000);
+	}
+
+	return NULL;
+}
+
+static void start_cams(int timing, int fps)
+{
+	int c;
+
+	vid_init();
+	for (c = 0; c < N_CAMS; c++) {
+		struct context* ctxt = &ctxts[c];
+
+		memset(ctxt, 0, sizeof(*ctxt));
+		ctxt->conf.v4l2_palette = 8;
+		ctxt->conf.width = W;
+		ctxt->conf.height = H;
+		ctxt->conf.video_device = paths[c];
+		ctxt->conf.io_method = c & 1 ? IO_METHOD_MMAP : IO_METHOD_MMAP_ZC;
+		ctxt->conf.passthrough = 1;
+		ctxt->conf.replay_timing = timing;
+		ctxt->conf.frame_limit = fps;
+		assert(vid_v4l2_start(ctxt) >= 0);
+		assert(!init_pipe_pool(&pipes[c], 8, 8, FRAME_SZ));
+	}
+}
+
+static void stop_cams(void)
+{
+	int c;
+
+	for (c = 0; c < N_CAMS; c++) {
+		vid_close(&ctxts[c]);
+		close_pipe(&pipes[c]);
+	}
+	vid_cleanup();
+}
+
+static double ms_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+	struct capture cap;
+	struct capture_stats st;
+	struct timespec t;
+	pthread_t thread;
+	int c, total;
+
+	write_files();
+
+	// 8 cameras at 200 fps on 2 threads, each one on time
+	start_cams(REPLAY_FIXED, 200);
+	for (c = 0; c < N_CAMS; c++)
+		ids[c] = attach_dst(&pipes[c], PIPE_DROP_NEWEST);
+	assert(!init_capture(&cap, 2, 1));
+	for (c = 0; c < N_CAMS; c++)
+		assert(capture_add(&cap, &ctxts[c], &pipes[c]) == c);
+	assert(!pthread_create(&thread, NULL, consumer, NULL));
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	assert(!capture_start(&cap));
+	while (capture_running(&cap))
+		usleep(1000);
+	printf("%d cameras of %d frames at 200 fps in %.1f ms\n", N_CAMS,
+		N_FRAMES, ms_since(&t));
+	// one after the other would take N_CAMS times as long
+	assert(ms_since(&t) < N_FRAMES * 5 * 3);
+
+	usleep(20000);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	for (c = 0; c < N_CAMS; c++) {
+		capture_stats(&cap, c, &st);
+		printf("  camera %d: %u frames, %u drops, %u skipped, %d received\n",
+			c, st.frames, st.drops, st.skipped, received[c]);
+		assert(st.done);
+		assert(st.frames + st.drops + st.skipped <= N_FRAMES);
+		assert(st.frames > N_FRAMES / 2);
+		assert(received[c] > 0 && received[c] <= (int)st.frames);
+	}
+	close_capture(&cap);
+	stop_cams();
+
+	// as fast as they go, nobody attached
+	start_cams(REPLAY_FAST, 0);
+	assert(!init_capture(&cap, 0, 0));
+	for (c = 0; c < N_CAMS; c++)
+		assert(capture_add(&cap, &ctxts[c], &pipes[c]) == c);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	assert(!capture_start(&cap));
+	while (capture_running(&cap))
+		usleep(100);
+	for (total = c = 0; c < N_CAMS; c++) {
+		capture_stats(&cap, c, &st);
+		assert(st.frames == N_FRAMES && !st.drops && !st.skipped);
+		total += st.frames;
+	}
+	printf("%d frames as fast as possible in %.1f ms\n", total,
+		ms_since(&t));
+	close_capture(&cap);
+	stop_cams();
+
+	for (c = 0; c < N_CAMS; c++)
+		unlink(paths[c] + 5);
+	printf("capture ok\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,40 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+// many cameras captured by a few threads instead of a thread blocked on
+// each. devices are switched to non-blocking (vid_nonblock) and shared
+// out over n loops, each waiting on its own with epoll, and every camera
+// goes into its own pipe like the capture loop of main.c does (zero-copy
+// or copied, MJPEG is decoded on the loop)
+
+struct context;
+struct pipe;
+
+struct capture {
+	void* priv; //a hidden datastructure
+};
+
+struct capture_stats {
+	unsigned int frames;  // pushed
+	unsigned int drops;   // gaps in the driver sequence
+	unsigned int skipped; // dequeued but no pipe buffer was free
+	int done;             // end of a file or a device error
+};
+
+// all return values are 0 if success
+
+int  init_capture(struct capture* c, int n_loops, int pin);
+	// n_loops threads (0 for one per core), each pinned to a core of its
+	// own if pin
+int  capture_add(struct capture* c, struct context* ctxt, struct pipe* p);
+	// a device started with vid_v4l2_start (conf.io_method 0 or 1),
+	// frames go into p. before capture_start, returns the camera number
+	// or -1
+int  capture_start(struct capture* c);
+int  capture_running(struct capture* c);
+	// cameras not done
+void capture_stats(struct capture* c, int cam, struct capture_stats* st);
+void close_capture(struct capture* c);
+	// stops the loops, devices are left to vid_close
+
+#endif
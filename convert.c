@@ -0,0 +1,2336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "pipe.h"
+#include "tpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+
+// coefficients of the old float converter in Q12, applied to
+// (c - 128) << 6 with a 16 bit multiply-high, so every term comes out
+// in Q2 and the SIMD kernels can do exactly the same arithmetic
+#define CR_V 5614 // 1.370705
+#define CG_V 2859 // 0.698001
+#define CG_U 1383 // 0.337633
+#define CB_U 7096 // 1.732446
+
+#define clamp(v, m, M) \
+	(((v) > (M)) ? (M) : ((v) < (m) ? (m) : (v)))
+
+// what _mm_mulhi_epi16 does
+static inline int mulhi(int a, int b)
+{
+	return (a * b) >> 16;
+}
+
+// frames of at least pool_pixels are converted in bands of rows across
+// pool (convert_pool), bands start on a multiple of align (even rows at
+// least) so no output row is written by two threads. every conversion
+// is fn(arg, h0, h1) over its rows for that
+static struct tpool* pool;
+static int pool_pixels;
+
+static void bands(int width, int height, int align,
+	void (*fn)(void* arg, int h0, int h1), void* arg)
+{
+	struct tpool* tp = __atomic_load_n(&pool, __ATOMIC_ACQUIRE);
+
+	if (tp && width * height >= __atomic_load_n(&pool_pixels, 
+			__ATOMIC_RELAXED))
+		tpool_bands(tp, height, align, fn, arg);
+	else
+		fn(arg, 0, height);
+}
+
+void convert_pool(struct tpool* tp, int min_pixels)
+{
+	__atomic_store_n(&pool_pixels, min_pixels > 0 ? min_pixels : 
+		CONVERT_POOL_PIXELS, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool, tp, __ATOMIC_RELEASE);
+}
+
+// one pair of rows sharing a chroma row, from pixel x on. y1/d1 may be
+// y0/d0 for the last row of an odd height
+typedef int (*row2_fn)(const unsigned char* y0, const unsigned char* y1,
+	const unsigned char* u, const unsigned char* v,
+	unsigned char* d0, unsigned char* d1, int x, int width);
+
+static int row2_bgra_c(const unsigned char* y0, const unsigned char* y1,
+	const unsigned char* u, const unsigned char* v,
+	unsigned char* d0, unsigned char* d1, int x, int width)
+{
+	for (; x < width; x++) {
+		int du = (u[x / 2] - 128) << 6;
+		int dv = (v[x / 2] - 128) << 6;
+		int r = mulhi(dv, CR_V);
+		int g = mulhi(du, CG_U) + mulhi(dv, CG_V);
+		int b = mulhi(du, CB_U);
+		int y;
+
+		y = (y0[x] << 2) + 2;
+		d0[x * 4 + 0] = clamp((y + b) >> 2, 0, 255);
+		d0[x * 4 + 1] = clamp((y - g) >> 2, 0, 255);
+		d0[x * 4 + 2] = clamp((y + r) >> 2, 0, 255);
+		d0[x * 4 + 3] = 255;
+
+		y = (y1[x] << 2) + 2;
+		d1[x * 4 + 0] = clamp((y + b) >> 2, 0, 255);
+		d1[x * 4 + 1] = clamp((y - g) >> 2, 0, 255);
+		d1[x * 4 + 2] = clamp((y + r) >> 2, 0, 255);
+		d1[x * 4 + 3] = 255;
+	}
+
+	return x;
+}
+
+static void row2_bgr_c(const unsigned char* y0, const unsigned char* y1,
+	const unsigned char* u, const unsigned char* v,
+	unsigned char* d0, unsigned char* d1, int width)
+{
+	int x;
+
+	for (x = 0; x < width; x++) {
+		int du = (u[x / 2] - 128) << 6;
+		int dv = (v[x / 2] - 128) << 6;
+		int r = mulhi(dv, CR_V);
+		int g = mulhi(du, CG_U) + mulhi(dv, CG_V);
+		int b = mulhi(du, CB_U);
+		int y;
+
+		y = (y0[x] << 2) + 2;
+		d0[x * 3 + 0] = clamp((y + b) >> 2, 0, 255);
+		d0[x * 3 + 1] = clamp((y - g) >> 2, 0, 255);
+		d0[x * 3 + 2] = clamp((y + r) >> 2, 0, 255);
+
+		y = (y1[x] << 2) + 2;
+		d1[x * 3 + 0] = clamp((y + b) >> 2, 0, 255);
+		d1[x * 3 + 1] = clamp((y - g) >> 2, 0, 255);
+		d1[x * 3 + 2] = clamp((y + r) >> 2, 0, 255);
+	}
+}
+
+#ifdef CONVERT_X86
+
+// 16 pixels of one row, y4 is (y << 2) + 2 of pixels 0-7 and 8-15,
+// chroma terms already doubled up to one per pixel
+__attribute__((target("sse2")))
+static inline void bgra16_sse2(__m128i ylo, __m128i yhi,
+	__m128i rlo, __m128i rhi, __m128i glo, __m128i ghi,
+	__m128i blo, __m128i bhi, unsigned char* d)
+{
+	__m128i b = _mm_packus_epi16(
+		_mm_srai_epi16(_mm_add_epi16(ylo, blo), 2),
+		_mm_srai_epi16(_mm_add_epi16(yhi, bhi), 2));
+	__m128i g = _mm_packus_epi16(
+		_mm_srai_epi16(_mm_sub_epi16(ylo, glo), 2),
+		_mm_srai_epi16(_mm_sub_epi16(yhi, ghi), 2));
+	__m128i r = _mm_packus_epi16(
+		_mm_srai_epi16(_mm_add_epi16(ylo, rlo), 2),
+		_mm_srai_epi16(_mm_add_epi16(yhi, rhi), 2));
+	__m128i a = _mm_set1_epi8((char)0xff);
+	__m128i bg_lo = _mm_unpacklo_epi8(b, g), bg_hi = _mm_unpackhi_epi8(b, g);
+	__m128i ra_lo = _mm_unpacklo_epi8(r, a), ra_hi = _mm_unpackhi_epi8(r, a);
+
+	_mm_storeu_si128((__m128i*)(d +  0), _mm_unpacklo_epi16(bg_lo, ra_lo));
+	_mm_storeu_si128((__m128i*)(d + 16), _mm_unpackhi_epi16(bg_lo, ra_lo));
+	_mm_storeu_si128((__m128i*)(d + 32), _mm_unpacklo_epi16(bg_hi, ra_hi));
+	_mm_storeu_si128((__m128i*)(d + 48), _mm_unpackhi_epi16(bg_hi, ra_hi));
+}
+
+__attribute__((target("sse2")))
+static inline void y4_sse2(const unsigned char* y, __m128i* lo, __m128i* hi)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i two = _mm_set1_epi16(2);
+	__m128i v = _mm_loadu_si128((const __m128i*)y);
+
+	*lo = _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(v, zero), 2), two);
+	*hi = _mm_add_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(v, zero), 2), two);
+}
+
+__attribute__((target("sse2")))
+static int row2_bgra_sse2(const unsigned char* y0, const unsigned char* y1,
+	const unsigned char* u, const unsigned char* v,
+	unsigned char* d0, unsigned char* d1, int x, int width)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i c128 = _mm_set1_epi16(128);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i du = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i*)(u + x / 2)), zero), c128), 6);
+		__m128i dv = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i*)(v + x / 2)), zero), c128), 6);
+		__m128i r = _mm_mulhi_epi16(dv, _mm_set1_epi16(CR_V));
+		__m128i g = _mm_add_epi16(_mm_mulhi_epi16(du, _mm_set1_epi16(CG_U)),
+			_mm_mulhi_epi16(dv, _mm_set1_epi16(CG_V)));
+		__m128i b = _mm_mulhi_epi16(du, _mm_set1_epi16(CB_U));
+		__m128i rlo = _mm_unpacklo_epi16(r, r), rhi = _mm_unpackhi_epi16(r, r);
+		__m128i glo = _mm_unpacklo_epi16(g, g), ghi = _mm_unpackhi_epi16(g, g);
+		__m128i blo = _mm_unpacklo_epi16(b, b), bhi = _mm_unpackhi_epi16(b, b);
+		__m128i ylo, yhi;
+
+		y4_sse2(y0 + x, &ylo, &yhi);
+		bgra16_sse2(ylo, yhi, rlo, rhi, glo, ghi, blo, bhi, d0 + x * 4);
+		y4_sse2(y1 + x, &ylo, &yhi);
+		bgra16_sse2(ylo, yhi, rlo, rhi, glo, ghi, blo, bhi, d1 + x * 4);
+	}
+
+	return x;
+}
+
+// 32 pixels of one row, same as bgra16_sse2 but the 128 bit lanes of
+// pack and unpack need sorting out at the end
+__attribute__((target("avx2")))
+static inline void bgra32_avx2(const unsigned char* py,
+	__m256i r0, __m256i r1, __m256i g0, __m256i g1,
+	__m256i b0, __m256i b1, unsigned char* d)
+{
+	__m256i two = _mm256_set1_epi16(2);
+	__m256i y0 = _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(
+		_mm_loadu_si128((const __m128i*)py)), 2), two);
+	__m256i y1 = _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(
+		_mm_loadu_si128((const __m128i*)(py + 16))), 2), two);
+
+	// packing leaves pixels 0-7 16-23 | 8-15 24-31
+	__m256i b = _mm256_packus_epi16(
+		_mm256_srai_epi16(_mm256_add_epi16(y0, b0), 2),
+		_mm256_srai_epi16(_mm256_add_epi16(y1, b1), 2));
+	__m256i g = _mm256_packus_epi16(
+		_mm256_srai_epi16(_mm256_sub_epi16(y0, g0), 2),
+		_mm256_srai_epi16(_mm256_sub_epi16(y1, g1), 2));
+	__m256i r = _mm256_packus_epi16(
+		_mm256_srai_epi16(_mm256_add_epi16(y0, r0), 2),
+		_mm256_srai_epi16(_mm256_add_epi16(y1, r1), 2));
+	__m256i a = _mm256_set1_epi8((char)0xff);
+	__m256i bg_lo = _mm256_unpacklo_epi8(b, g), bg_hi = _mm256_unpackhi_epi8(b, g);
+	__m256i ra_lo = _mm256_unpacklo_epi8(r, a), ra_hi = _mm256_unpackhi_epi8(r, a);
+
+	// pixels 0-3 | 8-11, 4-7 | 12-15, 16-19 | 24-27, 20-23 | 28-31
+	__m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+	__m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+	__m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+	__m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+
+	_mm256_storeu_si256((__m256i*)(d +  0), _mm256_permute2x128_si256(p0, p1, 0x20));
+	_mm256_storeu_si256((__m256i*)(d + 32), _mm256_permute2x128_si256(p0, p1, 0x31));
+	_mm256_storeu_si256((__m256i*)(d + 64), _mm256_permute2x128_si256(p2, p3, 0x20));
+	_mm256_storeu_si256((__m256i*)(d + 96), _mm256_permute2x128_si256(p2, p3, 0x31));
+}
+
+// doubles every chroma term, pixels 0-15 and 16-31
+__attribute__((target("avx2")))
+static inline void dup32_avx2(__m256i c, __m256i* c0, __m256i* c1)
+{
+	__m256i lo = _mm256_unpacklo_epi16(c, c); // 0-7 | 16-23
+	__m256i hi = _mm256_unpackhi_epi16(c, c); // 8-15 | 24-31
+
+	*c0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+	*c1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+}
+
+__attribute__((target("avx2")))
+static int row2_bgra_avx2(const unsigned char* y0, const unsigned char* y1,
+	const unsigned char* u, const unsigned char* v,
+	unsigned char* d0, unsigned char* d1, int x, int width)
+{
+	__m256i c128 = _mm256_set1_epi16(128);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i du = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i*)(u + x / 2))), c128), 6);
+		__m256i dv = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i*)(v + x / 2))), c128), 6);
+		__m256i r0, r1, g0, g1, b0, b1;
+
+		dup32_avx2(_mm256_mulhi_epi16(dv, _mm256_set1_epi16(CR_V)), &r0, &r1);
+		dup32_avx2(_mm256_add_epi16(
+			_mm256_mulhi_epi16(du, _mm256_set1_epi16(CG_U)),
+			_mm256_mulhi_epi16(dv, _mm256_set1_epi16(CG_V))), &g0, &g1);
+		dup32_avx2(_mm256_mulhi_epi16(du, _mm256_set1_epi16(CB_U)), &b0, &b1);
+
+		bgra32_avx2(y0 + x, r0, r1, g0, g1, b0, b1, d0 + x * 4);
+		bgra32_avx2(y1 + x, r0, r1, g0, g1, b0, b1, d1 + x * 4);
+	}
+
+	// less than 32 left, maybe 16
+	return row2_bgra_sse2(y0, y1, u, v, d0, d1, x, width);
+}
+
+#endif
+
+// -----
+
+static row2_fn row2_bgra;
+static const char* row2_bgra_name;
+
+static row2_fn pick_bgra(void)
+{
+	row2_fn fn = __atomic_load_n(&row2_bgra, __ATOMIC_ACQUIRE);
+	const char* name = "c";
+
+	if (fn)
+		return fn;
+
+	fn = row2_bgra_c;
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = row2_bgra_avx2;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		fn = row2_bgra_sse2;
+		name = "sse2";
+	}
+#endif
+	// every thread picks the same, no harm if several do
+	__atomic_store_n(&row2_bgra_name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&row2_bgra, fn, __ATOMIC_RELEASE);
+
+	return fn;
+}
+
+struct yuv420_job {
+	row2_fn fn;
+	const unsigned char* yuv;
+	unsigned char* rgb;
+	int width;
+	int height;
+};
+
+static void bgra_band(void* arg, int h0, int h1)
+{
+	struct yuv420_job* j = (struct yuv420_job*)arg;
+	row2_fn fn = j->fn;
+	unsigned char* rgb = j->rgb;
+	int width = j->width, height = j->height;
+	const unsigned char* y = j->yuv;
+	const unsigned char* u = y + (width * height);
+	const unsigned char* v = u + ((width / 2) * (height / 2));
+	int h;
+
+	for (h = h0; h < h1; h += 2) {
+		const unsigned char* y0 = y + h * width;
+		const unsigned char* y1 = h + 1 < height ? y0 + width : y0;
+		unsigned char* d0 = rgb + h * width * 4;
+		unsigned char* d1 = h + 1 < height ? d0 + width * 4 : d0;
+		int x;
+
+		x = fn(y0, y1, u + (h / 2) * (width / 2), v + (h / 2) * (width / 2),
+			d0, d1, 0, width);
+		// odd tail
+		row2_bgra_c(y0, y1, u + (h / 2) * (width / 2),
+			v + (h / 2) * (width / 2), d0, d1, x, width);
+	}
+}
+
+static void yuv420_bgra(row2_fn fn, const unsigned char* yuv,
+	unsigned char* rgb, int width, int height)
+{
+	struct yuv420_job j = { fn, yuv, rgb, width, height };
+
+	bands(width, height, 2, bgra_band, &j);
+}
+
+void convert_yuv420_bgra8888(const unsigned char* yuv, unsigned char* rgb,
+	int width, int height)
+{
+	yuv420_bgra(pick_bgra(), yuv, rgb, width, height);
+}
+
+static void bgr_band(void* arg, int h0, int h1)
+{
+	struct yuv420_job* j = (struct yuv420_job*)arg;
+	unsigned char* rgb = j->rgb;
+	int width = j->width, height = j->height;
+	const unsigned char* y = j->yuv;
+	const unsigned char* u = y + (width * height);
+	const unsigned char* v = u + ((width / 2) * (height / 2));
+	int h;
+
+	for (h = h0; h < h1; h += 2) {
+		const unsigned char* y0 = y + h * width;
+		const unsigned char* y1 = h + 1 < height ? y0 + width : y0;
+		unsigned char* d0 = rgb + h * width * 3;
+		unsigned char* d1 = h + 1 < height ? d0 + width * 3 : d0;
+
+		row2_bgr_c(y0, y1, u + (h / 2) * (width / 2),
+			v + (h / 2) * (width / 2), d0, d1, width);
+	}
+}
+
+void convert_yuv420_bgr888(const unsigned char* yuv, unsigned char* rgb,
+	int width, int height)
+{
+	struct yuv420_job j = { NULL, yuv, rgb, width, height };
+
+	bands(width, height, 2, bgr_band, &j);
+}
+
+const char* convert_kernel(void)
+{
+	pick_bgra();
+	return __atomic_load_n(&row2_bgra_name, __ATOMIC_RELAXED);
+}
+
+// -----
+
+// raw bayer BGGR (rows B G B G .. / G R G R ..) to YUV420P in one pass,
+// bilinear. a pair of bayer rows gives two Y rows and one chroma row,
+// the rows above and below come in as pointers so the first and last
+// pair just get mirrored ones, and only the first and last 2x2 block of
+// a pair need mirrored columns. Y is the old rgb24 converter in Q15,
+// chroma is taken once from the sum of the 4 pixels of a block
+
+#define BY_R 9796
+#define BY_G 19235
+#define BY_B 3736
+#define BU_R -4784
+#define BU_G -9437
+#define BU_B 14221
+#define BV_R 20218
+#define BV_G -16941
+#define BV_B -3277
+
+typedef int (*bggr_fn)(const unsigned char* up, const unsigned char* a,
+	const unsigned char* b, const unsigned char* dn,
+	unsigned char* ya, unsigned char* yb, unsigned char* u, unsigned char* v,
+	int x, int width);
+
+// the block at columns x, x + 1 of rows a (B G) and b (G R), xm is the
+// column left of it and xp the one right of it
+static inline void bggr_block(const unsigned char* up,
+	const unsigned char* a, const unsigned char* b, const unsigned char* dn,
+	int x, int xm, int xp,
+	unsigned char* ya, unsigned char* yb, unsigned char* u, unsigned char* v)
+{
+	int b0 = a[x];
+	int g0 = (a[xm] + a[x + 1] + up[x] + b[x]) >> 2;
+	int r0 = (up[xm] + up[x + 1] + b[xm] + b[x + 1]) >> 2;
+	int b1 = (a[x] + a[xp]) >> 1;
+	int g1 = a[x + 1];
+	int r1 = (up[x + 1] + b[x + 1]) >> 1;
+	int b2 = (a[x] + dn[x]) >> 1;
+	int g2 = b[x];
+	int r2 = (b[xm] + b[x + 1]) >> 1;
+	int b3 = (a[x] + a[xp] + dn[x] + dn[xp]) >> 2;
+	int g3 = (b[x] + b[xp] + a[x + 1] + dn[x + 1]) >> 2;
+	int r3 = b[x + 1];
+	int sr = r0 + r1 + r2 + r3, sg = g0 + g1 + g2 + g3, sb = b0 + b1 + b2 + b3;
+	int c;
+
+	ya[x]     = (BY_R * r0 + BY_G * g0 + BY_B * b0) >> 15;
+	ya[x + 1] = (BY_R * r1 + BY_G * g1 + BY_B * b1) >> 15;
+	yb[x]     = (BY_R * r2 + BY_G * g2 + BY_B * b2) >> 15;
+	yb[x + 1] = (BY_R * r3 + BY_G * g3 + BY_B * b3) >> 15;
+
+	c = ((BU_R * sr + BU_G * sg + BU_B * sb) >> 17) + 128;
+	u[x / 2] = clamp(c, 0, 255);
+	c = ((BV_R * sr + BV_G * sg + BV_B * sb) >> 17) + 128;
+	v[x / 2] = clamp(c, 0, 255);
+}
+
+// blocks from x on that have both neighbour columns
+static int bggr_row2_c(const unsigned char* up, const unsigned char* a,
+	const unsigned char* b, const unsigned char* dn,
+	unsigned char* ya, unsigned char* yb, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	for (; x + 2 < width; x += 2)
+		bggr_block(up, a, b, dn, x, x - 1, x + 2, ya, yb, u, v);
+
+	return x;
+}
+
+#ifdef CONVERT_X86
+
+// Y of 8 pixels, r g b in 16 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i bggr_y_sse2(__m128i r, __m128i g, __m128i b)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i crg = _mm_set1_epi32((BY_G << 16) | BY_R);
+	__m128i cb = _mm_set1_epi32(BY_B);
+	__m128i lo = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpacklo_epi16(r, g), crg),
+		_mm_madd_epi16(_mm_unpacklo_epi16(b, zero), cb));
+	__m128i hi = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpackhi_epi16(r, g), crg),
+		_mm_madd_epi16(_mm_unpackhi_epi16(b, zero), cb));
+
+	return _mm_packs_epi32(_mm_srai_epi32(lo, 15), _mm_srai_epi32(hi, 15));
+}
+
+// U or V of 8 blocks from the sums of their pixels, stored as 8 bytes
+__attribute__((target("sse2")))
+static inline void bggr_c_sse2(__m128i sr, __m128i sg, __m128i sb,
+	int cr, int cg, int cb, unsigned char* d)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i crg = _mm_set1_epi32((int)(((unsigned)cg << 16) | (cr & 0xffff)));
+	__m128i cb_ = _mm_set1_epi32(cb & 0xffff);
+	__m128i lo = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpacklo_epi16(sr, sg), crg),
+		_mm_madd_epi16(_mm_unpacklo_epi16(sb, zero), cb_));
+	__m128i hi = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpackhi_epi16(sr, sg), crg),
+		_mm_madd_epi16(_mm_unpackhi_epi16(sb, zero), cb_));
+	__m128i c = _mm_add_epi16(_mm_packs_epi32(_mm_srai_epi32(lo, 17),
+		_mm_srai_epi32(hi, 17)), _mm_set1_epi16(128));
+
+	_mm_storel_epi64((__m128i*)d, _mm_packus_epi16(c, c));
+}
+
+// 8 blocks (16 columns) at a time, even columns of a load in the low
+// byte of each 16 bit lane and odd ones in the high byte
+__attribute__((target("sse2")))
+static int bggr_row2_sse2(const unsigned char* up, const unsigned char* a,
+	const unsigned char* b, const unsigned char* dn,
+	unsigned char* ya, unsigned char* yb, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	__m128i lob = _mm_set1_epi16(0xff);
+
+	#define EV(p) _mm_and_si128(_mm_loadu_si128((const __m128i*)(p)), lob)
+	#define OD(p) _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(p)), 8)
+	#define AVG2(p, q) _mm_srli_epi16(_mm_add_epi16(p, q), 1)
+	#define AVG4(p, q, r, s) _mm_srli_epi16(_mm_add_epi16( \
+		_mm_add_epi16(p, q), _mm_add_epi16(r, s)), 2)
+
+	// the rightmost block needs column x + 16
+	for (; x + 17 <= width; x += 16) {
+		__m128i a0 = EV(a + x), a1 = OD(a + x);
+		__m128i am = EV(a + x - 1), ap = OD(a + x + 1);
+		__m128i u0 = EV(up + x), u1 = OD(up + x), um = EV(up + x - 1);
+		__m128i b0 = EV(b + x), b1 = OD(b + x);
+		__m128i bm = EV(b + x - 1), bp = OD(b + x + 1);
+		__m128i d0 = EV(dn + x), d1 = OD(dn + x), dp = OD(dn + x + 1);
+
+		__m128i pb0 = a0;
+		__m128i pg0 = AVG4(am, a1, u0, b0);
+		__m128i pr0 = AVG4(um, u1, bm, b1);
+		__m128i pb1 = AVG2(a0, ap);
+		__m128i pg1 = a1;
+		__m128i pr1 = AVG2(u1, b1);
+		__m128i pb2 = AVG2(a0, d0);
+		__m128i pg2 = b0;
+		__m128i pr2 = AVG2(bm, b1);
+		__m128i pb3 = AVG4(a0, ap, d0, dp);
+		__m128i pg3 = AVG4(b0, bp, a1, d1);
+		__m128i pr3 = b1;
+
+		__m128i sr = _mm_add_epi16(_mm_add_epi16(pr0, pr1),
+			_mm_add_epi16(pr2, pr3));
+		__m128i sg = _mm_add_epi16(_mm_add_epi16(pg0, pg1),
+			_mm_add_epi16(pg2, pg3));
+		__m128i sb = _mm_add_epi16(_mm_add_epi16(pb0, pb1),
+			_mm_add_epi16(pb2, pb3));
+
+		_mm_storeu_si128((__m128i*)(ya + x), _mm_or_si128(
+			bggr_y_sse2(pr0, pg0, pb0),
+			_mm_slli_epi16(bggr_y_sse2(pr1, pg1, pb1), 8)));
+		_mm_storeu_si128((__m128i*)(yb + x), _mm_or_si128(
+			bggr_y_sse2(pr2, pg2, pb2),
+			_mm_slli_epi16(bggr_y_sse2(pr3, pg3, pb3), 8)));
+		bggr_c_sse2(sr, sg, sb, BU_R, BU_G, BU_B, u + x / 2);
+		bggr_c_sse2(sr, sg, sb, BV_R, BV_G, BV_B, v + x / 2);
+	}
+
+	#undef EV
+	#undef OD
+	#undef AVG2
+	#undef AVG4
+
+	return x;
+}
+
+#endif
+
+static bggr_fn pick_bggr(void)
+{
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		return bggr_row2_sse2;
+#endif
+	return bggr_row2_c;
+}
+
+// the pair of bayer rows starting at row h
+static void bggr_rows(bggr_fn fn, const unsigned char* raw, int stride,
+	int width, int height, int h, unsigned char* ya, unsigned char* yb,
+	unsigned char* u, unsigned char* v)
+{
+	const unsigned char* a = raw + h * stride;
+	const unsigned char* b = a + stride;
+	// row -1 is row 1, row height is row height - 2
+	const unsigned char* up = h ? a - stride : b;
+	const unsigned char* dn = h + 2 < height ? b + stride : a;
+	int x;
+
+	// column -1 is column 1, column width is column width - 2
+	bggr_block(up, a, b, dn, 0, 1, width > 2 ? 2 : 0, ya, yb, u, v);
+	if (width <= 2)
+		return;
+	x = fn(up, a, b, dn, ya, yb, u, v, 2, width);
+	x = bggr_row2_c(up, a, b, dn, ya, yb, u, v, x, width);
+	bggr_block(up, a, b, dn, x, x - 1, x, ya, yb, u, v);
+}
+
+struct bggr_job {
+	bggr_fn fn;
+	const unsigned char* raw;
+	unsigned char* yuv;
+	int width;
+	int height;
+};
+
+static void bggr_band(void* arg, int h0, int h1)
+{
+	struct bggr_job* j = (struct bggr_job*)arg;
+	int width = j->width, height = j->height;
+	unsigned char* y = j->yuv;
+	unsigned char* u = y + (width * height);
+	unsigned char* v = u + ((width / 2) * (height / 2));
+	int h;
+
+	for (h = h0; h < h1; h += 2)
+		bggr_rows(j->fn, j->raw, width, width, height, h, y + h * width,
+			y + (h + 1) * width, u + (h / 2) * (width / 2),
+			v + (h / 2) * (width / 2));
+}
+
+static void bggr_yuv420(bggr_fn fn, const unsigned char* raw,
+	unsigned char* yuv, int width, int height)
+{
+	struct bggr_job j = { fn, raw, yuv, width, height };
+
+	bands(width, height, 2, bggr_band, &j);
+}
+
+void convert_bggr8_yuv420(const unsigned char* raw, unsigned char* yuv,
+	int width, int height)
+{
+	bggr_yuv420(pick_bggr(), raw, yuv, width, height);
+}
+
+// -----
+
+// packed B, G, R to YUV420P, what conv_rgb24toyuv420p of video2.c did.
+// chroma is the sum of the 4 pixels of a block, each term shifted down
+// on its own as before so the output doesn't change
+
+struct bgr24_job {
+	const unsigned char* bgr;
+	unsigned char* yuv;
+	int width;
+	int height;
+};
+
+static void bgr24_band(void* arg, int h0, int h1)
+{
+	struct bgr24_job* j = (struct bgr24_job*)arg;
+	int width = j->width, height = j->height;
+	unsigned char* y = j->yuv;
+	unsigned char* u = y + width * height;
+	unsigned char* v = u + (width * height) / 4;
+	int h, x;
+
+	for (h = h0; h < h1; h++) {
+		const unsigned char* s = j->bgr + h * width * 3;
+		unsigned char* yy = y + h * width;
+		unsigned char* uu = u + (h / 2) * (width / 2);
+		unsigned char* vv = v + (h / 2) * (width / 2);
+
+		if (!(h & 1)) {
+			memset(uu, 0, width / 2);
+			memset(vv, 0, width / 2);
+		}
+
+		for (x = 0; x < width; x += 2, s += 6) {
+			int b = s[0], g = s[1], r = s[2];
+			int b1 = s[3], g1 = s[4], r1 = s[5];
+
+			yy[x] = (BY_R * r + BY_G * g + BY_B * b) >> 15;
+			yy[x + 1] = (BY_R * r1 + BY_G * g1 + BY_B * b1) >> 15;
+			uu[x / 2] += ((BU_R * r + BU_G * g + BU_B * b) >> 17) + 32 +
+				((BU_R * r1 + BU_G * g1 + BU_B * b1) >> 17) + 32;
+			vv[x / 2] += ((BV_R * r + BV_G * g + BV_B * b) >> 17) + 32 +
+				((BV_R * r1 + BV_G * g1 + BV_B * b1) >> 17) + 32;
+		}
+	}
+}
+
+void convert_bgr24_yuv420(const unsigned char* bgr, unsigned char* yuv,
+	int width, int height)
+{
+	struct bgr24_job j = { bgr, yuv, width, height };
+
+	bands(width, height, 2, bgr24_band, &j);
+}
+
+// -----
+
+// packed 4:2:2 (YUYV 'YUYV' or UYVY 'UYVY') and planar 4:2:2 ('422P')
+// to YUV420P. Y is copied, chroma of two rows is averaged, rounding
+// down like the old converters
+
+// one pair of rows from pixel x on, s0/s1 are the source rows
+typedef int (*packed_fn)(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width);
+
+// yo is where Y sits in a pixel pair, 0 for YUYV and 1 for UYVY
+static inline int packed2_c(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width, int yo)
+{
+	int co = 1 - yo;
+
+	for (; x + 2 <= width; x += 2) {
+		const unsigned char* p0 = s0 + x * 2;
+		const unsigned char* p1 = s1 + x * 2;
+
+		y0[x] = p0[yo];
+		y0[x + 1] = p0[yo + 2];
+		y1[x] = p1[yo];
+		y1[x + 1] = p1[yo + 2];
+		u[x / 2] = (p0[co] + p1[co]) >> 1;
+		v[x / 2] = (p0[co + 2] + p1[co + 2]) >> 1;
+	}
+
+	return x;
+}
+
+static int yuyv2_c(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_c(s0, s1, y0, y1, u, v, x, width, 0);
+}
+
+static int uyvy2_c(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_c(s0, s1, y0, y1, u, v, x, width, 1);
+}
+
+#ifdef CONVERT_X86
+
+// (a + b) >> 1 per byte, _mm_avg_epu8 rounds up
+__attribute__((target("sse2")))
+static inline __m128i avg_down_sse2(__m128i a, __m128i b)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b),
+		_mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+// 16 pixels, even bytes of 32 and odd bytes of 32
+__attribute__((target("sse2")))
+static inline void split16_sse2(const unsigned char* s, __m128i* ev,
+	__m128i* od)
+{
+	__m128i lob = _mm_set1_epi16(0xff);
+	__m128i p0 = _mm_loadu_si128((const __m128i*)s);
+	__m128i p1 = _mm_loadu_si128((const __m128i*)(s + 16));
+
+	*ev = _mm_packus_epi16(_mm_and_si128(p0, lob), _mm_and_si128(p1, lob));
+	*od = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+}
+
+__attribute__((target("sse2")))
+static inline int packed2_sse2(const unsigned char* s0,
+	const unsigned char* s1, unsigned char* y0, unsigned char* y1,
+	unsigned char* u, unsigned char* v, int x, int width, int yo)
+{
+	__m128i lob = _mm_set1_epi16(0xff);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i e0, o0, e1, o1, c;
+
+		split16_sse2(s0 + x * 2, &e0, &o0);
+		split16_sse2(s1 + x * 2, &e1, &o1);
+		_mm_storeu_si128((__m128i*)(y0 + x), yo ? o0 : e0);
+		_mm_storeu_si128((__m128i*)(y1 + x), yo ? o1 : e1);
+
+		// U V U V ..
+		c = yo ? avg_down_sse2(e0, e1) : avg_down_sse2(o0, o1);
+		_mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(
+			_mm_and_si128(c, lob), lob));
+		_mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(
+			_mm_srli_epi16(c, 8), lob));
+	}
+
+	return x;
+}
+
+__attribute__((target("sse2")))
+static int yuyv2_sse2(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_sse2(s0, s1, y0, y1, u, v, x, width, 0);
+}
+
+__attribute__((target("sse2")))
+static int uyvy2_sse2(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_sse2(s0, s1, y0, y1, u, v, x, width, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avg_down_avx2(__m256i a, __m256i b)
+{
+	return _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+		_mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+// 32 pixels, packing works per 128 bit lane so the quadwords need
+// putting back in order
+__attribute__((target("avx2")))
+static inline void split32_avx2(const unsigned char* s, __m256i* ev,
+	__m256i* od)
+{
+	__m256i lob = _mm256_set1_epi16(0xff);
+	__m256i p0 = _mm256_loadu_si256((const __m256i*)s);
+	__m256i p1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+
+	*ev = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+		_mm256_and_si256(p0, lob), _mm256_and_si256(p1, lob)), 0xd8);
+	*od = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+		_mm256_srli_epi16(p0, 8), _mm256_srli_epi16(p1, 8)), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline int packed2_avx2(const unsigned char* s0,
+	const unsigned char* s1, unsigned char* y0, unsigned char* y1,
+	unsigned char* u, unsigned char* v, int x, int width, int yo)
+{
+	__m256i lob = _mm256_set1_epi16(0xff);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i e0, o0, e1, o1, c;
+
+		split32_avx2(s0 + x * 2, &e0, &o0);
+		split32_avx2(s1 + x * 2, &e1, &o1);
+		_mm256_storeu_si256((__m256i*)(y0 + x), yo ? o0 : e0);
+		_mm256_storeu_si256((__m256i*)(y1 + x), yo ? o1 : e1);
+
+		// 16 U V pairs, packed to U 0-7 . | U 8-15 . before the permute
+		c = yo ? avg_down_avx2(e0, e1) : avg_down_avx2(o0, o1);
+		_mm_storeu_si128((__m128i*)(u + x / 2), _mm256_castsi256_si128(
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_and_si256(c, lob), lob), 0x08)));
+		_mm_storeu_si128((__m128i*)(v + x / 2), _mm256_castsi256_si128(
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_srli_epi16(c, 8), lob), 0x08)));
+	}
+
+	// less than 32 left, maybe 16
+	return packed2_sse2(s0, s1, y0, y1, u, v, x, width, yo);
+}
+
+__attribute__((target("avx2")))
+static int yuyv2_avx2(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_avx2(s0, s1, y0, y1, u, v, x, width, 0);
+}
+
+__attribute__((target("avx2")))
+static int uyvy2_avx2(const unsigned char* s0, const unsigned char* s1,
+	unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+	int x, int width)
+{
+	return packed2_avx2(s0, s1, y0, y1, u, v, x, width, 1);
+}
+
+// a chroma row of 422P from the two rows sharing it
+__attribute__((target("sse2")))
+static int avg_row_sse2(const unsigned char* c0, const unsigned char* c1,
+	unsigned char* d, int x, int n)
+{
+	for (; x + 16 <= n; x += 16)
+		_mm_storeu_si128((__m128i*)(d + x), avg_down_sse2(
+			_mm_loadu_si128((const __m128i*)(c0 + x)),
+			_mm_loadu_si128((const __m128i*)(c1 + x))));
+
+	return x;
+}
+
+#endif
+
+static int avg_row_c(const unsigned char* c0, const unsigned char* c1,
+	unsigned char* d, int x, int n)
+{
+	for (; x < n; x++)
+		d[x] = (c0[x] + c1[x]) >> 1;
+
+	return x;
+}
+
+typedef int (*avg_fn)(const unsigned char* c0, const unsigned char* c1,
+	unsigned char* d, int x, int n);
+
+static avg_fn pick_avg(void)
+{
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		return avg_row_sse2;
+#endif
+	return avg_row_c;
+}
+
+static packed_fn pick_packed(int uyvy)
+{
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return uyvy ? uyvy2_avx2 : yuyv2_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return uyvy ? uyvy2_sse2 : yuyv2_sse2;
+#endif
+	return uyvy ? uyvy2_c : yuyv2_c;
+}
+
+struct packed_job {
+	packed_fn fn;
+	packed_fn tail;
+	const unsigned char* src;
+	int stride;
+	unsigned char* yuv;
+	int width;
+	int height;
+};
+
+static void packed_band(void* arg, int h0, int h1)
+{
+	struct packed_job* j = (struct packed_job*)arg;
+	int width = j->width, height = j->height, stride = j->stride;
+	unsigned char* y = j->yuv;
+	unsigned char* u = y + (width * height);
+	unsigned char* v = u + ((width / 2) * (height / 2));
+	int h;
+
+	for (h = h0; h < h1; h += 2) {
+		const unsigned char* s0 = j->src + h * stride;
+		unsigned char* y0 = y + h * width;
+		unsigned char* uu = u + (h / 2) * (width / 2);
+		unsigned char* vv = v + (h / 2) * (width / 2);
+		int x;
+
+		x = j->fn(s0, s0 + stride, y0, y0 + width, uu, vv, 0, width);
+		j->tail(s0, s0 + stride, y0, y0 + width, uu, vv, x, width);
+	}
+}
+
+static void packed_yuv420(packed_fn fn, packed_fn tail,
+	const unsigned char* src, int stride, unsigned char* yuv,
+	int width, int height)
+{
+	struct packed_job j = { fn, tail, src, stride, yuv, width, height };
+
+	bands(width, height, 2, packed_band, &j);
+}
+
+void convert_yuyv_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height)
+{
+	packed_yuv420(pick_packed(0), yuyv2_c, src, stride ? stride : width * 2,
+		yuv, width, height);
+}
+
+void convert_uyvy_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height)
+{
+	packed_yuv420(pick_packed(1), uyvy2_c, src, stride ? stride : width * 2,
+		yuv, width, height);
+}
+
+struct p422_job {
+	avg_fn avg;
+	const unsigned char* src;
+	int stride;
+	unsigned char* yuv;
+	int width;
+	int height;
+};
+
+static void p422_band(void* arg, int h0, int h1)
+{
+	struct p422_job* j = (struct p422_job*)arg;
+	// planes follow each other, chroma lines are half as long
+	const unsigned char* src = j->src;
+	unsigned char* yuv = j->yuv;
+	int width = j->width, height = j->height, stride = j->stride;
+	int cs = stride / 2;
+	const unsigned char* su = src + stride * height;
+	const unsigned char* sv = su + cs * height;
+	unsigned char* u = yuv + (width * height);
+	unsigned char* v = u + ((width / 2) * (height / 2));
+	avg_fn avg_row = j->avg;
+	int h;
+
+	for (h = h0; h < h1; h++)
+		memcpy(yuv + h * width, src + h * stride, width);
+
+	for (h = h0; h < h1; h += 2) {
+		int x;
+
+		x = avg_row(su + h * cs, su + (h + 1) * cs, u + (h / 2) * (width / 2),
+			0, width / 2);
+		avg_row_c(su + h * cs, su + (h + 1) * cs, u + (h / 2) * (width / 2),
+			x, width / 2);
+		x = avg_row(sv + h * cs, sv + (h + 1) * cs, v + (h / 2) * (width / 2),
+			0, width / 2);
+		avg_row_c(sv + h * cs, sv + (h + 1) * cs, v + (h / 2) * (width / 2),
+			x, width / 2);
+	}
+}
+
+void convert_yuv422p_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height)
+{
+	struct p422_job j = { pick_avg(), src, stride ? stride : width, yuv, 
+		width, height };
+
+	bands(width, height, 2, p422_band, &j);
+}
+
+// -----
+
+// any source format to any destination format, a pair of rows at a time.
+// a reader hands out the two rows as YUV420P, pointing into the source
+// where it is laid out like that already and converting into a few rows
+// of scratch otherwise. a writer turns them into the destination, so
+// there is never a whole YUV420P frame in between
+
+struct rows {
+	const unsigned char* y0;
+	const unsigned char* y1;
+	const unsigned char* u;
+	const unsigned char* v;
+};
+
+// Y of two rows down to one row of half the width, each pixel the
+// rounded mean of a 2x2 block
+static int half_row_c(const unsigned char* y0, const unsigned char* y1,
+	unsigned char* d, int x, int n)
+{
+	for (; x < n; x++)
+		d[x] = (y0[x * 2] + y0[x * 2 + 1] + y1[x * 2] + y1[x * 2 + 1] + 2) >> 2;
+
+	return x;
+}
+
+#ifdef CONVERT_X86
+
+// sums of horizontal pairs of 16 pixels of both rows
+__attribute__((target("sse2")))
+static inline __m128i quad_sum_sse2(const unsigned char* y0,
+	const unsigned char* y1)
+{
+	__m128i lob = _mm_set1_epi16(0xff);
+	__m128i a = _mm_loadu_si128((const __m128i*)y0);
+	__m128i b = _mm_loadu_si128((const __m128i*)y1);
+
+	return _mm_add_epi16(
+		_mm_add_epi16(_mm_and_si128(a, lob), _mm_srli_epi16(a, 8)),
+		_mm_add_epi16(_mm_and_si128(b, lob), _mm_srli_epi16(b, 8)));
+}
+
+__attribute__((target("sse2")))
+static int half_row_sse2(const unsigned char* y0, const unsigned char* y1,
+	unsigned char* d, int x, int n)
+{
+	__m128i two = _mm_set1_epi16(2);
+
+	for (; x + 16 <= n; x += 16) {
+		__m128i lo = quad_sum_sse2(y0 + x * 2, y1 + x * 2);
+		__m128i hi = quad_sum_sse2(y0 + x * 2 + 16, y1 + x * 2 + 16);
+
+		_mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(
+			_mm_srli_epi16(_mm_add_epi16(lo, two), 2),
+			_mm_srli_epi16(_mm_add_epi16(hi, two), 2)));
+	}
+
+	return x;
+}
+
+#endif
+
+// kernels picked once per frame
+struct kernels {
+	row2_fn bgra;
+	packed_fn yuyv;
+	packed_fn uyvy;
+	bggr_fn bggr;
+	avg_fn avg;
+	avg_fn half;
+};
+
+// scratch is 3 * width bytes each, a writer's keeps what it left there
+// from the pairs before in the band
+typedef void (*read2_fn)(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch);
+typedef void (*write2_fn)(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch);
+
+static void read_yu12(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	const unsigned char* u = src + stride * height;
+
+	r->y0 = src + h * stride;
+	r->y1 = r->y0 + stride;
+	r->u = u + (h / 2) * (stride / 2);
+	r->v = u + (stride / 2) * (height / 2) + (h / 2) * (stride / 2);
+}
+
+static void read_nv12(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	const unsigned char* uv = src + stride * height + (h / 2) * stride;
+	unsigned char* u = scratch;
+	unsigned char* v = u + width / 2;
+	int x;
+
+	for (x = 0; x < width / 2; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+
+	r->y0 = src + h * stride;
+	r->y1 = r->y0 + stride;
+	r->u = u;
+	r->v = v;
+}
+
+static void read_packed(packed_fn fn, packed_fn tail,
+	const unsigned char* src, int stride, int width, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	const unsigned char* s0 = src + h * stride;
+	unsigned char* y0 = scratch;
+	unsigned char* u = y0 + width * 2;
+	unsigned char* v = u + width / 2;
+	int x;
+
+	x = fn(s0, s0 + stride, y0, y0 + width, u, v, 0, width);
+	tail(s0, s0 + stride, y0, y0 + width, u, v, x, width);
+
+	r->y0 = y0;
+	r->y1 = y0 + width;
+	r->u = u;
+	r->v = v;
+}
+
+static void read_yuyv(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	read_packed(k->yuyv, yuyv2_c, src, stride, width, h, r, scratch);
+}
+
+static void read_uyvy(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	read_packed(k->uyvy, uyvy2_c, src, stride, width, h, r, scratch);
+}
+
+static void read_422p(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	int cs = stride / 2;
+	const unsigned char* su = src + stride * height + h * cs;
+	const unsigned char* sv = src + stride * height + cs * height + h * cs;
+	unsigned char* u = scratch;
+	unsigned char* v = u + width / 2;
+
+	avg_row_c(su, su + cs, u, k->avg(su, su + cs, u, 0, width / 2),
+		width / 2);
+	avg_row_c(sv, sv + cs, v, k->avg(sv, sv + cs, v, 0, width / 2),
+		width / 2);
+
+	r->y0 = src + h * stride;
+	r->y1 = r->y0 + stride;
+	r->u = u;
+	r->v = v;
+}
+
+static void read_ba81(const struct kernels* k, const unsigned char* src,
+	int stride, int width, int height, int h, struct rows* r,
+	unsigned char* scratch)
+{
+	unsigned char* y0 = scratch;
+	unsigned char* u = y0 + width * 2;
+	unsigned char* v = u + width / 2;
+
+	bggr_rows(k->bggr, src, stride, width, height, h, y0, y0 + width, u, v);
+
+	r->y0 = y0;
+	r->y1 = y0 + width;
+	r->u = u;
+	r->v = v;
+}
+
+static void write_yu12(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	unsigned char* u = dst + width * height;
+	unsigned char* v = u + (width / 2) * (height / 2);
+
+	memcpy(dst + h * width, r->y0, width);
+	memcpy(dst + (h + 1) * width, r->y1, width);
+	memcpy(u + (h / 2) * (width / 2), r->u, width / 2);
+	memcpy(v + (h / 2) * (width / 2), r->v, width / 2);
+}
+
+static void write_grey(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	memcpy(dst + h * width, r->y0, width);
+	memcpy(dst + (h + 1) * width, r->y1, width);
+}
+
+static void write_bgr4(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	unsigned char* d0 = dst + h * width * 4;
+	int x;
+
+	x = k->bgra(r->y0, r->y1, r->u, r->v, d0, d0 + width * 4, 0, width);
+	row2_bgra_c(r->y0, r->y1, r->u, r->v, d0, d0 + width * 4, x, width);
+}
+
+static void write_bgr3(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	unsigned char* d0 = dst + h * width * 3;
+
+	row2_bgr_c(r->y0, r->y1, r->u, r->v, d0, d0 + width * 3, width);
+}
+
+// the pair down to Y at width / scale into y and its chroma, scale 2
+// or 4. a 4x4 block is the rounded mean of the 2x2 means of its
+// quarters, like going down by 2 twice, so the first pair of a block
+// is kept in scratch and 0 returned for it. 1 once y is written
+static int down_rows(const struct kernels* k, const struct rows* r,
+	int width, int h, int scale, unsigned char* y, unsigned char* scratch,
+	const unsigned char** u, const unsigned char** v)
+{
+	int n = width / 2;
+	unsigned char* ay = scratch;   // first pair of the block at half
+	unsigned char* au = ay + n;
+	unsigned char* av = au + n;
+	unsigned char* by = av + n;    // second pair at half
+	unsigned char* qu = by + n;    // chroma at a quarter
+	unsigned char* qv = qu + n / 2;
+	unsigned char* hy = scale == 2 ? y : !(h & 2) ? ay : by;
+
+	half_row_c(r->y0, r->y1, hy, k->half(r->y0, r->y1, hy, 0, n), n);
+	if (scale == 2) {
+		*u = r->u;
+		*v = r->v;
+		return 1;
+	}
+	if (!(h & 2)) {
+		memcpy(au, r->u, n);
+		memcpy(av, r->v, n);
+		return 0;
+	}
+
+	n /= 2;
+	half_row_c(ay, by, y, k->half(ay, by, y, 0, n), n);
+	half_row_c(au, r->u, qu, k->half(au, r->u, qu, 0, n), n);
+	half_row_c(av, r->v, qv, k->half(av, r->v, qv, 0, n), n);
+	*u = qu;
+	*v = qv;
+
+	return 1;
+}
+
+static void write_grey_div(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int h, int scale, unsigned char* scratch)
+{
+	const unsigned char* u;
+	const unsigned char* v;
+
+	down_rows(k, r, width, h, scale, 
+		dst + (h / scale) * (width / scale), scratch, &u, &v);
+}
+
+// one pixel per chroma sample after going down, so 4:4:4
+static void write_bgr_div(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int h, int scale, unsigned char* scratch)
+{
+	int n = width / scale;
+	unsigned char* y = scratch + width * 5 / 2;
+	unsigned char* d = dst + (h / scale) * n * 3;
+	const unsigned char* u;
+	const unsigned char* v;
+	int x;
+
+	if (!down_rows(k, r, width, h, scale, y, scratch, &u, &v))
+		return;
+
+	for (x = 0; x < n; x++) {
+		int du = (u[x] - 128) << 6;
+		int dv = (v[x] - 128) << 6;
+		int yy = (y[x] << 2) + 2;
+
+		d[x * 3 + 0] = clamp((yy + mulhi(du, CB_U)) >> 2, 0, 255);
+		d[x * 3 + 1] = clamp((yy - mulhi(du, CG_U) - mulhi(dv, CG_V)) >> 2,
+			0, 255);
+		d[x * 3 + 2] = clamp((yy + mulhi(dv, CR_V)) >> 2, 0, 255);
+	}
+}
+
+static void write_grey_div2(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	write_grey_div(k, r, dst, width, h, 2, scratch);
+}
+
+static void write_grey_div4(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	write_grey_div(k, r, dst, width, h, 4, scratch);
+}
+
+static void write_bgr_div2(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	write_bgr_div(k, r, dst, width, h, 2, scratch);
+}
+
+static void write_bgr_div4(const struct kernels* k, const struct rows* r,
+	unsigned char* dst, int width, int height, int h, 
+	unsigned char* scratch)
+{
+	write_bgr_div(k, r, dst, width, h, 4, scratch);
+}
+
+// bpp is the bytes per pixel of the first plane, for a default stride
+static const struct {
+	unsigned int fourcc;
+	read2_fn read;
+	int bpp;
+} readers[] = {
+	{ CONVERT_YU12, read_yu12, 1 },
+	{ CONVERT_NV12, read_nv12, 1 },
+	{ CONVERT_YUYV, read_yuyv, 2 },
+	{ CONVERT_UYVY, read_uyvy, 2 },
+	{ CONVERT_422P, read_422p, 1 },
+	{ CONVERT_BA81, read_ba81, 1 },
+};
+
+// align is the rows an output row comes from
+static const struct {
+	unsigned int fourcc;
+	write2_fn write;
+	int align;
+} writers[] = {
+	{ CONVERT_YU12, write_yu12, 2 },
+	{ CONVERT_GREY, write_grey, 2 },
+	{ CONVERT_BGR4, write_bgr4, 2 },
+	{ CONVERT_BGR3, write_bgr3, 2 },
+	{ CONVERT_GREY_DIV(2), write_grey_div2, 2 },
+	{ CONVERT_GREY_DIV(4), write_grey_div4, 4 },
+	{ CONVERT_BGR3_DIV(2), write_bgr_div2, 2 },
+	{ CONVERT_BGR3_DIV(4), write_bgr_div4, 4 },
+};
+
+static int find_reader(unsigned int fourcc)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(readers) / sizeof(readers[0])); i++)
+		if (readers[i].fourcc == fourcc)
+			return i;
+
+	return -1;
+}
+
+static int find_writer(unsigned int fourcc)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(writers) / sizeof(writers[0])); i++)
+		if (writers[i].fourcc == fourcc)
+			return i;
+
+	return -1;
+}
+
+int convert_supported(unsigned int src, unsigned int dst)
+{
+	return find_reader(src) >= 0 && find_writer(dst) >= 0;
+}
+
+struct frame_job {
+	struct kernels k;
+	read2_fn read;
+	write2_fn write;
+	const unsigned char* in;
+	int stride;
+	unsigned char* out;
+	int width;
+	int height;
+	int failed;
+};
+
+// every band has its own scratch, the reader's then the writer's
+static void frame_band(void* arg, int h0, int h1)
+{
+	struct frame_job* j = (struct frame_job*)arg;
+	unsigned char* scratch;
+	struct rows r;
+	int h;
+
+	if (!(scratch = (unsigned char*)malloc(j->width * 6))) {
+		__atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (h = h0; h + 1 < h1; h += 2) {
+		j->read(&j->k, j->in, j->stride, j->width, j->height, h, &r, 
+			scratch);
+		j->write(&j->k, &r, j->out, j->width, j->height, h, 
+			scratch + j->width * 3);
+	}
+
+	free(scratch);
+}
+
+int convert_frame(unsigned int src, const unsigned char* in, int stride,
+	unsigned int dst, unsigned char* out, int width, int height)
+{
+	int ri = find_reader(src), wi = find_writer(dst);
+	struct frame_job j;
+
+	if (ri < 0 || wi < 0)
+		return -1;
+
+	j.k.bgra = pick_bgra();
+	j.k.yuyv = pick_packed(0);
+	j.k.uyvy = pick_packed(1);
+	j.k.bggr = pick_bggr();
+	j.k.avg = pick_avg();
+	j.k.half = half_row_c;
+#ifdef CONVERT_X86
+	if (__builtin_cpu_supports("sse2"))
+		j.k.half = half_row_sse2;
+#endif
+	j.read = readers[ri].read;
+	j.write = writers[wi].write;
+	j.in = in;
+	j.stride = stride ? stride : width * readers[ri].bpp;
+	j.out = out;
+	j.width = width;
+	j.height = height;
+	j.failed = 0;
+
+	bands(width, height, writers[wi].align, frame_band, &j);
+
+	return j.failed ? -1 : 0;
+}
+
+int convert_size(unsigned int dst, int width, int height)
+{
+	switch (dst) {
+	case CONVERT_YU12 : return width * height * 3 / 2;
+	case CONVERT_GREY : return width * height;
+	case CONVERT_GREY_DIV(2) : return (width / 2) * (height / 2);
+	case CONVERT_GREY_DIV(4) : return (width / 4) * (height / 4);
+	case CONVERT_BGR3_DIV(2) : return (width / 2) * (height / 2) * 3;
+	case CONVERT_BGR3_DIV(4) : return (width / 4) * (height / 4) * 3;
+	case CONVERT_BGR3 : return width * height * 3;
+	case CONVERT_BGR4 : return width * height * 4;
+	default : return -1;
+	}
+}
+
+// make() of pipe_derive, arg is the fourcc
+static int derive_frame(void* arg, void* handle, const void* buf, void* out)
+{
+	struct frame_info* info = buf_info(handle);
+
+	return convert_frame(info->fourcc, (const unsigned char*)buf, 
+		info->stride, (unsigned int)(uintptr_t)arg, (unsigned char*)out, 
+		info->width, info->height);
+}
+
+const unsigned char* convert_derived(struct pipe* p, void* handle,
+	const void* buf, unsigned int dst)
+{
+	struct frame_info* info = buf_info(handle);
+
+	// the frame is what was asked for already, or starts with it
+	if (info->stride == info->width && (info->fourcc == dst ||
+		(dst == CONVERT_GREY && (info->fourcc == CONVERT_YU12 ||
+		 info->fourcc == CONVERT_NV12 || info->fourcc == CONVERT_422P))))
+		return (const unsigned char*)buf;
+
+	if (!convert_supported(info->fourcc, dst))
+		return NULL;
+
+	return (const unsigned char*)pipe_derive(p, handle, dst, 
+		convert_size(dst, info->width, info->height), derive_frame, 
+		(void*)(uintptr_t)dst);
+}
+
+const unsigned char* convert_luma(struct pipe* p, void* handle,
+	const void* buf, int* stride)
+{
+	struct frame_info* info = buf_info(handle);
+
+	if (info->fourcc == CONVERT_YU12 || info->fourcc == CONVERT_NV12 ||
+		info->fourcc == CONVERT_422P || info->fourcc == CONVERT_GREY) {
+		*stride = info->stride ? info->stride : info->width;
+		return (const unsigned char*)buf;
+	}
+
+	*stride = info->width;
+	return convert_derived(p, handle, buf, CONVERT_GREY);
+}
+
+#ifdef CONVERT_TEST
+#include <assert.h>
+#include <time.h>
+
+// the float converter this replaces
+static void ref_bgra(const unsigned char* yuv, unsigned char* rgb,
+	int width, int height)
+{
+	int w, h;
+	unsigned char* p = rgb;
+	const unsigned char* y = yuv;
+	const unsigned char* u = y + (width * height);
+	const unsigned char* v = u + ((width / 2) * (height / 2));
+
+	for (h = 0; h < height; h++) {
+		for (w = 0; w < width; w++) {
+			int _y = y[h * width + w];
+			int _u = u[(h / 2) * (width / 2) + (w / 2)];
+			int _v = v[(h / 2) * (width / 2) + (w / 2)];
+
+			int rTmp = _y + (1.370705 * (_v-128));
+			int gTmp = _y - (0.698001 * (_v-128)) - (0.337633 * (_u-128));
+			int bTmp = _y + (1.732446 * (_u-128));
+
+			*p++ = clamp(bTmp, 0, 255); //blue
+			*p++ = clamp(gTmp, 0, 255); //green
+			*p++ = clamp(rTmp, 0, 255); //red
+			*p++ = 255;
+		}
+	}
+}
+
+static double ms_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+// every kernel against the scalar one and the float reference
+static void check(int width, int height, int n_runs)
+{
+	struct { const char* name; row2_fn fn; int ok; } k[] = {
+		{ "c", row2_bgra_c, 1 },
+#ifdef CONVERT_X86
+		{ "sse2", row2_bgra_sse2, __builtin_cpu_supports("sse2") },
+		{ "avx2", row2_bgra_avx2, __builtin_cpu_supports("avx2") },
+#endif
+	};
+	int n_k = sizeof(k) / sizeof(k[0]);
+	int sz = width * height + 2 * (width / 2) * ((height + 1) / 2);
+	int out_sz = width * height * 4;
+	unsigned char* yuv = (unsigned char*)malloc(sz);
+	unsigned char* ref = (unsigned char*)malloc(out_sz);
+	unsigned char* c = (unsigned char*)malloc(out_sz);
+	unsigned char* out = (unsigned char*)malloc(out_sz);
+	unsigned char* bgr = (unsigned char*)malloc(width * height * 3);
+	int i, j, max_diff = 0;
+	struct timespec t;
+
+	// all extremes first, then noise
+	for (i = 0; i < sz; i++)
+		yuv[i] = i < 256 * 3 ? (i * 37) & 0xff : rand() & 0xff;
+	for (i = 0; i < 8 && i < width * height; i++)
+		yuv[i] = i & 1 ? 0 : 255;
+
+	ref_bgra(yuv, ref, width, height);
+	yuv420_bgra(row2_bgra_c, yuv, c, width, height);
+	for (i = 0; i < out_sz; i++) {
+		int d = abs(ref[i] - c[i]);
+
+		max_diff = d > max_diff ? d : max_diff;
+	}
+	assert(max_diff <= 2);
+
+	convert_yuv420_bgr888(yuv, bgr, width, height);
+	for (i = 0; i < width * height; i++)
+		assert(!memcmp(bgr + i * 3, c + i * 4, 3));
+
+	printf("%dx%d max diff to float %d\n", width, height, max_diff);
+
+	for (j = 0; j < n_k; j++) {
+		if (!k[j].ok)
+			continue;
+
+		memset(out, 0, out_sz);
+		yuv420_bgra(k[j].fn, yuv, out, width, height);
+		assert(!memcmp(out, c, out_sz));
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		for (i = 0; i < n_runs; i++)
+			yuv420_bgra(k[j].fn, yuv, out, width, height);
+		printf("  %-5s bit exact, %.3f ms\n", k[j].name,
+			ms_since(&t) / n_runs);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		ref_bgra(yuv, ref, width, height);
+	printf("  float %.3f ms\n", ms_since(&t) / n_runs);
+
+	free(yuv);
+	free(ref);
+	free(c);
+	free(out);
+	free(bgr);
+}
+
+// conv_rgb24toyuv420p of video2.c, convert_bgr24_yuv420 now
+static void ref_bgr24(const unsigned char* bgr, unsigned char* yuv,
+	int width, int height)
+{
+	unsigned char* y = yuv;
+	unsigned char* u = y + width * height;
+	unsigned char* v = u + width * height / 4;
+	int i, size = width * height;
+
+	memset(u, 0, size / 4);
+	memset(v, 0, size / 4);
+	for (i = 0; i < size; i++) {
+		const unsigned char* c = bgr + i * 3;
+		int q = (i / width / 2) * (width / 2) + (i % width) / 2;
+
+		y[i] = (BY_R * c[2] + BY_G * c[1] + BY_B * c[0]) >> 15;
+		u[q] += ((BU_R * c[2] + BU_G * c[1] + BU_B * c[0]) >> 17) + 32;
+		v[q] += ((BV_R * c[2] + BV_G * c[1] + BV_B * c[0]) >> 17) + 32;
+	}
+}
+
+// the two passes convert_bggr8_yuv420 replaces, bayer2rgb24 of video2.c
+// and ref_bgr24
+static void ref_bggr(const unsigned char* raw, unsigned char* yuv,
+	int width, int height)
+{
+	unsigned char* bgr = (unsigned char*)malloc(width * height * 3);
+	unsigned char* p = bgr;
+	int i, size = width * height;
+
+	for (i = 0; i < size; i++) {
+		const unsigned char* r = raw + i;
+		int row = i / width, col = i % width;
+
+		if (!(row & 1) && !(i & 1)) {
+			*p++ = *r;
+			if (i > width && col > 0) {
+				*p++ = (r[-1] + r[1] + r[width] + r[-width]) / 4;
+				*p++ = (r[-width - 1] + r[-width + 1] +
+					r[width - 1] + r[width + 1]) / 4;
+			} else {
+				*p++ = (r[1] + r[width]) / 2;
+				*p++ = r[width + 1];
+			}
+		} else if (!(row & 1)) {
+			if (i > width && col < width - 1) {
+				*p++ = (r[-1] + r[1]) / 2;
+				*p++ = *r;
+				*p++ = (r[width] + r[-width]) / 2;
+			} else {
+				*p++ = r[-1];
+				*p++ = *r;
+				*p++ = r[width];
+			}
+		} else if (!(i & 1)) {
+			if (i < width * (height - 1) && col > 0) {
+				*p++ = (r[width] + r[-width]) / 2;
+				*p++ = *r;
+				*p++ = (r[-1] + r[1]) / 2;
+			} else {
+				*p++ = r[-width];
+				*p++ = *r;
+				*p++ = r[1];
+			}
+		} else {
+			if (i < width * (height - 1) && col < width - 1) {
+				*p++ = (r[-width - 1] + r[-width + 1] +
+					r[width - 1] + r[width + 1]) / 4;
+				*p++ = (r[-1] + r[1] + r[-width] + r[width]) / 4;
+				*p++ = *r;
+			} else {
+				*p++ = r[-width - 1];
+				*p++ = (r[-1] + r[-width]) / 2;
+				*p++ = *r;
+			}
+		}
+	}
+
+	ref_bgr24(bgr, yuv, width, height);
+	free(bgr);
+}
+
+// every kernel against the scalar one, and the scalar one against the
+// two passes away from the border. Y is the same there, chroma rounds
+// once instead of per pixel. the old chroma wraps around for saturated
+// colors, hence the modulo
+static void check_bggr(int width, int height, int n_runs)
+{
+	struct { const char* name; bggr_fn fn; int ok; } k[] = {
+		{ "c", bggr_row2_c, 1 },
+#ifdef CONVERT_X86
+		{ "sse2", bggr_row2_sse2, __builtin_cpu_supports("sse2") },
+#endif
+	};
+	int n_k = sizeof(k) / sizeof(k[0]);
+	int sz = width * height;
+	int out_sz = sz * 3 / 2;
+	unsigned char* raw = (unsigned char*)malloc(sz);
+	unsigned char* ref = (unsigned char*)malloc(out_sz);
+	unsigned char* c = (unsigned char*)malloc(out_sz);
+	unsigned char* out = (unsigned char*)malloc(out_sz);
+	int i, j, x, y, max_y = 0, max_c = 0;
+	struct timespec t;
+
+	// smooth areas, hard edges and noise
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			raw[y * width + x] = y < height / 3 ? (x * 2 + y) & 0xff :
+				y < height * 2 / 3 ? ((x / 7 + y / 5) & 1) * 255 :
+				rand() & 0xff;
+
+	ref_bggr(raw, ref, width, height);
+	bggr_yuv420(bggr_row2_c, raw, c, width, height);
+	for (y = 1; y < height - 1; y++) {
+		for (x = 1; x < width - 1; x++) {
+			int d = abs(ref[y * width + x] - c[y * width + x]);
+
+			max_y = d > max_y ? d : max_y;
+		}
+	}
+	for (y = 1; y < height / 2 - 1; y++) {
+		for (x = 1; x < width / 2 - 1; x++) {
+			for (j = 0; j < 2; j++) {
+				int o = sz + j * sz / 4 + y * (width / 2) + x;
+				int d = abs((signed char)(ref[o] - c[o]));
+
+				max_c = d > max_c ? d : max_c;
+			}
+		}
+	}
+	assert(max_y == 0 && max_c <= 3);
+	printf("%dx%d bayer, inside max diff to two passes Y %d UV %d\n",
+		width, height, max_y, max_c);
+
+	for (j = 0; j < n_k; j++) {
+		if (!k[j].ok)
+			continue;
+
+		memset(out, 0, out_sz);
+		bggr_yuv420(k[j].fn, raw, out, width, height);
+		assert(!memcmp(out, c, out_sz));
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		for (i = 0; i < n_runs; i++)
+			bggr_yuv420(k[j].fn, raw, out, width, height);
+		printf("  %-5s bit exact, %.3f ms\n", k[j].name,
+			ms_since(&t) / n_runs);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		ref_bggr(raw, ref, width, height);
+	printf("  two passes %.3f ms\n", ms_since(&t) / n_runs);
+
+	free(raw);
+	free(ref);
+	free(c);
+	free(out);
+}
+
+// conv_uyvyto420p and conv_yuv422to420p (YUYV) of video2.c
+static void ref_packed(const unsigned char* src, unsigned char* yuv,
+	int width, int height, int uyvy)
+{
+	unsigned char* y = yuv;
+	unsigned char* u = y + width * height;
+	unsigned char* v = u + width * height / 4;
+	int yo = uyvy, co = 1 - uyvy;
+	int i, j;
+
+	for (i = 0; i < width * height; i++)
+		y[i] = src[i * 2 + yo];
+	for (i = 0; i < height / 2; i++) {
+		const unsigned char* s0 = src + i * 2 * width * 2;
+		const unsigned char* s1 = s0 + width * 2;
+
+		for (j = 0; j < width / 2; j++) {
+			*u++ = ((int)s0[j * 4 + co] + (int)s1[j * 4 + co]) / 2;
+			*v++ = ((int)s0[j * 4 + co + 2] + (int)s1[j * 4 + co + 2]) / 2;
+		}
+	}
+}
+
+// a 4x2 frame worked out by hand in every format
+static void check_422_golden(void)
+{
+	static const unsigned char packed[16] = {
+		10, 100, 11, 200, 12, 101, 13, 201,
+		20, 110, 21, 211, 22, 111, 23, 210,
+	};
+	static const unsigned char yuyv[12] = {
+		10, 11, 12, 13, 20, 21, 22, 23, 105, 106, 205, 205,
+	};
+	static const unsigned char uyvy[12] = {
+		100, 200, 101, 201, 110, 211, 111, 210, 15, 17, 16, 18,
+	};
+	static const unsigned char planar[16] = {
+		1, 2, 3, 4, 5, 6, 7, 8,          // Y
+		50, 60, 51, 255,                 // U, 2 per row
+		0, 255, 1, 254,                  // V
+	};
+	static const unsigned char planar_420[12] = {
+		1, 2, 3, 4, 5, 6, 7, 8, 50, 157, 0, 254,
+	};
+	unsigned char out[12];
+
+	convert_yuyv_yuv420(packed, 0, out, 4, 2);
+	assert(!memcmp(out, yuyv, 12));
+	convert_uyvy_yuv420(packed, 0, out, 4, 2);
+	assert(!memcmp(out, uyvy, 12));
+	convert_yuv422p_yuv420(planar, 0, out, 4, 2);
+	assert(!memcmp(out, planar_420, 12));
+	printf("422 golden ok\n");
+}
+
+// every packed kernel against the old converters, with a padded stride
+// too, and 422P against the packed path on the same picture
+static void check_422(int width, int height, int n_runs)
+{
+	struct { const char* name; packed_fn fn[2]; int ok; } k[] = {
+		{ "c", { yuyv2_c, uyvy2_c }, 1 },
+#ifdef CONVERT_X86
+		{ "sse2", { yuyv2_sse2, uyvy2_sse2 },
+			__builtin_cpu_supports("sse2") },
+		{ "avx2", { yuyv2_avx2, uyvy2_avx2 },
+			__builtin_cpu_supports("avx2") },
+#endif
+	};
+	packed_fn tail[2] = { yuyv2_c, uyvy2_c };
+	int n_k = sizeof(k) / sizeof(k[0]);
+	int stride = width * 2 + 64;
+	int sz = width * height * 2;
+	int out_sz = width * height * 3 / 2;
+	unsigned char* src = (unsigned char*)malloc(sz);
+	unsigned char* padded = (unsigned char*)malloc(stride * height);
+	unsigned char* planar = (unsigned char*)malloc(sz);
+	unsigned char* ref = (unsigned char*)malloc(out_sz);
+	unsigned char* out = (unsigned char*)malloc(out_sz);
+	int i, j, f, x, y;
+	struct timespec t;
+
+	for (i = 0; i < sz; i++)
+		src[i] = i < 256 * 2 ? (i * 37) & 0xff : rand() & 0xff;
+	for (y = 0; y < height; y++)
+		memcpy(padded + y * stride, src + y * width * 2, width * 2);
+
+	for (f = 0; f < 2; f++) {
+		ref_packed(src, ref, width, height, f);
+		printf("%dx%d %s\n", width, height, f ? "UYVY" : "YUYV");
+
+		for (j = 0; j < n_k; j++) {
+			if (!k[j].ok)
+				continue;
+
+			memset(out, 0, out_sz);
+			packed_yuv420(k[j].fn[f], tail[f], src, width * 2, out,
+				width, height);
+			assert(!memcmp(out, ref, out_sz));
+			memset(out, 0, out_sz);
+			packed_yuv420(k[j].fn[f], tail[f], padded, stride, out,
+				width, height);
+			assert(!memcmp(out, ref, out_sz));
+
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			for (i = 0; i < n_runs; i++)
+				packed_yuv420(k[j].fn[f], tail[f], src, width * 2, out,
+					width, height);
+			printf("  %-5s bit exact, %.3f ms\n", k[j].name,
+				ms_since(&t) / n_runs);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		for (i = 0; i < n_runs; i++)
+			ref_packed(src, ref, width, height, f);
+		printf("  old   %.3f ms\n", ms_since(&t) / n_runs);
+	}
+
+	// the same picture as 422P
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++)
+			planar[y * width + x] = src[(y * width + x) * 2];
+		for (x = 0; x < width / 2; x++) {
+			planar[width * height + y * (width / 2) + x] =
+				src[(y * width + x * 2) * 2 + 1];
+			planar[width * height * 3 / 2 + y * (width / 2) + x] =
+				src[(y * width + x * 2) * 2 + 3];
+		}
+	}
+	ref_packed(src, ref, width, height, 0);
+	convert_yuv422p_yuv420(planar, 0, out, width, height);
+	assert(!memcmp(out, ref, out_sz));
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		convert_yuv422p_yuv420(planar, 0, out, width, height);
+	printf("  422P  same as YUYV, %.3f ms\n", ms_since(&t) / n_runs);
+
+	free(src);
+	free(padded);
+	free(planar);
+	free(ref);
+	free(out);
+}
+
+// every source to every destination in one pass against going through
+// a whole YU12 frame, with padded source lines. the source to YU12
+// step is checked against the converters of each format
+static void check_frame(int width, int height, int n_runs)
+{
+	static const unsigned int srcs[] = {
+		CONVERT_YU12, CONVERT_NV12, CONVERT_YUYV, CONVERT_UYVY,
+		CONVERT_422P, CONVERT_BA81,
+	};
+	static const unsigned int dsts[] = {
+		CONVERT_YU12, CONVERT_GREY, CONVERT_BGR4, CONVERT_BGR3,
+		CONVERT_GREY_DIV(2), CONVERT_GREY_DIV(4), CONVERT_BGR3_DIV(2),
+		CONVERT_BGR3_DIV(4),
+	};
+	int n_srcs = sizeof(srcs) / sizeof(srcs[0]);
+	int n_dsts = sizeof(dsts) / sizeof(dsts[0]);
+	int pad = 64;
+	int src_sz = (width * 2 + pad) * height * 2;
+	int yuv_sz = width * height * 3 / 2;
+	unsigned char* in = (unsigned char*)malloc(src_sz);
+	unsigned char* flat = (unsigned char*)malloc(src_sz);
+	unsigned char* yuv = (unsigned char*)malloc(yuv_sz);
+	unsigned char* ref = (unsigned char*)malloc(yuv_sz);
+	unsigned char* two = (unsigned char*)malloc(width * height * 4);
+	unsigned char* one = (unsigned char*)malloc(width * height * 4);
+	int i, s, d, y;
+	struct timespec t;
+
+	assert(!convert_supported(CONVERT_BGR4, CONVERT_YU12));
+	assert(!convert_supported(CONVERT_YU12, CONVERT_YUYV));
+	assert(convert_frame(CONVERT_GREY, in, 0, CONVERT_BGR4, one,
+		width, height) == -1);
+
+	for (i = 0; i < src_sz; i++)
+		in[i] = rand() & 0xff;
+
+	for (s = 0; s < n_srcs; s++) {
+		int bpp = srcs[s] == CONVERT_YUYV || srcs[s] == CONVERT_UYVY ? 2 : 1;
+		int stride = width * bpp + pad;
+		const unsigned char* p = in + stride * height;
+		unsigned char* q = flat + width * bpp * height;
+
+		// the same picture without the padding, chroma lines of planar
+		// formats are half as long, NV12 lines the same
+		for (y = 0; y < height; y++)
+			memcpy(flat + y * width * bpp, in + y * stride, width * bpp);
+		if (srcs[s] == CONVERT_NV12)
+			for (y = 0; y < height / 2; y++)
+				memcpy(q + y * width, p + y * stride, width);
+		if (srcs[s] == CONVERT_YU12 || srcs[s] == CONVERT_422P)
+			for (y = 0; y < (srcs[s] == CONVERT_YU12 ? height : height * 2); y++)
+				memcpy(q + y * (width / 2), p + y * (stride / 2), width / 2);
+
+		assert(!convert_frame(srcs[s], in, stride, CONVERT_YU12, yuv,
+			width, height));
+		if (srcs[s] == CONVERT_YU12) {
+			assert(!memcmp(yuv, flat, yuv_sz));
+		} else if (srcs[s] == CONVERT_NV12) {
+			const unsigned char* uv = flat + width * height;
+
+			memcpy(ref, flat, width * height);
+			for (i = 0; i < width * height / 4; i++) {
+				ref[width * height + i] = uv[i * 2];
+				ref[width * height * 5 / 4 + i] = uv[i * 2 + 1];
+			}
+			assert(!memcmp(yuv, ref, yuv_sz));
+		} else {
+			if (srcs[s] == CONVERT_YUYV)
+				convert_yuyv_yuv420(in, stride, ref, width, height);
+			else if (srcs[s] == CONVERT_UYVY)
+				convert_uyvy_yuv420(in, stride, ref, width, height);
+			else if (srcs[s] == CONVERT_422P)
+				convert_yuv422p_yuv420(in, stride, ref, width, height);
+			else
+				convert_bggr8_yuv420(flat, ref, width, height);
+			assert(!memcmp(yuv, ref, yuv_sz));
+		}
+
+		for (d = 0; d < n_dsts; d++) {
+			int out_sz = convert_size(dsts[d], width, height);
+
+			assert(convert_supported(srcs[s], dsts[d]));
+			assert(!convert_frame(CONVERT_YU12, yuv, 0, dsts[d], two,
+				width, height));
+			memset(one, 0, out_sz);
+			assert(!convert_frame(srcs[s], in, stride, dsts[d], one,
+				width, height));
+			assert(!memcmp(one, two, out_sz));
+		}
+	}
+
+	// half scale Y by hand
+	assert(!convert_frame(CONVERT_YU12, yuv, 0, CONVERT_GREY_HALF, one,
+		width, height));
+	for (y = 0; y < height / 2; y++) {
+		for (i = 0; i < width / 2; i++) {
+			const unsigned char* p = yuv + y * 2 * width + i * 2;
+
+			assert(one[y * (width / 2) + i] ==
+				((p[0] + p[1] + p[width] + p[width + 1] + 2) >> 2));
+		}
+	}
+
+	// the path the render thread used to take for a YUYV camera
+	convert_yuv420_bgra8888(yuv, one, width, height);
+	assert(!convert_frame(CONVERT_YU12, yuv, 0, CONVERT_BGR4, two,
+		width, height));
+	assert(!memcmp(one, two, width * height * 4));
+	printf("%dx%d every format pair same as through YU12\n", width, height);
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++) {
+		convert_yuyv_yuv420(in, 0, yuv, width, height);
+		convert_yuv420_bgra8888(yuv, one, width, height);
+	}
+	printf("  YUYV to BGRA through YU12 %.3f ms\n", ms_since(&t) / n_runs);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		convert_frame(CONVERT_YUYV, in, 0, CONVERT_BGR4, one, width, height);
+	printf("  YUYV to BGRA in one pass  %.3f ms\n", ms_since(&t) / n_runs);
+
+	free(in);
+	free(flat);
+	free(yuv);
+	free(ref);
+	free(two);
+	free(one);
+}
+
+// every conversion on n threads against the calling thread alone, with
+// bands down to one pair of rows. bgr24 against the old converter too
+static void check_pool(int n, int width, int height, int n_runs)
+{
+	static const unsigned int srcs[] = { CONVERT_YU12, CONVERT_NV12, 
+		CONVERT_YUYV, CONVERT_UYVY, CONVERT_422P, CONVERT_BA81 };
+	static const unsigned int dsts[] = { CONVERT_YU12, CONVERT_GREY,
+		CONVERT_BGR4, CONVERT_BGR3, CONVERT_GREY_DIV(2), CONVERT_GREY_DIV(4),
+		CONVERT_BGR3_DIV(2), CONVERT_BGR3_DIV(4) };
+	int sz = width * height * 4;
+	unsigned char* in = (unsigned char*)malloc(sz);
+	unsigned char* one = (unsigned char*)malloc(sz);
+	unsigned char* out = (unsigned char*)malloc(sz);
+	struct tpool tp;
+	struct timespec t;
+	double ms_one, ms_n;
+	int i, s, d;
+
+	for (i = 0; i < sz; i++)
+		in[i] = rand() & 0xff;
+	assert(!init_tpool(&tp, n));
+
+#define SAME(call) do { \
+		convert_pool(NULL, 0); \
+		memset(one, 0, sz); \
+		call(one); \
+		convert_pool(&tp, 1); \
+		memset(out, 0, sz); \
+		call(out); \
+		assert(!memcmp(one, out, sz)); \
+	} while (0)
+#define BGRA(o) convert_yuv420_bgra8888(in, o, width, height)
+#define BGR(o) convert_yuv420_bgr888(in, o, width, height)
+#define BGGR(o) convert_bggr8_yuv420(in, o, width, height)
+#define YUYV(o) convert_yuyv_yuv420(in, 0, o, width, height)
+#define UYVY(o) convert_uyvy_yuv420(in, width * 2 + 6, o, width, height)
+#define P422(o) convert_yuv422p_yuv420(in, 0, o, width, height)
+#define BGR24(o) convert_bgr24_yuv420(in, o, width, height)
+#define FRAME(o) assert(!convert_frame(srcs[s], in, 0, dsts[d], o, \
+		width, height))
+
+	SAME(BGRA);
+	SAME(BGR);
+	SAME(BGGR);
+	SAME(YUYV);
+	SAME(UYVY);
+	SAME(P422);
+	SAME(BGR24);
+	for (s = 0; s < (int)(sizeof(srcs) / sizeof(srcs[0])); s++)
+		for (d = 0; d < (int)(sizeof(dsts) / sizeof(dsts[0])); d++)
+			SAME(FRAME);
+
+	BGR24(out);
+	ref_bgr24(in, one, width, height);
+	assert(!memcmp(one, out, width * height * 3 / 2));
+
+	convert_pool(NULL, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		BGRA(out);
+	ms_one = ms_since(&t) / n_runs;
+	convert_pool(&tp, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < n_runs; i++)
+		BGRA(out);
+	ms_n = ms_since(&t) / n_runs;
+	printf("%dx%d on %d threads same as on 1, bgra %.3f ms, on 1 %.3f ms\n",
+		width, height, n, ms_n, ms_one);
+
+#undef SAME
+#undef BGRA
+#undef BGR
+#undef BGGR
+#undef YUYV
+#undef UYVY
+#undef P422
+#undef BGR24
+#undef FRAME
+
+	convert_pool(NULL, 0);
+	close_tpool(&tp);
+	free(in);
+	free(one);
+	free(out);
+}
+
+// a plane of w x h down by 2, rounded 2x2 means
+static void ref_half(const unsigned char* s, unsigned char* d, int w, int h)
+{
+	int x, y;
+
+	for (y = 0; y < h / 2; y++)
+		for (x = 0; x < w / 2; x++) {
+			const unsigned char* p = s + y * 2 * w + x * 2;
+
+			d[y * (w / 2) + x] = (p[0] + p[1] + p[w] + p[w + 1] + 2) >> 2;
+		}
+}
+
+// shrunk formats by hand. GREY_DIV(4) is halving twice, the BGR ones
+// are what BGR3 gives for a YU12 frame made of the shrunk planes blown
+// up again, at the top left pixel of each block
+static void check_div(int width, int height)
+{
+	int sz = width * height * 3 / 2;
+	unsigned char* yuv = (unsigned char*)malloc(sz);
+	unsigned char* big = (unsigned char*)malloc(sz);
+	unsigned char* half = (unsigned char*)malloc(sz);
+	unsigned char* quarter = (unsigned char*)malloc(sz);
+	unsigned char* out = (unsigned char*)malloc(width * height * 3);
+	unsigned char* bgr = (unsigned char*)malloc(width * height * 3);
+	int i, n, x, y;
+
+	for (i = 0; i < sz; i++)
+		yuv[i] = rand() & 0xff;
+
+	for (n = 2; n <= 4; n *= 2) {
+		const unsigned char* u = yuv + width * height;
+		const unsigned char* v = u + (width / 2) * (height / 2);
+		const unsigned char* py = half;
+		const unsigned char* pu = u;
+		const unsigned char* pv = v;
+
+		// the shrunk planes, chroma is at half already
+		ref_half(yuv, half, width, height);
+		if (n == 4) {
+			ref_half(half, quarter, width / 2, height / 2);
+			ref_half(u, quarter + sz / 3, width / 2, height / 2);
+			ref_half(v, quarter + sz / 3 * 2, width / 2, height / 2);
+			py = quarter;
+			pu = quarter + sz / 3;
+			pv = quarter + sz / 3 * 2;
+		}
+
+		assert(!convert_frame(CONVERT_YU12, yuv, 0, CONVERT_GREY_DIV(n), 
+			out, width, height));
+		assert(!memcmp(out, py, (width / n) * (height / n)));
+
+		// blown up, chroma n / 2 times
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				big[y * width + x] = py[(y / n) * (width / n) + x / n];
+		for (y = 0; y < height / 2; y++)
+			for (x = 0; x < width / 2; x++) {
+				int o = (y / (n / 2)) * (width / n) + x / (n / 2);
+
+				big[width * height + y * (width / 2) + x] = pu[o];
+				big[width * height * 5 / 4 + y * (width / 2) + x] = pv[o];
+			}
+		convert_yuv420_bgr888(big, bgr, width, height);
+
+		assert(!convert_frame(CONVERT_YU12, yuv, 0, CONVERT_BGR3_DIV(n), 
+			out, width, height));
+		for (y = 0; y < height / n; y++)
+			for (x = 0; x < width / n; x++)
+				assert(!memcmp(out + (y * (width / n) + x) * 3,
+					bgr + (y * n * width + x * n) * 3, 3));
+	}
+	printf("%dx%d shrunk by 2 and 4 same as by hand\n", width, height);
+
+	free(yuv);
+	free(big);
+	free(half);
+	free(quarter);
+	free(out);
+	free(bgr);
+}
+
+// a YUYV frame through a pipe, two dst asking for the same conversions
+static void check_derived(int width, int height)
+{
+	struct pipe p;
+	void* h;
+	void* h0;
+	void* h1;
+	void* b;
+	const void* b0;
+	const void* b1;
+	const unsigned char* d0;
+	const unsigned char* d1;
+	unsigned char* ref = (unsigned char*)malloc(width * height * 4);
+	int i, s0, s1, id0, id1;
+
+	assert(!init_pipe_pool(&p, 4, 2, width * height * 2));
+	id0 = attach_dst(&p, PIPE_DROP_NEWEST);
+	id1 = attach_dst(&p, PIPE_DROP_NEWEST);
+
+	h = get_buf(&p, &b);
+	for (i = 0; i < width * height * 2; i++)
+		((unsigned char*)b)[i] = rand() & 0xff;
+	buf_info(h)->fourcc = CONVERT_YUYV;
+	buf_info(h)->width = width;
+	buf_info(h)->height = height;
+	buf_info(h)->stride = width * 2;
+	push_buf(&p, h, 1);
+	h0 = pull_buf(&p, id0, &b0, &s0);
+	h1 = pull_buf(&p, id1, &b1, &s1);
+
+	d0 = convert_derived(&p, h0, b0, CONVERT_BGR4);
+	d1 = convert_derived(&p, h1, b1, CONVERT_BGR4);
+	assert(d0 && d0 == d1);
+	convert_frame(CONVERT_YUYV, (const unsigned char*)b0, 0, CONVERT_BGR4,
+		ref, width, height);
+	assert(!memcmp(d0, ref, width * height * 4));
+	d1 = convert_derived(&p, h1, b1, CONVERT_GREY);
+	assert(d1 && d1 != d0);
+	assert(convert_luma(&p, h0, b0, &s0) == d1 && s0 == width);
+	assert(!convert_derived(&p, h1, b1, CONVERT_YUYV));
+	put_buf(&p, h0);
+	put_buf(&p, h1);
+
+	// a YU12 frame is its own GREY and YU12
+	h = get_buf(&p, &b);
+	buf_info(h)->fourcc = CONVERT_YU12;
+	buf_info(h)->width = width;
+	buf_info(h)->height = height;
+	buf_info(h)->stride = width;
+	push_buf(&p, h, 2);
+	h0 = pull_buf(&p, id0, &b0, &s0);
+	assert(convert_derived(&p, h0, b0, CONVERT_GREY) == b0);
+	assert(convert_derived(&p, h0, b0, CONVERT_YU12) == b0);
+	// padded, Y is still read in place
+	buf_info(h0)->stride = width + 32;
+	assert(convert_luma(&p, h0, b0, &s0) == b0 && s0 == width + 32);
+	put_buf(&p, h0);
+	printf("%dx%d derived once, shared\n", width, height);
+
+	detach_dst(&p, id0);
+	detach_dst(&p, id1);
+	close_pipe(&p);
+	free(ref);
+}
+
+int main(int argc, char* argv[])
+{
+	printf("runtime kernel %s\n", convert_kernel());
+
+	check(640, 480, 20);
+	check(1920, 1080, 5);
+	// tails for every kernel and an odd height
+	check(16 + 32 + 14, 7, 1);
+	check(2, 2, 1);
+	check(30, 1, 1);
+
+	check_bggr(1280, 960, 10);
+	// first and last block only, no room for sse2, one sse2 step + tail
+	check_bggr(2, 2, 1);
+	check_bggr(4, 6, 1);
+	check_bggr(2 + 16 + 6, 4, 1);
+
+	check_422_golden();
+	check_422(1280, 720, 20);
+	// one avx2 step, one sse2 step and a tail
+	check_422(32 + 16 + 6, 4, 1);
+	check_422(2, 2, 1);
+
+	check_frame(1280, 720, 20);
+	check_frame(32 + 16 + 6, 4, 1);
+	check_frame(2, 2, 1);
+
+	check_div(640, 480);
+	// tails of the sse2 kernel at both steps, a row block cut short
+	check_div(16 * 4 + 36, 10);
+
+	check_derived(640, 480);
+
+	check_pool(4, 3840, 2160, 10);
+	check_pool(3, 640, 480, 1);
+	// fewer pairs of rows than threads
+	check_pool(4, 32 + 16 + 6, 6, 1);
+	check_pool(8, 2, 2, 1);
+
+	return 0;
+}
+#endif
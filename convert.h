@@ -0,0 +1,102 @@
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+// YUV420P (I420, 'YU12') to packed RGB for display and opencv, and
+// camera formats to YUV420P. fixed point, two rows per chroma row,
+// SSE2/AVX2 picked at runtime. all kernels of a conversion give the same
+// output, the RGB ones within 2 of the float reference
+
+void convert_yuv420_bgra8888(const unsigned char* yuv, unsigned char* rgb,
+	int width, int height);
+	// 4 bytes per pixel B, G, R, 255
+void convert_yuv420_bgr888(const unsigned char* yuv, unsigned char* rgb,
+	int width, int height);
+	// 3 bytes per pixel B, G, R
+
+void convert_bggr8_yuv420(const unsigned char* raw, unsigned char* yuv,
+	int width, int height);
+	// raw bayer BGGR ('BA81') to YUV420P in one pass, bilinear. width
+	// and height even
+
+void convert_yuyv_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height);
+void convert_uyvy_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height);
+	// packed 4:2:2 ('YUYV', 'UYVY') to YUV420P, stride is bytes per
+	// source line (0 if width * 2). width and height even
+void convert_yuv422p_yuv420(const unsigned char* src, int stride,
+	unsigned char* yuv, int width, int height);
+	// planar 4:2:2 ('422P') to YUV420P, stride is bytes per Y line (0 if
+	// width), chroma lines are half of it
+void convert_bgr24_yuv420(const unsigned char* bgr, unsigned char* yuv,
+	int width, int height);
+	// packed B, G, R ('BGR3') to YUV420P, width and height even
+
+// --------
+
+// frame formats as fourccs, the same values as V4L2_PIX_FMT_* so
+// frame_info.fourcc can be used as is
+
+#define CONVERT_FOURCC(a, b, c, d) \
+	((unsigned int)(a) | ((unsigned int)(b) << 8) | \
+	 ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+
+#define CONVERT_YU12 CONVERT_FOURCC('Y', 'U', '1', '2') // YUV420P
+#define CONVERT_NV12 CONVERT_FOURCC('N', 'V', '1', '2') // Y, then U V pairs
+#define CONVERT_YUYV CONVERT_FOURCC('Y', 'U', 'Y', 'V')
+#define CONVERT_UYVY CONVERT_FOURCC('U', 'Y', 'V', 'Y')
+#define CONVERT_422P CONVERT_FOURCC('4', '2', '2', 'P')
+#define CONVERT_BA81 CONVERT_FOURCC('B', 'A', '8', '1') // bayer BGGR
+#define CONVERT_GREY CONVERT_FOURCC('G', 'R', 'E', 'Y') // Y only
+#define CONVERT_BGR3 CONVERT_FOURCC('B', 'G', 'R', '3') // B, G, R
+#define CONVERT_BGR4 CONVERT_FOURCC('B', 'G', 'R', '4') // B, G, R, 255
+
+// frames shrunk by n (2 or 4) on the way for detectors, each pixel the
+// mean of an n x n block. not V4L2 formats
+#define CONVERT_GREY_DIV(n) CONVERT_FOURCC('G', 'R', 'Y', '0' + (n))
+#define CONVERT_BGR3_DIV(n) CONVERT_FOURCC('B', 'G', '3', '0' + (n))
+#define CONVERT_GREY_HALF CONVERT_GREY_DIV(2)
+
+int  convert_supported(unsigned int src, unsigned int dst);
+	// 1 if convert_frame can go from src to dst
+int  convert_frame(unsigned int src, const unsigned char* in, int stride,
+	unsigned int dst, unsigned char* out, int width, int height);
+	// reads YU12, NV12, YUYV, UYVY, 422P or BA81 and writes YU12, GREY,
+	// BGR3, BGR4 or one of the shrunk formats in one pass, the same as
+	// going through YU12 with the functions above. stride is bytes per
+	// line of the first plane of in (0 if unpadded), out is unpadded.
+	// width and height even, rows past the last whole block of a shrunk
+	// format are left out. -1 if there is no way from src to dst
+
+int  convert_size(unsigned int dst, int width, int height);
+	// bytes convert_frame writes, -1 if dst isn't written
+
+struct pipe;
+const unsigned char* convert_derived(struct pipe* p, void* handle,
+	const void* buf, unsigned int dst);
+	// the pulled frame (handle, buf) in dst, converted at most once per
+	// frame and shared by every dst of the pipe asking for it (see 
+	// pipe_derive). no conversion if the frame is dst already (or starts
+	// with the Y plane for GREY). NULL if it can't be converted
+const unsigned char* convert_luma(struct pipe* p, void* handle,
+	const void* buf, int* stride);
+	// Y of the pulled frame without copying it when the frame starts 
+	// with the Y plane (YU12, NV12, 422P, GREY), padding included, else
+	// as convert_derived GREY. stride is set to bytes per line
+
+// big frames are split into bands of rows converted in parallel, every
+// function above but convert_derived (which converts with convert_frame)
+
+#define CONVERT_POOL_PIXELS (1280 * 720)
+
+struct tpool;
+void convert_pool(struct tpool* tp, int min_pixels);
+	// frames of at least min_pixels (0 for CONVERT_POOL_PIXELS) are 
+	// converted across tp from now on, smaller ones stay on the calling
+	// thread. NULL stops using a pool for conversions started afterwards,
+	// tp may be closed once the threads converting are joined
+
+const char* convert_kernel(void);
+	// name of the kernel convert_yuv420_bgra8888 runs with
+
+#endif
@@ -25,6 +25,10 @@
 #define VIDEO_PALETTE_PLANAR    13      /* start of planar entries */
 #define VIDEO_PALETTE_COMPONENT 7       /* start of component entries */
 
+#define IO_METHOD_MMAP          0   /* driver buffer is converted into a pipe buffer */
+#define IO_METHOD_MMAP_ZC       1   /* driver buffer is handed to the pipe as is */
+#define IO_METHOD_USERPTR       2   /* driver captures into pipe buffers */
+
 #define motion_log(lvl, i, fmt, args...) fprintf(stderr, fmt "\n", ##args)
 
 #ifdef __GNUC__
@@ -77,6 +81,7 @@ struct config {
 		# V4L2_PIX_FMT_YUYV    : 6  'YUYV'
 		# V4L2_PIX_FMT_YUV422P : 7  '422P'
 		# V4L2_PIX_FMT_YUV420  : 8  'YU12'
+		# V4L2_PIX_FMT_NV12    : 9  'NV12'
 		*/
 	int autobright; 
 		/*
@@ -131,11 +136,82 @@ struct config {
  		# The frequency to set the tuner to (kHz) (only for TV tuner cards) (default: 0)
 		*/
 	int tuner_number; // 0 - only used for BSD
+	int io_method; // 0
+		/*
+		# How captured frames get into the pipe
+		# Values :
+		# IO_METHOD_MMAP    : 0  converted or copied from the driver buffer
+		# IO_METHOD_MMAP_ZC : 1  zero-copy, the driver buffer itself is pushed
+		#                        and requeued when the last consumer puts it
+		# IO_METHOD_USERPTR : 2  zero-copy, pipe buffers are queued to the
+		#                        driver (vid_queue) which captures into them,
+		#                        falls back to 0 if the driver can't do it
+		# 1 and 2 need YU12 from the driver (or passthrough), otherwise 
+		# fall back to 0 in vid_v4l2_start()
+		*/
+	int decode_threads; // 0
+		/*
+		# Threads decoding MJPEG/JPEG frames in parallel, in capture order
+		# 0 decodes in the capture thread (vid_next)
+		*/
+	int convert_threads; // 0
+		/*
+		# Threads converting one frame in bands of rows, for frames of
+		# CONVERT_POOL_PIXELS (1280x720) or more, smaller ones aren't split
+		# 0 and 1 convert on the thread asking for it
+		*/
+	int v4l2_buffers; // 0
+		/*
+		# Buffers the driver captures into, 0 for 4 (MMAP_BUFFERS), at
+		# least 2. in zero-copy mode they are held by consumers too
+		*/
+	int low_latency; // 0
+		/*
+		# 1 is the low latency preset: as few driver buffers (2) and as
+		# short pipe queues (1) as will do, so a frame is never behind 
+		# others captured earlier. fewer frames are buffered against
+		# hiccups of the consumers
+		*/
+	int passthrough; // 0
+		/*
+		# 0 converts every format to YUV420P before it goes into the pipe
+		# 1 pushes frames in the format the driver delivers, frame_info
+		#   says which, and every consumer converts once to what it needs
+		#   with convert_frame(). formats convert_frame can't read (MJPEG,
+		#   RGB24, ...) are still converted to YUV420P
+		# zero-copy modes also work for any passed through format
+		*/
 	const char* video_device; // /dev/video0
+		/*
+		# The capture device, or "file:<path>" to play a file instead
+		# (replay.h): Y4M, MJPEG (.mjpg, .mjpeg, .jpg) or raw frames in
+		# v4l2_palette at width x height, one of SBGGR8, RGB24 (read as
+		# B, G, R like the camera's), UYVY, YUYV, YUV422P, YUV420 or
+		# NV12 (YUV420 if -1). frames are paced as in replay_timing and
+		# go into the pipe like captured ones
+		*/
+	int replay_timing; // 0
+		/*
+		# How a file is played
+		# Values :
+		# REPLAY_ORIGINAL : 0  at the rate in the file, frame_limit if it
+		#                      has none (raw, MJPEG)
+		# REPLAY_FIXED    : 1  at frame_limit
+		# REPLAY_FAST     : 2  as fast as frames are taken, for throughput
+		# late frames are skipped like a driver drops them (not with 2)
+		*/
+	int replay_loop; // 0
+		/*
+		# 1 starts a file over at its end, 0 plays it once after which
+		# vid_next* return VID_END
+		*/
 };
 
+struct video_dev;
+
 struct context {
 	int video_dev;
+	struct video_dev* dev; // of video_dev, set by vid_v4l2_start
 
 	struct config conf;
 	struct images imgs;
@@ -175,18 +251,34 @@ struct video_dev {
     int v4l_maxbuffer;
     int v4l_bufsize;
 #endif
+
+    /* file: video_device, instead of v4l2 */
+    void *file_private;
 };
 
 /*
  * function definitions
  */
+struct frame_info; /* pipe.h */
+
 extern unsigned short int debug_level;
 
+/* vid_next* return 0 with a frame, 1 if there was none this time, -1 on
+ * errors and VID_END once a file (conf.replay_loop 0) is played */
+#define VID_END 2
+
 void vid_init(void);
 void vid_cleanup(void);
 
 int vid_v4l2_start(struct context *cnt);
 int vid_next(struct context* cnt, unsigned char* map);
+int vid_next_ref(struct context* cnt, unsigned char** map);
+void vid_release(void* cnt, void* map);
+int vid_queue(struct context* cnt, void* handle, void* map, int len);
+int vid_next_userptr(struct context* cnt, void** handle);
+void vid_frame_info(struct context* cnt, struct frame_info* info);
+unsigned int vid_pixformat(struct context* cnt);
+int vid_nonblock(struct context* cnt);
 
 void vid_close(struct context *cnt);
 
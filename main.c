@@ -7,9 +7,15 @@
 
 #include "global.h"
 #include "pipe.h"
+#include "convert.h"
+#include "mjpeg.h"
+#include "tpool.h"
+#include "overlay.h"
+#include "replay.h"
 
 #include <unistd.h>
-#include <X11/Xlib.h>
+#include <linux/videodev2.h>
+#include "xdisplay.h"
 
 unsigned short int debug_level;
 
@@ -20,75 +26,78 @@ void sigint_handler(int signo)
 	finish = 1;
 }
 
-#define clamp(v, m, M) \
-	(((v) > (M)) ? (M) : ((v) < (m) ? (m) : (v)))
-
-void convert_yuv420_bgra8888(const unsigned char* yuv, unsigned char* rgb, int width, int height)
-{
-	int w, h;
-	unsigned char* p = rgb;
-	const unsigned char* y = yuv;
-	const unsigned char* u = y + (width * height);
-	const unsigned char* v = u + ((width / 2) * (height / 2));
-
-	for (h = 0; h < height; h++) {
-		for (w = 0; w < width; w++) {
-			int _y = y[h * width + w];
-			int _u = u[(h / 2) * (width / 2) + (w / 2)];
-			int _v = v[(h / 2) * (width / 2) + (w / 2)];
-
-			int rTmp = _y + (1.370705 * (_v-128));
-			int gTmp = _y - (0.698001 * (_v-128)) - (0.337633 * (_u-128));
-			int bTmp = _y + (1.732446 * (_u-128));
-
-			*p++ = clamp(bTmp, 0, 255); //blue
-			*p++ = clamp(gTmp, 0, 255); //green
-			*p++ = clamp(rTmp, 0, 255); //red
-			*p++ = 255;
-		}
-	}
-}
-
 #define WIDTH   640
 #define HEIGHT  480
+#define OSD_SCALE 2 // glyphs of 10x14
 
 volatile int render_thread_fps = 0;
+volatile int render_thread_latency = 0; // ms, capture to display
+
+// wall time, frame and the rate and latency of the last period on the
+// top left of the image
+static void draw_osd(struct overlay* ov, unsigned char* image, int buf_seq)
+{
+	char text[64];
+	struct tm tm;
+	time_t t = time(NULL);
+
+	localtime_r(&t, &tm);
+	snprintf(text, sizeof(text), "%02d:%02d:%02d #%d %d fps %d ms",
+		tm.tm_hour, tm.tm_min, tm.tm_sec, buf_seq, render_thread_fps,
+		render_thread_latency);
+	overlay_text(ov, image, WIDTH, HEIGHT, 0, 0, text,
+		OVERLAY_RGB(255, 255, 255), OVERLAY_RGB(0, 0, 0));
+}
 
 void* render_thread(void* argv)
 {
 	struct pipe* p = (struct pipe*)argv;
-    static char image32[WIDTH*HEIGHT*4];
-    Display* display = XOpenDisplay(NULL);
-    Visual* visual = DefaultVisual(display, 0);
-    Window window = XCreateSimpleWindow(display, 
-		RootWindow(display, 0), 0, 0, WIDTH, HEIGHT, 1, 0, 0);
-    XImage* ximage = XCreateImage(display, visual, 24, ZPixmap, 0, 
-		image32, WIDTH, HEIGHT, 32, 0);
-    XMapWindow(display, window);
+	struct xdisplay xd;
+	struct overlay ov;
 	struct timespec t_start;
-	int seq;
+	uint64_t lat_ns = 0;
+	int seq, id;
 
-    if(visual->class!=TrueColor) {
-		fprintf(stderr, "Cannot handle non true color visual ...\n");
+	if (init_overlay(&ov, OSD_SCALE)) {
+		fprintf(stderr, "unable to init overlay\n");
 		return (void*)-1;
-    }
+	}
+
+	if (init_xdisplay(&xd, WIDTH, HEIGHT, 1)) {
+		fprintf(stderr, "unable to open display\n");
+		close_overlay(&ov);
+		return (void*)-1;
+	}
+
+	// render always wants the latest frame
+	if ((id = attach_dst(p, PIPE_DROP_OLDEST)) < 0) {
+		fprintf(stderr, "unable to attach render thread\n");
+		close_xdisplay(&xd);
+		close_overlay(&ov);
+		return (void*)-1;
+	}
 
 	clock_gettime(CLOCK_REALTIME, &t_start);
 	for (seq = 0; !finish; ) {
 		int buf_seq;
 		const void* buf;
-		void* h = pull_buf(p, 0, &buf, &buf_seq);
+		void* h = pull_buf_wait(p, id, &buf, &buf_seq, 100);
 
-		if (!h) {
-			usleep(1000);
+		if (!h)
 			continue;
-		}
 			
-		convert_yuv420_bgra8888(buf, image32, WIDTH, HEIGHT);
+		// straight into the image the server reads, from whatever the 
+		// camera delivers
+		if (convert_frame(buf_info(h)->fourcc, (const unsigned char*)buf, 
+				buf_info(h)->stride, CONVERT_BGR4, xdisplay_image(&xd), 
+				WIDTH, HEIGHT)) {
+			put_buf(p, h);
+			continue;
+		}
+		draw_osd(&ov, xdisplay_image(&xd), buf_seq);
+		xdisplay_put(&xd);
 
-		XPutImage(display, window, DefaultGC(display, 0), 
-							ximage, 0, 0, 0, 0, WIDTH, HEIGHT);
-			
+		lat_ns += pipe_clock_ns() - buf_info(h)->t_capture;
 		put_buf(p, h);
 
 		if (seq == 30) {
@@ -98,16 +107,43 @@ void* render_thread(void* argv)
 			clock_gettime(CLOCK_REALTIME, &t_now);
 			t_ms = (t_now.tv_sec - t_start.tv_sec) * 1e3;
 			t_ms += ((t_now.tv_nsec - t_start.tv_nsec) / 1e6);
+			if (t_ms < 1) // a file played as fast as possible
+				t_ms = 1;
 
 			render_thread_fps = (seq * (int)1e3) / t_ms;
+			render_thread_latency = lat_ns / seq / 1000000;
 
 			t_start = t_now;
+			lat_ns = 0;
 
 			seq = 0;
 		}
 
 		seq++;
 	}
+
+	detach_dst(p, id);
+	close_xdisplay(&xd);
+	close_overlay(&ov);
+	return NULL;
+}
+
+// from a decoder thread, in capture order
+void decoded(void* arg, void* h, int seq, int ok)
+{
+	struct pipe* p = (struct pipe*)arg;
+	struct frame_info* info = buf_info(h);
+
+	if (!ok) { //corrupt frame, buffer goes back unused
+		drop_buf(p, h);
+		return;
+	}
+
+	info->t_convert = pipe_clock_ns();
+	info->fourcc = V4L2_PIX_FMT_YUV420;
+	info->stride = info->width;
+	info->bytesused = info->width * info->height * 3 / 2;
+	push_buf(p, h, seq);
 }
 
 int main(int argc, char* argv[])
@@ -115,8 +151,18 @@ int main(int argc, char* argv[])
 	struct context ctxt = {0};
 	struct pipe p;
 	int seq, ret, seq_abs;
-	struct timespec t_start;
+	unsigned int i;
+	struct timespec t_start, t_begin;
+	unsigned int drv_seq = 0, drv_drops = 0;
 	pthread_t threads[3] = {0};
+	void* h_free = NULL; // pipe buffer the driver had no room for (USERPTR)
+	                     // or a bad frame was written into (copy)
+	void* buf_free;
+	int buf_sz;
+	struct mjpeg_pool mp;
+	int decode_pool = 0;
+	struct tpool tp;
+	int convert_pool_on = 0;
 
 
 	/* 
@@ -127,22 +173,6 @@ int main(int argc, char* argv[])
         exit(0);
     }
 
-	/* 
-	 * setup pipe
-	 */
-	if (init_pipe(&p, 1, 2, WIDTH * HEIGHT * 2)) {
-		fprintf(stderr, "unable to setup pipe\n");
-		exit(0);
-	}
-
-	/*
-	 * setup threads
-	 */
-	if (pthread_create(&threads[0], NULL, render_thread, &p)) {
-		fprintf(stderr, "unable to start render thread\n");
-		exit(0);
-	}
-
 	/* 
 	 * setup webcam
 	 */
@@ -155,10 +185,37 @@ int main(int argc, char* argv[])
 	ctxt.conf.width = WIDTH;
 	ctxt.conf.height = HEIGHT;
 	ctxt.conf.video_device = "/dev/video0";
+	ctxt.conf.io_method = IO_METHOD_MMAP_ZC;
+	ctxt.conf.decode_threads = 2;
+	ctxt.conf.convert_threads = 2;
+	ctxt.conf.passthrough = 1;
+	ctxt.conf.v4l2_buffers = 0;
+	ctxt.conf.low_latency = 0;
+	ctxt.conf.replay_timing = REPLAY_ORIGINAL;
+	ctxt.conf.replay_loop = 0;
+
+	// [device [original|fixed|fast]], a camera or file:<path>
+	if (argc > 1)
+		ctxt.conf.video_device = argv[1];
+	if (argc > 2)
+		ctxt.conf.replay_timing = !strcmp(argv[2], "fast") ? REPLAY_FAST :
+			!strcmp(argv[2], "fixed") ? REPLAY_FIXED : REPLAY_ORIGINAL;
 
 	//ctxt.imgs.type assigned in vid_v4l2_start()
 	//also type is set statically to VIDEO_PALETTE_YUV420P in v4l2_start()
 
+	/*
+	 * setup conversion threads before anything is converted
+	 */
+	if (ctxt.conf.convert_threads > 1) {
+		if (init_tpool(&tp, ctxt.conf.convert_threads)) {
+			fprintf(stderr, "unable to start conversion threads\n");
+			exit(0);
+		}
+		convert_pool(&tp, 0);
+		convert_pool_on = 1;
+	}
+
 	vid_init();
 	ret = vid_v4l2_start(&ctxt);
 	if (ret == -1) {
@@ -166,31 +223,148 @@ int main(int argc, char* argv[])
 		exit(0);
 	}
 
+	/* 
+	 * setup pipe, consumers attach themselves
+	 * in mmap zero-copy mode frames live in the driver buffers
+	 * otherwise they are what vid_next writes (imgs.size). queues are
+	 * a frame deep in low latency mode
+	 */
+	buf_sz = ctxt.imgs.size > WIDTH * HEIGHT * 2 ? 
+		ctxt.imgs.size : WIDTH * HEIGHT * 2;
+	if (init_pipe_pool(&p, 4, ctxt.conf.low_latency ? 1 : 2, 
+			ctxt.conf.io_method == IO_METHOD_MMAP_ZC ? 0 : buf_sz)) {
+		fprintf(stderr, "unable to setup pipe\n");
+		exit(0);
+	}
+
+	/*
+	 * setup mjpeg decoder threads, they push frames in capture order
+	 */
+	if (ctxt.conf.decode_threads > 0 && 
+		(vid_pixformat(&ctxt) == V4L2_PIX_FMT_MJPEG ||
+		 vid_pixformat(&ctxt) == V4L2_PIX_FMT_JPEG)) {
+		if (init_mjpeg_pool(&mp, ctxt.conf.decode_threads, 
+				ctxt.conf.decode_threads * 2, decoded, &p)) {
+			fprintf(stderr, "unable to start decoder threads\n");
+			exit(0);
+		}
+		decode_pool = 1;
+	}
+
+	/*
+	 * setup threads
+	 */
+	if (pthread_create(&threads[0], NULL, render_thread, &p)) {
+		fprintf(stderr, "unable to start render thread\n");
+		exit(0);
+	}
+
 	/* 
 	 * capture & display loop
 	 */
 	clock_gettime(CLOCK_REALTIME, &t_start);
+	t_begin = t_start;
 	for (seq_abs = seq = 1; !finish; ) {
+		unsigned char* map;
 		void* buf;
-		void* h = get_buf(&p, &buf);
-
-		if (!h) { //no more empty so skipping!
-			usleep(1000);
-			continue;
+		void* h;
+
+		if (decode_pool) {
+			if (!h_free)
+				h_free = get_buf_wait(&p, &buf_free, 100);
+			if (!h_free) //no more empty so skipping!
+				continue;
+
+			// compressed frame stays in the driver buffer until decoded
+			if ((ret = vid_next_ref(&ctxt, &map))) {
+				if (ret == VID_END) // file played
+					finish = 1;
+				continue;
+			}
+			h = h_free;
+			buf = buf_free;
+			h_free = NULL;
+		} else if (ctxt.conf.io_method == IO_METHOD_MMAP_ZC) {
+			if ((ret = vid_next_ref(&ctxt, &map))) {
+				if (ret == VID_END) // file played
+					finish = 1;
+				continue;
+			}
+
+			h = get_buf_zc(&p, map, vid_release, &ctxt);
+			if (!h) { //no more handles so dropping!
+				vid_release(&ctxt, map);
+				continue;
+			}
+		} else if (ctxt.conf.io_method == IO_METHOD_USERPTR) {
+			// keep the driver fed with every free pipe buffer
+			ret = 0;
+			while (h_free || (h_free = get_buf(&p, &buf_free))) {
+				if ((ret = vid_queue(&ctxt, h_free, buf_free, buf_sz)))
+					break;
+				h_free = NULL;
+			}
+			if (ret < 0) { // the same buffer would fail again
+				fprintf(stderr, "unable to queue buffer\n");
+				finish = 1;
+				continue;
+			}
+
+			if ((ret = vid_next_userptr(&ctxt, &h))) {
+				if (ret < 0) {
+					fprintf(stderr, "unable to capture\n");
+					finish = 1;
+				} else if (!h_free) //driver has nothing, wait
+					h_free = get_buf_wait(&p, &buf_free, 100);
+				continue;
+			}
+		} else {
+			if (!h_free)
+				h_free = get_buf_wait(&p, &buf_free, 100);
+			if (!h_free) //no more empty so skipping!
+				continue;
+
+			// broken (e.g. corrupt jpeg) frames keep the buffer for the next
+			if ((ret = vid_next(&ctxt, buf_free))) {
+				if (ret == VID_END)
+					finish = 1;
+				continue;
+			}
+			h = h_free;
+			h_free = NULL;
 		}
 
-		vid_next(&ctxt, buf);
-		push_buf(&p, h, seq_abs);
+		// driver sequence gaps are frames lost before they reached us
+		vid_frame_info(&ctxt, buf_info(h));
+		if (seq_abs > 1)
+			drv_drops += buf_info(h)->sequence - drv_seq - 1;
+		drv_seq = buf_info(h)->sequence;
+
+		if (!decode_pool) {
+			push_buf(&p, h, seq_abs);
+		} else if (mjpeg_pool_submit(&mp, map, buf_info(h)->bytesused, 
+				vid_release, &ctxt, h, (unsigned char*)buf, 
+				WIDTH, HEIGHT, 1, seq_abs)) {
+			vid_release(&ctxt, map);
+			drop_buf(&p, h);
+		}
 
 		if (seq == 30) {
 			struct timespec t_now;
+			struct pipe_stats st;
 			int t_ms;
 
 			clock_gettime(CLOCK_REALTIME, &t_now);
 			t_ms = (t_now.tv_sec - t_start.tv_sec) * 1e3;
 			t_ms += ((t_now.tv_nsec - t_start.tv_nsec) / 1e6);
+			if (t_ms < 1) // a file played as fast as possible
+				t_ms = 1;
 
-			printf("%d \t %d \n", (seq * (int)1e3) / t_ms, render_thread_fps);
+			pipe_stats(&p, &st);
+			printf("%d \t %d \t %d ms \t %d bufs, exhausted %u, "
+				"driver drops %u\n", 
+				(seq * (int)1e3) / t_ms, render_thread_fps, 
+				render_thread_latency, st.n_alloc, st.exhausted, drv_drops);
 
 			t_start = t_now;
 
@@ -202,7 +376,30 @@ int main(int argc, char* argv[])
 	}
 
 out_vid : 
+	// the whole run, throughput of a file played as fast as possible
+	clock_gettime(CLOCK_REALTIME, &t_start);
+	printf("%d frames in %d ms\n", seq_abs - 1,
+		(int)((t_start.tv_sec - t_begin.tv_sec) * 1e3 + 
+		(t_start.tv_nsec - t_begin.tv_nsec) / 1e6));
+
+	/*
+	 * consumers go first, they may be converting a frame that lives in a
+	 * driver buffer (or the mapped file) and give it back with put_buf.
+	 * the decoders emit what is left into the pipe. buffers the driver
+	 * still holds (USERPTR) are pipe memory so the pipe goes last
+	 */
+	finish = 1;
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+		if (threads[i])
+			pthread_join(threads[i], NULL);
+	if (decode_pool)
+		close_mjpeg_pool(&mp);
 	vid_close(&ctxt);
+	close_pipe(&p);
+	if (convert_pool_on) { // nothing converts anymore
+		convert_pool(NULL, 0);
+		close_tpool(&tp);
+	}
 
     return 0;
 }
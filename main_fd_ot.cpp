@@ -7,14 +7,23 @@
 
 #include "global.h"
 #include "pipe.h"
+#include "convert.h"
+#include "mjpeg.h"
+#include "tpool.h"
+#include "overlay.h"
+#include "replay.h"
+#include "result.h"
 
 #include <unistd.h>
-#include <X11/Xlib.h>
+#include <linux/videodev2.h>
+#include "xdisplay.h"
 
 #include <opencv2/objdetect.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/tracking/tracker.hpp>
 
+#include <algorithm>
+
 unsigned short int debug_level;
 
 volatile int finish = 0;
@@ -24,117 +33,125 @@ void sigint_handler(int signo)
 	finish = 1;
 }
 
-#define clamp(v, m, M) \
-	(((v) > (M)) ? (M) : ((v) < (m) ? (m) : (v)))
-
-void convert_yuv420_bgra8888(const unsigned char* yuv, unsigned char* rgb, int width, int height)
-{
-	int w, h;
-	unsigned char* p = rgb;
-	const unsigned char* y = yuv;
-	const unsigned char* u = y + (width * height);
-	const unsigned char* v = u + ((width / 2) * (height / 2));
-
-	for (h = 0; h < height; h++) {
-		for (w = 0; w < width; w++) {
-			int _y = y[h * width + w];
-			int _u = u[(h / 2) * (width / 2) + (w / 2)];
-			int _v = v[(h / 2) * (width / 2) + (w / 2)];
-
-			int rTmp = _y + (1.370705 * (_v-128));
-			int gTmp = _y - (0.698001 * (_v-128)) - (0.337633 * (_u-128));
-			int bTmp = _y + (1.732446 * (_u-128));
-
-			*p++ = clamp(bTmp, 0, 255); //blue
-			*p++ = clamp(gTmp, 0, 255); //green
-			*p++ = clamp(rTmp, 0, 255); //red
-			*p++ = 255;
-		}
-	}
-}
-
-void convert_yuv420_bgr888(const unsigned char* yuv, unsigned char* rgb, int width, int height)
-{
-	int w, h;
-	unsigned char* p = rgb;
-	const unsigned char* y = yuv;
-	const unsigned char* u = y + (width * height);
-	const unsigned char* v = u + ((width / 2) * (height / 2));
-
-	for (h = 0; h < height; h++) {
-		for (w = 0; w < width; w++) {
-			int _y = y[h * width + w];
-			int _u = u[(h / 2) * (width / 2) + (w / 2)];
-			int _v = v[(h / 2) * (width / 2) + (w / 2)];
-
-			int rTmp = _y + (1.370705 * (_v-128));
-			int gTmp = _y - (0.698001 * (_v-128)) - (0.337633 * (_u-128));
-			int bTmp = _y + (1.732446 * (_u-128));
-
-			*p++ = clamp(bTmp, 0, 255); //blue
-			*p++ = clamp(gTmp, 0, 255); //green
-			*p++ = clamp(rTmp, 0, 255); //red
-		}
-	}
-}
-
 #define WIDTH   640
 #define HEIGHT  480
+#define OSD_SCALE 2 // glyphs of 10x14
 
-volatile int render_thread_fps = 0;
+// detection and tracking run on frames shrunk by these (1, 2 or 4) in
+// the same pass that converts them, detection cost goes with the pixel
+// count. rectangles are mapped back to full size for the render thread
+#define DETECT_SCALE 2
+#define TRACK_SCALE  1
+#define DETECT_FMT (DETECT_SCALE > 1 ? CONVERT_GREY_DIV(DETECT_SCALE) : \
+	CONVERT_GREY)
+
+// trackers run on gray, straight on the Y plane of the frame at full
+// size (no conversion for planar formats), or on BGR with color names
+#define TRACK_GRAY   1
 
-pthread_spinlock_t obj_lock;
-cv::Rect obj_rect;
+volatile int render_thread_fps = 0;
+volatile int render_thread_latency = 0; // ms, capture to display
+
+// faces tracked on each frame, full size, from the tracker to render
+struct results results;
+
+// a face keeps its color for as long as it is tracked
+static const unsigned int face_colors[] = {
+	OVERLAY_RGB(255, 255, 255),
+	OVERLAY_RGB(0, 255, 0),
+	OVERLAY_RGB(255, 255, 0),
+	OVERLAY_RGB(0, 255, 255),
+	OVERLAY_RGB(255, 0, 255),
+	OVERLAY_RGB(255, 128, 0),
+};
+#define N_FACE_COLORS (int)(sizeof(face_colors) / sizeof(face_colors[0]))
+
+// wall time, frame and the rate and latency of the last period on the
+// top left of the image
+static void draw_osd(struct overlay* ov, unsigned char* image, int buf_seq)
+{
+	char text[64];
+	struct tm tm;
+	time_t t = time(NULL);
+
+	localtime_r(&t, &tm);
+	snprintf(text, sizeof(text), "%02d:%02d:%02d #%d %d fps %d ms",
+		tm.tm_hour, tm.tm_min, tm.tm_sec, buf_seq, render_thread_fps,
+		render_thread_latency);
+	overlay_text(ov, image, WIDTH, HEIGHT, 0, 0, text,
+		OVERLAY_RGB(255, 255, 255), OVERLAY_RGB(0, 0, 0));
+}
 
 void* render_thread(void* argv)
 {
 	struct pipe* p = (struct pipe*)argv;
-    static char image32[WIDTH*HEIGHT*4];
-    static char image16[WIDTH*HEIGHT*2];
-    Display* display = XOpenDisplay(NULL);
-    Visual* visual = DefaultVisual(display, 0);
-    Window window = XCreateSimpleWindow(display, 
-		RootWindow(display, 0), 0, 0, WIDTH, HEIGHT, 1, 0, 0);
-    XImage* ximage = XCreateImage(display, visual, 24, ZPixmap, 0, 
-		image32, WIDTH, HEIGHT, 32, 0);
-    XMapWindow(display, window);
+	struct xdisplay xd;
+	struct overlay ov;
 	struct timespec t_start;
-	int seq;
-	cv::Mat image(HEIGHT, WIDTH, 0, CV_MAT_CONT_FLAG);
+	uint64_t lat_ns = 0;
+	int seq, id;
 
-	image.data = (uchar*)image16;
+	if (init_overlay(&ov, OSD_SCALE)) {
+		fprintf(stderr, "unable to init overlay\n");
+		return (void*)-1;
+	}
 
-#if 0
-	// doesn't compile with g++
-    if(visual->class != TrueColor) {
-		fprintf(stderr, "Cannot handle non true color visual ...\n");
+	if (init_xdisplay(&xd, WIDTH, HEIGHT, 1)) {
+		fprintf(stderr, "unable to open display\n");
+		close_overlay(&ov);
 		return (void*)-1;
-    }
-#endif
+	}
+
+	// render always wants the latest frame
+	if ((id = attach_dst(p, PIPE_DROP_OLDEST)) < 0) {
+		fprintf(stderr, "unable to attach render thread\n");
+		close_xdisplay(&xd);
+		close_overlay(&ov);
+		return (void*)-1;
+	}
 
 	clock_gettime(CLOCK_REALTIME, &t_start);
 	for (seq = 0; !finish; ) {
-		int buf_seq, i;
+		int buf_seq, ret;
 		const void* buf;
-		void* h = pull_buf(p, 0, &buf, &buf_seq);
+		uint64_t t_capture;
+		struct result res;
+		unsigned char* image;
+		void* h = pull_buf_wait(p, id, &buf, &buf_seq, 100);
 
-		if (!h) {
-			usleep(1000);
+		if (!h)
 			continue;
-		}
 
-		memcpy(image16, buf, WIDTH * HEIGHT * 2);
+		// straight into the image the server reads, from whatever the
+		// camera delivers, boxes and text are drawn over it
+		image = xdisplay_image(&xd);
+		ret = convert_frame(buf_info(h)->fourcc, (const unsigned char*)buf,
+			buf_info(h)->stride, CONVERT_BGR4, image, WIDTH, HEIGHT);
+		t_capture = buf_info(h)->t_capture;
 		put_buf(p, h);
+		if (ret)
+			continue;
 
-		pthread_spin_lock(&obj_lock);
-		cv::rectangle(image, obj_rect, 255);
-		pthread_spin_unlock(&obj_lock);
-			
-		convert_yuv420_bgra8888((const unsigned char*)image16, 
-			(unsigned char*)image32, WIDTH, HEIGHT);
+		// the tracker is a frame or two behind, its boxes are moved on to
+		// this frame. labels sit on top of the box, inside at the top edge
+		if (!result_at(&results, buf_seq, 1, &res)) {
+			for (int i = 0; i < res.n; i++) {
+				const struct result_rect* r = &res.rects[i];
+				unsigned int color = face_colors[r->id % N_FACE_COLORS];
+				int y = r->y - overlay_line_height(&ov) - OSD_SCALE;
+				char label[16];
+
+				overlay_rect(&ov, image, WIDTH, HEIGHT, r->x, r->y,
+					r->width, r->height, 2, color);
+				snprintf(label, sizeof(label), "face %d", r->id);
+				overlay_text(&ov, image, WIDTH, HEIGHT, r->x, y < 0 ? r->y : y,
+					label, OVERLAY_RGB(0, 0, 0), color);
+			}
+		}
+		draw_osd(&ov, image, buf_seq);
+		xdisplay_put(&xd);
 
-		XPutImage(display, window, DefaultGC(display, 0), 
-							ximage, 0, 0, 0, 0, WIDTH, HEIGHT);
+		lat_ns += pipe_clock_ns() - t_capture;
 
 		if (seq == 30) {
 			struct timespec t_now;
@@ -143,10 +160,14 @@ void* render_thread(void* argv)
 			clock_gettime(CLOCK_REALTIME, &t_now);
 			t_ms = (t_now.tv_sec - t_start.tv_sec) * 1e3;
 			t_ms += ((t_now.tv_nsec - t_start.tv_nsec) / 1e6);
+			if (t_ms < 1) // a file played as fast as possible
+				t_ms = 1;
 
 			render_thread_fps = (seq * (int)1e3) / t_ms;
+			render_thread_latency = lat_ns / seq / 1000000;
 
 			t_start = t_now;
+			lat_ns = 0;
 
 			seq = 0;
 		}
@@ -154,9 +175,180 @@ void* render_thread(void* argv)
 		seq++;
 	}
 
+	detach_dst(p, id);
+	close_xdisplay(&xd);
+	close_overlay(&ov);
 	return NULL;
 }
 
+// every face found is tracked on its own (KCF) from frame to frame, the
+// cascade runs every detect_every frames and right away when a tracker
+// loses its face. detect_every follows the measured costs so that
+// detection adds about as much per frame as tracking does
+#define DETECT_EVERY_MIN 2
+#define DETECT_EVERY_MAX 30
+#define MISSES_MAX       2   // detections in a row without the face, gone
+#define MATCH_OVERLAP    0.3 // a detection is a tracked face from here
+#define DRIFT_OVERLAP    0.5 // a tracked face starts over below this
+
+struct face {
+	cv::Ptr<cv::Tracker> tracker;
+	cv::Rect2d rect; // in the tracked frame
+	int lost;        // tracker failed, rect is where it was last
+	int misses;
+	int id;          // kept when the face starts over
+};
+
+static cv::Rect2d scale_rect(const cv::Rect2d& r, double s)
+{
+	return cv::Rect2d(r.x * s, r.y * s, r.width * s, r.height * s);
+}
+
+// intersection over union
+static double overlap(const cv::Rect2d& a, const cv::Rect2d& b)
+{
+	double x0 = std::max(a.x, b.x), x1 = std::min(a.x + a.width, b.x + b.width);
+	double y0 = std::max(a.y, b.y), y1 = std::min(a.y + a.height, b.y + b.height);
+	double i = x1 > x0 && y1 > y0 ? (x1 - x0) * (y1 - y0) : 0;
+
+	return i / (a.width * a.height + b.width * b.height - i);
+}
+
+static cv::Ptr<cv::Tracker> new_tracker(void)
+{
+#if TRACK_GRAY
+	cv::TrackerKCF::Params params;
+
+	// color names need 3 channels
+	params.desc_pca = 0;
+	params.desc_npca = cv::TrackerKCF::GRAY;
+	return cv::TrackerKCF::createTracker(params);
+#else
+	return cv::Tracker::create("KCF");
+#endif
+}
+
+// the frame trackers run on, -1 if it can't be had. only valid until
+// put_buf
+static int track_frame(struct pipe* p, void* h, const void* buf, 
+	cv::Mat* frame)
+{
+	const unsigned char* data;
+	int stride;
+
+#if TRACK_GRAY
+	if (TRACK_SCALE == 1) {
+		data = convert_luma(p, h, buf, &stride);
+	} else {
+		data = convert_derived(p, h, buf, CONVERT_GREY_DIV(TRACK_SCALE));
+		stride = WIDTH / TRACK_SCALE;
+	}
+	if (!data)
+		return -1;
+	*frame = cv::Mat(HEIGHT / TRACK_SCALE, WIDTH / TRACK_SCALE, CV_8UC1, 
+		(void*)data, stride);
+#else
+	data = convert_derived(p, h, buf, TRACK_SCALE > 1 ? 
+		CONVERT_BGR3_DIV(TRACK_SCALE) : CONVERT_BGR3);
+	stride = (WIDTH / TRACK_SCALE) * 3;
+	if (!data)
+		return -1;
+	*frame = cv::Mat(HEIGHT / TRACK_SCALE, WIDTH / TRACK_SCALE, CV_8UC3, 
+		(void*)data, stride);
+#endif
+
+	return 0;
+}
+
+// KCF can't be initialized twice, a face starting over gets a new one
+static void start_face(struct face* f, const cv::Rect2d& r, 
+	const cv::Mat& frame_t)
+{
+	f->tracker = new_tracker();
+	f->rect = r;
+	f->lost = f->tracker == NULL || !f->tracker->init(frame_t, r);
+	f->misses = 0;
+}
+
+// detections (in frame8) against the faces. a lost or drifted face
+// starts over on the detection it overlaps most, faces no detection
+// overlaps miss and are dropped after MISSES_MAX, detections left over
+// are new faces
+static void match_faces(std::vector<struct face>& faces, 
+	const std::vector<cv::Rect>& found, const cv::Mat& frame_t)
+{
+	static int next_id;
+	std::vector<char> used(found.size(), 0);
+	size_t i, j;
+
+	for (i = 0; i < faces.size(); i++) {
+		double best = MATCH_OVERLAP;
+		int k = -1;
+
+		for (j = 0; j < found.size(); j++) {
+			double o = overlap(faces[i].rect, scale_rect(found[j], 
+				(double)DETECT_SCALE / TRACK_SCALE));
+
+			if (!used[j] && o > best) {
+				best = o;
+				k = j;
+			}
+		}
+
+		if (k < 0) {
+			faces[i].misses++;
+			continue;
+		}
+		used[k] = 1;
+		if (faces[i].lost || best < DRIFT_OVERLAP)
+			start_face(&faces[i], scale_rect(found[k], 
+				(double)DETECT_SCALE / TRACK_SCALE), frame_t);
+		faces[i].misses = 0;
+	}
+
+	for (i = 0; i < faces.size(); )
+		if (faces[i].misses >= MISSES_MAX)
+			faces.erase(faces.begin() + i);
+		else
+			i++;
+
+	for (j = 0; j < found.size(); j++) {
+		struct face f;
+
+		if (used[j])
+			continue;
+		start_face(&f, scale_rect(found[j], 
+			(double)DETECT_SCALE / TRACK_SCALE), frame_t);
+		if (f.lost)
+			continue;
+		f.id = next_id++;
+		faces.push_back(f);
+	}
+}
+
+static void publish_faces(const std::vector<struct face>& faces, int seq)
+{
+	struct result res;
+	size_t i;
+
+	res.seq = seq;
+	res.n = 0;
+	for (i = 0; i < faces.size() && res.n < RESULT_MAX_RECTS; i++) {
+		struct result_rect* r = &res.rects[res.n];
+		cv::Rect2d rect = scale_rect(faces[i].rect, TRACK_SCALE);
+
+		if (faces[i].lost)
+			continue;
+		r->id = faces[i].id;
+		r->x = rect.x;
+		r->y = rect.y;
+		r->width = rect.width;
+		r->height = rect.height;
+		res.n++;
+	}
+	publish_result(&results, &res);
+}
+
 // face detection grabbed from
 // http://docs.opencv.org/3.1.0/db/d28/tutorial_cascade_classifier.html#gsc.tab=0
 // tracker requires https://github.com/opencv/opencv_contrib
@@ -167,13 +359,18 @@ void* tracker_thread(void* argv)
 {
 	struct pipe* p = (struct pipe*)argv;
 	static char xml_path[128];
-	static char image24[WIDTH * HEIGHT * 3];
 	cv::CascadeClassifier face_cascade;
-	cv::Mat frame8(HEIGHT, WIDTH, CV_8UC1);
-	cv::Mat frame24(HEIGHT, WIDTH, CV_8UC3, image24);
-
-	cv::Rect2d face_rect2d;
-	cv::Ptr<cv::Tracker> tracker;
+	// point into the frame or conversions shared with other consumers
+	// (convert_derived), only valid until put_buf
+	cv::Mat frame8(HEIGHT / DETECT_SCALE, WIDTH / DETECT_SCALE, CV_8UC1, 
+		NULL);
+	cv::Mat frame_t; // track_frame()
+
+	std::vector<struct face> faces;
+	uint64_t t_detect = 0, t_track = 0; // ns, running averages
+	int detect_every = DETECT_EVERY_MIN;
+	int since = 0;                      // frames since the last detection
+	int id;
 
 	sprintf(xml_path, "%s/%s", OCV_PATH, 
 		"share/OpenCV/haarcascades/haarcascade_frontalface_alt.xml");
@@ -183,108 +380,123 @@ void* tracker_thread(void* argv)
 		return (void*)-1;
 	}
 
-	tracker = cv::Tracker::create("KCF");
-	if (tracker == NULL) {
+	if (new_tracker() == NULL) {
 		fprintf(stderr, "unble to create tracker\n");
 		return (void*)-1;
 	}
 
-	/* 
-	 * pull frame and detect objects
-	 */
+	// stale frames are useless to detect or track on
+	if ((id = attach_dst(p, PIPE_DROP_OLDEST)) < 0) {
+		fprintf(stderr, "unable to attach tracker thread\n");
+		return (void*)-1;
+	}
 
 	while (!finish) {
-		int buf_seq, i;
+		int buf_seq, lost = 0;
 		const void* buf;
 		void* h;
-		std::vector<cv::Rect> faces_rect;
+		uint64_t t;
+		size_t i;
 
-		if (!(h = pull_buf(p, 1, &buf, &buf_seq))) {
-			usleep(1000);
+		if (!(h = pull_buf_wait(p, id, &buf, &buf_seq, 100)))
 			continue;
-		}
-
-		frame8.data = (uchar*)buf;
-		face_cascade.detectMultiScale( frame8, faces_rect, 1.1, 2, 
-			cv::CASCADE_SCALE_IMAGE, cv::Size(30, 30) );
-
-		if (faces_rect.size()) {
-			printf("detected %d faces\n", faces_rect.size());
-
-			face_rect2d = faces_rect[0];
-
-			convert_yuv420_bgr888((const unsigned char*)buf, \
-							(unsigned char*)image24, WIDTH, HEIGHT);
 
+		if (track_frame(p, h, buf, &frame_t)) {
 			put_buf(p, h);
-			break;
+			continue;
 		}
 
-		put_buf(p, h);
-	}
-
-	/* 
-	 * tracker 
-	 */
-	if (finish) {
-		return NULL;
-	}
+		/* 
+		 * track every face
+		 */
+		t = pipe_clock_ns();
+		for (i = 0; i < faces.size(); i++) {
+			if (faces[i].lost)
+				continue;
+			if (!faces[i].tracker->update(frame_t, faces[i].rect))
+				faces[i].lost = 1;
+		}
+		for (i = 0; i < faces.size(); i++)
+			lost |= faces[i].lost;
+		if (faces.size())
+			t_track = (t_track * 7 + (pipe_clock_ns() - t)) / 8;
+
+		/* 
+		 * detect when due, a face was lost or there is none
+		 */
+		if (faces.empty() || lost || ++since >= detect_every) {
+			std::vector<cv::Rect> found;
+
+			frame8.data = (uchar*)convert_derived(p, h, buf, DETECT_FMT);
+			if (frame8.data) {
+				t = pipe_clock_ns();
+				face_cascade.detectMultiScale( frame8, found, 1.1, 2, 
+					cv::CASCADE_SCALE_IMAGE, 
+					cv::Size(30 / DETECT_SCALE, 30 / DETECT_SCALE) );
+				t_detect = t_detect ? 
+					(t_detect * 3 + (pipe_clock_ns() - t)) / 4 : 
+					pipe_clock_ns() - t;
+
+				match_faces(faces, found, frame_t);
+				since = 0;
+				if (t_track)
+					detect_every = std::min(std::max((int)(t_detect / t_track),
+						DETECT_EVERY_MIN), DETECT_EVERY_MAX);
+			}
+		}
 
-	if (!(tracker->init(frame24, face_rect2d))) {
-		fprintf(stderr, "unable to init tracker\n");
-		return (void*)-1;
+		put_buf(p, h);
+		publish_faces(faces, buf_seq);
 	}
 
-	pthread_spin_lock(&obj_lock);
-	obj_rect = face_rect2d;
-	pthread_spin_unlock(&obj_lock);
-
-	while (!finish) {
-		int buf_seq, i;
-		const void* buf;
-		void* h;
-
-		if (!(h = pull_buf(p, 1, &buf, &buf_seq)))  {
-			usleep(1000);
-			continue;
-		}
+	detach_dst(p, id);
+	return NULL;
+}
 
-		convert_yuv420_bgr888((const unsigned char*)buf, 
-			(unsigned char*)image24, WIDTH, HEIGHT);
-		put_buf(p, h);
 
-		if (!tracker->update(frame24, face_rect2d)) {
-			printf("unable to track\n");
-			break;
-		}
-			
-		//printf("tracked %d\n", trackers.objects.size());
+// from a decoder thread, in capture order
+void decoded(void* arg, void* h, int seq, int ok)
+{
+	struct pipe* p = (struct pipe*)arg;
+	struct frame_info* info = buf_info(h);
 
-		pthread_spin_lock(&obj_lock);
-		obj_rect = face_rect2d;
-		pthread_spin_unlock(&obj_lock);
+	if (!ok) { //corrupt frame, buffer goes back unused
+		drop_buf(p, h);
+		return;
 	}
 
-	return NULL;
+	info->t_convert = pipe_clock_ns();
+	info->fourcc = V4L2_PIX_FMT_YUV420;
+	info->stride = info->width;
+	info->bytesused = info->width * info->height * 3 / 2;
+	push_buf(p, h, seq);
 }
 
-
 int main(int argc, char* argv[])
 {
 	struct context ctxt = {0};
 	struct pipe p;
 	int seq, ret, seq_abs;
-	struct timespec t_start;
+	unsigned int i;
+	struct timespec t_start, t_begin;
+	unsigned int drv_seq = 0, drv_drops = 0;
 	pthread_t threads[3] = {0};
+	void* h_free = NULL; // pipe buffer the driver had no room for (USERPTR)
+	                     // or a bad frame was written into (copy)
+	void* buf_free;
+	int buf_sz;
+	struct mjpeg_pool mp;
+	int decode_pool = 0;
+	struct tpool tp;
+	int convert_pool_on = 0;
 
 	/* 
-	 * setup locks
+	 * setup tracker results
 	 */
-	if (pthread_spin_init(&obj_lock, PTHREAD_PROCESS_PRIVATE))  {
-        fprintf(stderr, "unable to setup spinlock\n");
+	if (init_results(&results)) {
+        fprintf(stderr, "unable to setup results\n");
 		exit(-1);
 	}
-	memset(&obj_rect, 0, sizeof(obj_rect));
 
 	/* 
 	 * setup signal
@@ -294,26 +506,6 @@ int main(int argc, char* argv[])
         exit(-1);
     }
 
-	/* 
-	 * setup pipe
-	 */
-	if (init_pipe(&p, 2, 2, WIDTH * HEIGHT * 2)) {
-		fprintf(stderr, "unable to setup pipe\n");
-		exit(-1);
-	}
-
-	/*
-	 * setup threads
-	 */
-	if (pthread_create(&threads[0], NULL, render_thread, &p)) {
-		fprintf(stderr, "unable to start render thread\n");
-		exit(-1);
-	}
-	if (pthread_create(&threads[1], NULL, tracker_thread, &p)) {
-		fprintf(stderr, "unable to start face detection thread\n");
-		exit(-1);
-	}
-
 	/* 
 	 * setup webcam
 	 */
@@ -326,10 +518,37 @@ int main(int argc, char* argv[])
 	ctxt.conf.width = WIDTH;
 	ctxt.conf.height = HEIGHT;
 	ctxt.conf.video_device = "/dev/video0";
+	ctxt.conf.io_method = IO_METHOD_MMAP_ZC;
+	ctxt.conf.decode_threads = 2;
+	ctxt.conf.convert_threads = 2;
+	ctxt.conf.passthrough = 1;
+	ctxt.conf.v4l2_buffers = 0;
+	ctxt.conf.low_latency = 0;
+	ctxt.conf.replay_timing = REPLAY_ORIGINAL;
+	ctxt.conf.replay_loop = 0;
+
+	// [device [original|fixed|fast]], a camera or file:<path>
+	if (argc > 1)
+		ctxt.conf.video_device = argv[1];
+	if (argc > 2)
+		ctxt.conf.replay_timing = !strcmp(argv[2], "fast") ? REPLAY_FAST :
+			!strcmp(argv[2], "fixed") ? REPLAY_FIXED : REPLAY_ORIGINAL;
 
 	//ctxt.imgs.type assigned in vid_v4l2_start()
 	//also type is set statically to VIDEO_PALETTE_YUV420P in v4l2_start()
 
+	/*
+	 * setup conversion threads before anything is converted
+	 */
+	if (ctxt.conf.convert_threads > 1) {
+		if (init_tpool(&tp, ctxt.conf.convert_threads)) {
+			fprintf(stderr, "unable to start conversion threads\n");
+			exit(0);
+		}
+		convert_pool(&tp, 0);
+		convert_pool_on = 1;
+	}
+
 	vid_init();
 	ret = vid_v4l2_start(&ctxt);
 	if (ret == -1) {
@@ -337,32 +556,152 @@ int main(int argc, char* argv[])
 		exit(-1);
 	}
 
+	/* 
+	 * setup pipe, consumers attach themselves
+	 * in mmap zero-copy mode frames live in the driver buffers
+	 * otherwise they are what vid_next writes (imgs.size). queues are
+	 * a frame deep in low latency mode
+	 */
+	buf_sz = ctxt.imgs.size > WIDTH * HEIGHT * 2 ? 
+		ctxt.imgs.size : WIDTH * HEIGHT * 2;
+	if (init_pipe_pool(&p, 6, ctxt.conf.low_latency ? 1 : 2, 
+			ctxt.conf.io_method == IO_METHOD_MMAP_ZC ? 0 : buf_sz)) {
+		fprintf(stderr, "unable to setup pipe\n");
+		exit(-1);
+	}
+
+	/*
+	 * setup mjpeg decoder threads, they push frames in capture order
+	 */
+	if (ctxt.conf.decode_threads > 0 && 
+		(vid_pixformat(&ctxt) == V4L2_PIX_FMT_MJPEG ||
+		 vid_pixformat(&ctxt) == V4L2_PIX_FMT_JPEG)) {
+		if (init_mjpeg_pool(&mp, ctxt.conf.decode_threads, 
+				ctxt.conf.decode_threads * 2, decoded, &p)) {
+			fprintf(stderr, "unable to start decoder threads\n");
+			exit(-1);
+		}
+		decode_pool = 1;
+	}
+
+	/*
+	 * setup threads
+	 */
+	if (pthread_create(&threads[0], NULL, render_thread, &p)) {
+		fprintf(stderr, "unable to start render thread\n");
+		exit(-1);
+	}
+	if (pthread_create(&threads[1], NULL, tracker_thread, &p)) {
+		fprintf(stderr, "unable to start face detection thread\n");
+		exit(-1);
+	}
+
 	/* 
 	 * capture & display loop
 	 */
 	clock_gettime(CLOCK_REALTIME, &t_start);
+	t_begin = t_start;
 	for (seq_abs = seq = 1; !finish; ) {
+		unsigned char* map;
 		void* buf;
-		void* h = get_buf(&p, &buf);
+		void* h;
 
-		if (!h) { //no more empty so skipping!
-			usleep(1000);
-			continue;
+		if (decode_pool) {
+			if (!h_free)
+				h_free = get_buf_wait(&p, &buf_free, 100);
+			if (!h_free) //no more empty so skipping!
+				continue;
+
+			// compressed frame stays in the driver buffer until decoded
+			if ((ret = vid_next_ref(&ctxt, &map))) {
+				if (ret == VID_END) // file played
+					finish = 1;
+				continue;
+			}
+			h = h_free;
+			buf = buf_free;
+			h_free = NULL;
+		} else if (ctxt.conf.io_method == IO_METHOD_MMAP_ZC) {
+			if ((ret = vid_next_ref(&ctxt, &map))) {
+				if (ret == VID_END) // file played
+					finish = 1;
+				continue;
+			}
+
+			h = get_buf_zc(&p, map, vid_release, &ctxt);
+			if (!h) { //no more handles so dropping!
+				vid_release(&ctxt, map);
+				continue;
+			}
+		} else if (ctxt.conf.io_method == IO_METHOD_USERPTR) {
+			// keep the driver fed with every free pipe buffer
+			ret = 0;
+			while (h_free || (h_free = get_buf(&p, &buf_free))) {
+				if ((ret = vid_queue(&ctxt, h_free, buf_free, buf_sz)))
+					break;
+				h_free = NULL;
+			}
+			if (ret < 0) { // the same buffer would fail again
+				fprintf(stderr, "unable to queue buffer\n");
+				finish = 1;
+				continue;
+			}
+
+			if ((ret = vid_next_userptr(&ctxt, &h))) {
+				if (ret < 0) {
+					fprintf(stderr, "unable to capture\n");
+					finish = 1;
+				} else if (!h_free) //driver has nothing, wait
+					h_free = get_buf_wait(&p, &buf_free, 100);
+				continue;
+			}
+		} else {
+			if (!h_free)
+				h_free = get_buf_wait(&p, &buf_free, 100);
+			if (!h_free) //no more empty so skipping!
+				continue;
+
+			// broken (e.g. corrupt jpeg) frames keep the buffer for the next
+			if ((ret = vid_next(&ctxt, (unsigned char*)buf_free))) {
+				if (ret == VID_END)
+					finish = 1;
+				continue;
+			}
+			h = h_free;
+			h_free = NULL;
 		}
 
-		vid_next(&ctxt, (unsigned char*)buf);
-		push_buf(&p, h, seq_abs);
+		// driver sequence gaps are frames lost before they reached us
+		vid_frame_info(&ctxt, buf_info(h));
+		if (seq_abs > 1)
+			drv_drops += buf_info(h)->sequence - drv_seq - 1;
+		drv_seq = buf_info(h)->sequence;
+
+		if (!decode_pool) {
+			push_buf(&p, h, seq_abs);
+		} else if (mjpeg_pool_submit(&mp, map, buf_info(h)->bytesused, 
+				vid_release, &ctxt, h, (unsigned char*)buf, 
+				WIDTH, HEIGHT, 1, seq_abs)) {
+			vid_release(&ctxt, map);
+			drop_buf(&p, h);
+		}
 
 		if (seq == 30) {
 			struct timespec t_now;
+			struct pipe_stats st;
 			int t_ms;
 
 			clock_gettime(CLOCK_REALTIME, &t_now);
 			t_ms = (t_now.tv_sec - t_start.tv_sec) * 1e3;
 			t_ms += ((t_now.tv_nsec - t_start.tv_nsec) / 1e6);
+			if (t_ms < 1) // a file played as fast as possible
+				t_ms = 1;
 
-			printf("%d \t %d\n", (seq * (int)1e3) / t_ms, 
-				render_thread_fps);
+			pipe_stats(&p, &st);
+			printf("%d \t %d \t %d ms \t %d bufs, exhausted %u, "
+				"driver drops %u\n", 
+				(seq * (int)1e3) / t_ms, render_thread_fps, 
+				render_thread_latency, st.n_alloc, st.exhausted, drv_drops);
 
 			t_start = t_now;
 
@@ -374,7 +713,30 @@ int main(int argc, char* argv[])
 	}
 
 out_vid : 
+	// the whole run, throughput of a file played as fast as possible
+	clock_gettime(CLOCK_REALTIME, &t_start);
+	printf("%d frames in %d ms\n", seq_abs - 1,
+		(int)((t_start.tv_sec - t_begin.tv_sec) * 1e3 + 
+		(t_start.tv_nsec - t_begin.tv_nsec) / 1e6));
+
+	/*
+	 * consumers go first, they may be converting a frame that lives in a
+	 * driver buffer (or the mapped file) and give it back with put_buf.
+	 * the decoders emit what is left into the pipe. buffers the driver
+	 * still holds (USERPTR) are pipe memory so the pipe goes last
+	 */
+	finish = 1;
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+		if (threads[i])
+			pthread_join(threads[i], NULL);
+	if (decode_pool)
+		close_mjpeg_pool(&mp);
 	vid_close(&ctxt);
+	close_pipe(&p);
+	if (convert_pool_on) { // nothing converts anymore
+		convert_pool(NULL, 0);
+		close_tpool(&tp);
+	}
 
     return 0;
 }
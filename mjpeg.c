@@ -0,0 +1,800 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <jpeglib.h>
+
+#include "mjpeg.h"
+
+struct mjpeg_priv {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jmp_buf jmp;
+
+	unsigned char* scratch; // rows that can't be decoded in place
+	int scratch_sz;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+	struct mjpeg_priv* d = (struct mjpeg_priv*)cinfo->client_data;
+
+	longjmp(d->jmp, 1);
+}
+
+// broken frames are common on USB, don't print a warning for each
+static void output_message(j_common_ptr cinfo)
+{
+}
+
+int init_mjpeg(struct mjpeg* m)
+{
+	struct mjpeg_priv* d;
+
+	d = (struct mjpeg_priv*)calloc(1, sizeof(*d));
+	if (!d)
+		return -1;
+
+	d->cinfo.err = jpeg_std_error(&d->jerr);
+	d->jerr.error_exit = error_exit;
+	d->jerr.output_message = output_message;
+	d->cinfo.client_data = d;
+
+	if (setjmp(d->jmp)) {
+		free(d);
+		return -1;
+	}
+	jpeg_create_decompress(&d->cinfo);
+
+	m->priv = (void*)d;
+	return 0;
+}
+
+void close_mjpeg(struct mjpeg* m)
+{
+	struct mjpeg_priv* d = (struct mjpeg_priv*)m->priv;
+
+	jpeg_destroy_decompress(&d->cinfo);
+	free(d->scratch);
+	free(d);
+}
+
+// longjmps on error, setjmp is up to the caller
+static void read_header(struct mjpeg_priv* d, const unsigned char* jpeg,
+	int len, int scale)
+{
+	jpeg_mem_src(&d->cinfo, (unsigned char*)jpeg, len);
+	jpeg_read_header(&d->cinfo, TRUE);
+
+	d->cinfo.raw_data_out = TRUE;
+	d->cinfo.scale_num = 1;
+	d->cinfo.scale_denom = scale;
+	jpeg_calc_output_dimensions(&d->cinfo);
+}
+
+static int valid_scale(int scale)
+{
+	return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+int mjpeg_size(struct mjpeg* m, const unsigned char* jpeg, int len,
+	int scale, int* width, int* height)
+{
+	struct mjpeg_priv* d = (struct mjpeg_priv*)m->priv;
+
+	if (!valid_scale(scale))
+		return -1;
+
+	if (setjmp(d->jmp)) {
+		jpeg_abort_decompress(&d->cinfo);
+		return -1;
+	}
+	read_header(d, jpeg, len, scale);
+
+	*width = d->cinfo.output_width;
+	*height = d->cinfo.output_height;
+	jpeg_abort_decompress(&d->cinfo);
+
+	return 0;
+}
+
+static unsigned char* get_scratch(struct mjpeg_priv* d, int sz)
+{
+	if (sz > d->scratch_sz) {
+		free(d->scratch);
+		d->scratch = (unsigned char*)malloc(sz);
+		d->scratch_sz = d->scratch ? sz : 0;
+		if (!d->scratch)
+			return NULL;
+	}
+	return d->scratch;
+}
+
+// chroma came at twice the 4:2:0 resolution horizontally (sx 2),
+// vertically (sy 2) or both
+static void down_420(unsigned char* dst, int w2, int h2,
+	const unsigned char* src, int src_stride, int sx, int sy)
+{
+	int x, y;
+
+	for (y = 0; y < h2; y++) {
+		const unsigned char* s0 = src + y * sy * src_stride;
+		const unsigned char* s1 = s0 + (sy - 1) * src_stride;
+		unsigned char* d = dst + y * w2;
+
+		if (sx == 2 && sy == 2) {
+			for (x = 0; x < w2; x++)
+				d[x] = (s0[2 * x] + s0[2 * x + 1] +
+					s1[2 * x] + s1[2 * x + 1] + 2) >> 2;
+		} else if (sx == 2) {
+			for (x = 0; x < w2; x++)
+				d[x] = (s0[2 * x] + s0[2 * x + 1] + 1) >> 1;
+		} else {
+			for (x = 0; x < w2; x++)
+				d[x] = (s0[x] + s1[x] + 1) >> 1;
+		}
+	}
+}
+
+// a plane the decoder writes rows_pass rows of per pass. rows go
+// straight into dst unless the decoder pads them wider than the
+// plane or they are past its end, those end up in scratch
+struct plane {
+	unsigned char* dst;
+	int width;   // of dst
+	int height;
+	int padded;  // what the decoder writes per row
+	int rows_pass;
+	unsigned char* scratch;
+	int full;    // whole component kept in scratch for down_420
+};
+
+static void setup_rows(struct plane* pl, int pass, JSAMPROW* rows)
+{
+	int i;
+
+	for (i = 0; i < pl->rows_pass; i++) {
+		int row = pass * pl->rows_pass + i;
+
+		if (pl->full)
+			rows[i] = pl->scratch + row * pl->padded;
+		else if (pl->padded == pl->width && row < pl->height)
+			rows[i] = pl->dst + row * pl->width;
+		else
+			rows[i] = pl->scratch + i * pl->padded;
+	}
+}
+
+static void copy_rows(struct plane* pl, int pass)
+{
+	int i;
+
+	if (pl->full || pl->padded == pl->width)
+		return;
+
+	for (i = 0; i < pl->rows_pass; i++) {
+		int row = pass * pl->rows_pass + i;
+
+		if (row < pl->height)
+			memcpy(pl->dst + row * pl->width,
+				pl->scratch + i * pl->padded, pl->width);
+	}
+}
+
+int mjpeg_decode(struct mjpeg* m, const unsigned char* jpeg, int len,
+	unsigned char* yuv, int width, int height, int scale)
+{
+	struct mjpeg_priv* d = (struct mjpeg_priv*)m->priv;
+	struct jpeg_decompress_struct* cinfo = &d->cinfo;
+	struct plane pl[3];
+	JSAMPROW rows[3][4 * DCTSIZE];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	int i, n_comp, ly, n_pass, sz, sx = 2, sy = 2;
+	unsigned char* scratch;
+
+	if (!valid_scale(scale))
+		return -1;
+
+	if (setjmp(d->jmp)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+	read_header(d, jpeg, len, scale);
+
+	n_comp = cinfo->num_components;
+	if ((int)cinfo->output_width != width ||
+		(int)cinfo->output_height != height ||
+		(!(n_comp == 1 && cinfo->jpeg_color_space == JCS_GRAYSCALE) &&
+		 !(n_comp == 3 && cinfo->jpeg_color_space == JCS_YCbCr)) ||
+		cinfo->max_v_samp_factor > 2) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	jpeg_start_decompress(cinfo);
+
+	// luma rows per pass
+	ly = cinfo->max_v_samp_factor * cinfo->min_DCT_scaled_size;
+	n_pass = (height + ly - 1) / ly;
+
+	for (i = 0; i < n_comp; i++) {
+		jpeg_component_info* comp = &cinfo->comp_info[i];
+
+		pl[i].padded = comp->width_in_blocks * comp->DCT_scaled_size;
+		pl[i].rows_pass = comp->v_samp_factor * comp->DCT_scaled_size;
+		pl[i].full = 0;
+		if (i == 0) {
+			pl[i].dst = yuv;
+			pl[i].width = width;
+			pl[i].height = height;
+		} else {
+			pl[i].dst = yuv + width * height +
+				(i - 1) * (width / 2) * (height / 2);
+			pl[i].width = width / 2;
+			pl[i].height = height / 2;
+		}
+	}
+
+	// how much finer than 4:2:0 chroma comes, the decoder may already
+	// scale it up with the IDCT when shrinking
+	if (n_comp == 3) {
+		for (i = 1; i < 3; i++) {
+			jpeg_component_info* comp = &cinfo->comp_info[i];
+			int ry = ly / pl[i].rows_pass;
+			int rx = cinfo->max_h_samp_factor * cinfo->min_DCT_scaled_size /
+				(comp->h_samp_factor * comp->DCT_scaled_size);
+
+			if (ry * pl[i].rows_pass != ly || (rx != 1 && rx != 2) ||
+				(ry != 1 && ry != 2) ||
+				(i == 2 && (3 - rx != sx || 3 - ry != sy))) {
+				jpeg_abort_decompress(cinfo);
+				return -1;
+			}
+			sx = 3 - rx;
+			sy = 3 - ry;
+		}
+		if (sx != 1 || sy != 1)
+			pl[1].full = pl[2].full = 1;
+	}
+
+	sz = ly * pl[0].padded;
+	for (i = 1; i < n_comp; i++)
+		sz += pl[i].padded * pl[i].rows_pass * (pl[i].full ? n_pass : 1);
+	if (!(scratch = get_scratch(d, sz))) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+	for (i = 0; i < n_comp; i++) {
+		pl[i].scratch = scratch;
+		scratch += pl[i].padded * pl[i].rows_pass *
+			(pl[i].full ? n_pass : 1);
+	}
+
+	while (cinfo->output_scanline < cinfo->output_height) {
+		int pass = cinfo->output_scanline / ly;
+
+		for (i = 0; i < n_comp; i++)
+			setup_rows(&pl[i], pass, rows[i]);
+
+		if (jpeg_read_raw_data(cinfo, planes, ly) != (JDIMENSION)ly) {
+			jpeg_abort_decompress(cinfo);
+			return -1;
+		}
+
+		for (i = 0; i < n_comp; i++)
+			copy_rows(&pl[i], pass);
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	if (n_comp == 1) {
+		memset(yuv + width * height, 128, 2 * (width / 2) * (height / 2));
+	} else if (pl[1].full) {
+		for (i = 1; i < 3; i++)
+			down_420(pl[i].dst, pl[i].width, pl[i].height,
+				pl[i].scratch, pl[i].padded, sx, sy);
+	}
+
+	return 0;
+}
+
+// -----
+// decoder pool. jobs sit in a ring indexed by ticket, tickets are
+// handed out at submit, taken by workers in order and emitted in order
+
+#define JOB_QUEUED   0
+#define JOB_DONE     1
+
+struct mjpeg_job {
+	const unsigned char* jpeg;
+	int len;
+	void (*release)(void* arg, void* jpeg);
+	void* release_arg;
+
+	void* handle;
+	unsigned char* yuv;
+	int width;
+	int height;
+	int scale;
+	int seq;
+
+	int state;
+	int ok;
+};
+
+struct mjpeg_pool_priv;
+
+struct mjpeg_worker {
+	struct mjpeg_pool_priv* pool;
+	struct mjpeg dec;
+	pthread_t thread;
+};
+
+struct mjpeg_pool_priv {
+	pthread_mutex_t lock;
+	pthread_cond_t work;  // submitted or stopping
+	pthread_cond_t space; // emitted
+	pthread_mutex_t emit_lock;
+
+	struct mjpeg_job* jobs;
+	unsigned int window;
+	unsigned int submitted; // tickets handed out
+	unsigned int taken;     // tickets taken by a worker
+	unsigned int emitted;   // tickets emitted
+	int stop;
+
+	struct mjpeg_worker* workers;
+	int n_workers;
+
+	void (*emit)(void* arg, void* handle, int seq, int ok);
+	void* arg;
+};
+
+// whoever completes a job emits every job that is done from the oldest
+// on, so a frame finished early waits for the ones before it
+static void emit_ready(struct mjpeg_pool_priv* pp)
+{
+	pthread_mutex_lock(&pp->emit_lock);
+	for (;;) {
+		struct mjpeg_job* job;
+
+		pthread_mutex_lock(&pp->lock);
+		job = &pp->jobs[pp->emitted % pp->window];
+		if (pp->emitted == pp->taken || job->state != JOB_DONE) {
+			pthread_mutex_unlock(&pp->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pp->lock);
+
+		pp->emit(pp->arg, job->handle, job->seq, job->ok);
+
+		pthread_mutex_lock(&pp->lock);
+		job->state = JOB_QUEUED;
+		pp->emitted++;
+		pthread_cond_signal(&pp->space);
+		pthread_mutex_unlock(&pp->lock);
+	}
+	pthread_mutex_unlock(&pp->emit_lock);
+}
+
+static void* worker_thread(void* argv)
+{
+	struct mjpeg_worker* w = (struct mjpeg_worker*)argv;
+	struct mjpeg_pool_priv* pp = w->pool;
+
+	for (;;) {
+		struct mjpeg_job* job;
+		int ok;
+
+		pthread_mutex_lock(&pp->lock);
+		while (!pp->stop && pp->taken == pp->submitted)
+			pthread_cond_wait(&pp->work, &pp->lock);
+		if (pp->taken == pp->submitted) {
+			// stopping and nothing left
+			pthread_mutex_unlock(&pp->lock);
+			break;
+		}
+		job = &pp->jobs[pp->taken % pp->window];
+		pp->taken++;
+		pthread_mutex_unlock(&pp->lock);
+
+		ok = !mjpeg_decode(&w->dec, job->jpeg, job->len, job->yuv,
+			job->width, job->height, job->scale);
+		if (job->release)
+			job->release(job->release_arg, (void*)job->jpeg);
+
+		pthread_mutex_lock(&pp->lock);
+		job->ok = ok;
+		job->state = JOB_DONE;
+		pthread_mutex_unlock(&pp->lock);
+
+		emit_ready(pp);
+	}
+
+	return NULL;
+}
+
+int init_mjpeg_pool(struct mjpeg_pool* mp, int n_workers, int window,
+	void (*emit)(void* arg, void* handle, int seq, int ok), void* arg)
+{
+	struct mjpeg_pool_priv* pp;
+	int i;
+
+	if (n_workers < 1 || window < 1)
+		return -1;
+
+	pp = (struct mjpeg_pool_priv*)calloc(1, sizeof(*pp));
+	if (!pp)
+		return -1;
+	pp->jobs = (struct mjpeg_job*)calloc(window, sizeof(pp->jobs[0]));
+	pp->workers = (struct mjpeg_worker*)calloc(n_workers, 
+		sizeof(pp->workers[0]));
+	if (!pp->jobs || !pp->workers)
+		goto free_pool;
+
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_mutex_init(&pp->emit_lock, NULL);
+	pthread_cond_init(&pp->work, NULL);
+	pthread_cond_init(&pp->space, NULL);
+	pp->window = window;
+	pp->emit = emit;
+	pp->arg = arg;
+	mp->priv = (void*)pp;
+
+	for (i = 0; i < n_workers; i++) {
+		struct mjpeg_worker* w = &pp->workers[i];
+
+		w->pool = pp;
+		if (init_mjpeg(&w->dec))
+			goto stop_workers;
+		if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+			close_mjpeg(&w->dec);
+			goto stop_workers;
+		}
+		pp->n_workers++;
+	}
+
+	return 0;
+
+stop_workers :
+	close_mjpeg_pool(mp);
+	return -1;
+
+free_pool :
+	free(pp->jobs);
+	free(pp->workers);
+	free(pp);
+	return -1;
+}
+
+int mjpeg_pool_submit(struct mjpeg_pool* mp, 
+	const unsigned char* jpeg, int len,
+	void (*release)(void* arg, void* jpeg), void* release_arg,
+	void* handle, unsigned char* yuv, int width, int height, int scale, 
+	int seq)
+{
+	struct mjpeg_pool_priv* pp = (struct mjpeg_pool_priv*)mp->priv;
+	struct mjpeg_job* job;
+
+	pthread_mutex_lock(&pp->lock);
+	while (!pp->stop && pp->submitted - pp->emitted >= pp->window)
+		pthread_cond_wait(&pp->space, &pp->lock);
+	if (pp->stop) {
+		pthread_mutex_unlock(&pp->lock);
+		return -1;
+	}
+
+	job = &pp->jobs[pp->submitted % pp->window];
+	job->jpeg = jpeg;
+	job->len = len;
+	job->release = release;
+	job->release_arg = release_arg;
+	job->handle = handle;
+	job->yuv = yuv;
+	job->width = width;
+	job->height = height;
+	job->scale = scale;
+	job->seq = seq;
+	job->state = JOB_QUEUED;
+	pp->submitted++;
+
+	pthread_cond_signal(&pp->work);
+	pthread_mutex_unlock(&pp->lock);
+
+	return 0;
+}
+
+void close_mjpeg_pool(struct mjpeg_pool* mp)
+{
+	struct mjpeg_pool_priv* pp = (struct mjpeg_pool_priv*)mp->priv;
+	int i;
+
+	pthread_mutex_lock(&pp->lock);
+	pp->stop = 1;
+	pthread_cond_broadcast(&pp->work);
+	pthread_cond_broadcast(&pp->space);
+	pthread_mutex_unlock(&pp->lock);
+
+	for (i = 0; i < pp->n_workers; i++) {
+		pthread_join(pp->workers[i].thread, NULL);
+		close_mjpeg(&pp->workers[i].dec);
+	}
+
+	pthread_mutex_destroy(&pp->lock);
+	pthread_mutex_destroy(&pp->emit_lock);
+	pthread_cond_destroy(&pp->work);
+	pthread_cond_destroy(&pp->space);
+	free(pp->jobs);
+	free(pp->workers);
+	free(pp);
+}
+
+#ifdef MJPEG_TEST
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+
+// smooth test pattern, value of plane c at (x, y) in luma coordinates
+static int pattern(int c, double x, double y)
+{
+	double v;
+
+	if (c == 0)
+		v = 128 + 80 * sin(x / 23.0) * cos(y / 31.0) + x / 20.0;
+	else if (c == 1)
+		v = 128 + 60 * cos((x + y) / 41.0);
+	else
+		v = 128 + 60 * sin((x - 2 * y) / 37.0);
+
+	return v < 0 ? 0 : v > 255 ? 255 : (int)v;
+}
+
+// jpeg with the given sampling, h_samp x v_samp of Y (chroma 1x1),
+// or grayscale if gray
+static unsigned char* encode(int width, int height, int h_samp, int v_samp,
+	int gray, unsigned long* len)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char* out = NULL;
+	unsigned char* src[3];
+	int pw = (width + 31) & ~31, ph = (height + 31) & ~31;
+	int c, x, y, n_comp = gray ? 1 : 3;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &out, len);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = n_comp;
+	cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_colorspace(&cinfo, gray ? JCS_GRAYSCALE : JCS_YCbCr);
+	jpeg_set_quality(&cinfo, 95, TRUE);
+	cinfo.raw_data_in = TRUE;
+	cinfo.comp_info[0].h_samp_factor = h_samp;
+	cinfo.comp_info[0].v_samp_factor = v_samp;
+	for (c = 1; c < n_comp; c++)
+		cinfo.comp_info[c].h_samp_factor = cinfo.comp_info[c].v_samp_factor = 1;
+
+	// every component at its own resolution, padded for the encoder
+	for (c = 0; c < n_comp; c++) {
+		int sx = c ? h_samp : 1, sy = c ? v_samp : 1;
+
+		src[c] = (unsigned char*)malloc(pw * ph);
+		for (y = 0; y < ph / sy; y++)
+			for (x = 0; x < pw / sx; x++)
+				src[c][y * pw + x] = pattern(c,
+					(x + 0.5) * sx - 0.5, (y + 0.5) * sy - 0.5);
+	}
+
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW rows[3][2 * DCTSIZE];
+		JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+		int n = v_samp * DCTSIZE;
+
+		for (c = 0; c < n_comp; c++) {
+			int sy = c ? v_samp : 1;
+
+			for (y = 0; y < n / sy; y++)
+				rows[c][y] = src[c] +
+					(cinfo.next_scanline / sy + y) * pw;
+		}
+		jpeg_write_raw_data(&cinfo, planes, n);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	for (c = 0; c < n_comp; c++)
+		free(src[c]);
+
+	return out;
+}
+
+// of plane c decoded at 1 / scale against the pattern averaged over
+// the same area
+static double psnr(const unsigned char* yuv, int width, int height,
+	int c, int scale, int gray)
+{
+	int w = c ? width / 2 : width, h = c ? height / 2 : height;
+	int f = c ? 2 * scale : scale;
+	const unsigned char* p = yuv + (c ? width * height : 0) +
+		(c == 2 ? w * h : 0);
+	double se = 0;
+	int x, y, i, j;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			double ref = 0;
+
+			for (j = 0; j < f; j++)
+				for (i = 0; i < f; i++)
+					ref += gray && c ? 128 :
+						pattern(c, x * f + i, y * f + j);
+			ref /= f * f;
+			se += (p[y * w + x] - ref) * (p[y * w + x] - ref);
+		}
+	}
+
+	se /= w * h;
+	return se > 0 ? 10 * log10(255 * 255 / se) : 99;
+}
+
+static double ms_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+static void check(struct mjpeg* m, const char* name, int width, int height,
+	int h_samp, int v_samp, int gray, int n_runs)
+{
+	unsigned long len = 0;
+	unsigned char* jpeg = encode(width, height, h_samp, v_samp, gray, &len);
+	unsigned char* yuv = (unsigned char*)malloc(width * height * 3 / 2 + 64);
+	int scale;
+
+	for (scale = 1; scale <= 8; scale *= 2) {
+		struct timespec t;
+		int w, h, i;
+		double p[3], ms;
+
+		assert(!mjpeg_size(m, jpeg, len, scale, &w, &h));
+		assert(w == (width + scale - 1) / scale);
+		assert(h == (height + scale - 1) / scale);
+		assert(mjpeg_decode(m, jpeg, len, yuv, w + 2, h, scale) == -1);
+
+		// nothing written past the image
+		memset(yuv, 0xa5, width * height * 3 / 2 + 64);
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		for (i = 0; i < n_runs; i++)
+			assert(!mjpeg_decode(m, jpeg, len, yuv, w, h, scale));
+		ms = ms_since(&t) / n_runs;
+		for (i = w * h + 2 * (w / 2) * (h / 2); i < width * height * 3 / 2 + 64; i++)
+			assert(yuv[i] == 0xa5);
+
+		for (i = 0; i < 3; i++)
+			p[i] = psnr(yuv, w, h, i, scale, gray);
+		printf("%s %dx%d 1/%d : %dx%d psnr %.1f %.1f %.1f, %.3f ms\n",
+			name, width, height, scale, w, h, p[0], p[1], p[2], ms);
+		assert(p[0] > 30 && p[1] > 30 && p[2] > 30);
+	}
+
+	// truncated frames decode (grey bottom), garbage is refused
+	assert(!mjpeg_decode(m, jpeg, len / 2, yuv, width, height, 1));
+	assert(mjpeg_decode(m, jpeg, 16, yuv, width, height, 1) == -1);
+	jpeg[1] = 0;
+	assert(mjpeg_decode(m, jpeg, len, yuv, width, height, 1) == -1);
+
+	free(jpeg);
+	free(yuv);
+}
+
+// pool : frames come out in order and decoded like a single decoder
+// would, corrupt ones included
+
+#define POOL_WINDOW 8
+
+struct pool_test {
+	int next_seq;
+	int sz;
+	const unsigned char* ref;
+};
+
+static int n_released;
+
+static void test_release(void* arg, void* jpeg)
+{
+	__atomic_add_fetch(&n_released, 1, __ATOMIC_RELAXED);
+}
+
+static int corrupt(int seq)
+{
+	return seq % 7 == 3;
+}
+
+static void test_emit(void* arg, void* handle, int seq, int ok)
+{
+	struct pool_test* t = (struct pool_test*)arg;
+
+	assert(seq == t->next_seq);
+	assert(ok == !corrupt(seq));
+	assert(!ok || !memcmp(handle, t->ref, t->sz));
+	t->next_seq++;
+}
+
+static void check_pool(int n_workers, int n_frames)
+{
+	struct mjpeg m;
+	struct mjpeg_pool mp;
+	struct pool_test t;
+	struct timespec ts;
+	unsigned long len = 0;
+	unsigned char* jpeg = encode(1920, 1080, 2, 2, 0, &len);
+	unsigned char* bad = (unsigned char*)malloc(len);
+	unsigned char* yuv[2 * POOL_WINDOW];
+	int i;
+
+	t.next_seq = 0;
+	t.sz = 1920 * 1080 * 3 / 2;
+	t.ref = (unsigned char*)malloc(t.sz);
+	assert(!init_mjpeg(&m));
+	assert(!mjpeg_decode(&m, jpeg, len, (unsigned char*)t.ref, 1920, 1080, 1));
+	close_mjpeg(&m);
+
+	memcpy(bad, jpeg, len);
+	bad[1] = 0;
+	for (i = 0; i < 2 * POOL_WINDOW; i++)
+		yuv[i] = (unsigned char*)malloc(t.sz);
+	n_released = 0;
+
+	assert(!init_mjpeg_pool(&mp, n_workers, POOL_WINDOW, test_emit, &t));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (i = 0; i < n_frames; i++) {
+		// frame i - 2 * POOL_WINDOW is emitted once i - 1 got submitted
+		unsigned char* out = yuv[i % (2 * POOL_WINDOW)];
+
+		memset(out, 0, t.sz);
+		assert(!mjpeg_pool_submit(&mp, corrupt(i) ? bad : jpeg, len,
+			test_release, NULL, out, out, 1920, 1080, 1, i));
+	}
+	close_mjpeg_pool(&mp);
+
+	assert(t.next_seq == n_frames && n_released == n_frames);
+	printf("pool %d workers : %d 1080p frames in order, %.1f fps\n",
+		n_workers, n_frames, n_frames * 1e3 / ms_since(&ts));
+
+	for (i = 0; i < 2 * POOL_WINDOW; i++)
+		free(yuv[i]);
+	free((void*)t.ref);
+	free(bad);
+	free(jpeg);
+}
+
+int main(int argc, char* argv[])
+{
+	struct mjpeg m;
+
+	assert(!init_mjpeg(&m));
+
+	check(&m, "420 ", 640, 480, 2, 2, 0, 10);
+	check(&m, "422 ", 640, 480, 2, 1, 0, 10);
+	check(&m, "444 ", 640, 480, 1, 1, 0, 10);
+	check(&m, "gray", 640, 480, 1, 1, 1, 10);
+	// last pass partly outside the image, padded rows
+	check(&m, "420 ", 1920, 1080, 2, 2, 0, 5);
+	check(&m, "422 ", 200, 150, 2, 1, 0, 1);
+
+	close_mjpeg(&m);
+
+	check_pool(1, 30);
+	check_pool(4, 60);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,53 @@
+#ifndef __MJPEG_H__
+#define __MJPEG_H__
+
+// (M)JPEG to YUV420P (I420) with libjpeg raw data output, no color
+// conversion or upsampling. 4:2:0 goes straight into the output, 4:2:2,
+// 4:4:4 and grayscale are brought down to 4:2:0 on the way. frames
+// without huffman tables (most MJPEG cameras) rely on libjpeg-turbo
+// loading the standard ones
+
+struct mjpeg {
+	void* priv; //a hidden datastructure
+};
+
+// all return values are 0 if success
+
+int  init_mjpeg(struct mjpeg* m);
+int  mjpeg_size(struct mjpeg* m, const unsigned char* jpeg, int len,
+	int scale, int* width, int* height);
+	// size of the image mjpeg_decode gives for this scale
+int  mjpeg_decode(struct mjpeg* m, const unsigned char* jpeg, int len,
+	unsigned char* yuv, int width, int height, int scale);
+	// scale 1, 2, 4 or 8 shrinks the image while decoding (DCT scaling),
+	// width and height must be what mjpeg_size says. -1 if the frame is
+	// corrupt or its sampling not supported
+void close_mjpeg(struct mjpeg* m);
+
+// --------
+
+// decoder threads for when one core can't keep up. frames are decoded
+// in parallel and handed to emit() in the order they were submitted,
+// one emit() at a time
+
+struct mjpeg_pool {
+	void* priv; //a hidden datastructure
+};
+
+int  init_mjpeg_pool(struct mjpeg_pool* mp, int n_workers, int window,
+	void (*emit)(void* arg, void* handle, int seq, int ok), void* arg);
+	// at most window frames are submitted but not emitted yet, ok is 0
+	// if the frame could not be decoded. returns 0 if success
+int  mjpeg_pool_submit(struct mjpeg_pool* mp, 
+	const unsigned char* jpeg, int len,
+	void (*release)(void* arg, void* jpeg), void* release_arg,
+	void* handle, unsigned char* yuv, int width, int height, int scale, 
+	int seq);
+	// queues jpeg to be decoded into yuv (see mjpeg_decode), waits while
+	// window frames are in flight. release(release_arg, jpeg) is called 
+	// from a worker once jpeg is not needed anymore, handle and seq are
+	// passed on to emit(). returns 0 if success
+void close_mjpeg_pool(struct mjpeg_pool* mp);
+	// decodes and emits what was submitted, then stops the workers
+
+#endif
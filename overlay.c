@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "overlay.h"
+
+#define FONT_W 5
+#define FONT_H 7
+#define FONT_FIRST ' '
+#define FONT_LAST '~'
+#define FONT_N (FONT_LAST - FONT_FIRST + 1)
+
+// printable ASCII, a byte per column, bit 0 is the top row
+static const unsigned char font[FONT_N][FONT_W] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, // ' '
+	{ 0x00, 0x00, 0x5f, 0x00, 0x00 }, // !
+	{ 0x00, 0x07, 0x00, 0x07, 0x00 }, // "
+	{ 0x14, 0x7f, 0x14, 0x7f, 0x14 }, // #
+	{ 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, // $
+	{ 0x23, 0x13, 0x08, 0x64, 0x62 }, // %
+	{ 0x36, 0x49, 0x55, 0x22, 0x50 }, // &
+	{ 0x00, 0x05, 0x03, 0x00, 0x00 }, // '
+	{ 0x00, 0x1c, 0x22, 0x41, 0x00 }, // (
+	{ 0x00, 0x41, 0x22, 0x1c, 0x00 }, // )
+	{ 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, // *
+	{ 0x08, 0x08, 0x3e, 0x08, 0x08 }, // +
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, // ,
+	{ 0x08, 0x08, 0x08, 0x08, 0x08 }, // -
+	{ 0x00, 0x60, 0x60, 0x00, 0x00 }, // .
+	{ 0x20, 0x10, 0x08, 0x04, 0x02 }, // /
+	{ 0x3e, 0x51, 0x49, 0x45, 0x3e }, // 0
+	{ 0x00, 0x42, 0x7f, 0x40, 0x00 }, // 1
+	{ 0x42, 0x61, 0x51, 0x49, 0x46 }, // 2
+	{ 0x21, 0x41, 0x45, 0x4b, 0x31 }, // 3
+	{ 0x18, 0x14, 0x12, 0x7f, 0x10 }, // 4
+	{ 0x27, 0x45, 0x45, 0x45, 0x39 }, // 5
+	{ 0x3c, 0x4a, 0x49, 0x49, 0x30 }, // 6
+	{ 0x01, 0x71, 0x09, 0x05, 0x03 }, // 7
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, // 8
+	{ 0x06, 0x49, 0x49, 0x29, 0x1e }, // 9
+	{ 0x00, 0x36, 0x36, 0x00, 0x00 }, // :
+	{ 0x00, 0x56, 0x36, 0x00, 0x00 }, // ;
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, // <
+	{ 0x14, 0x14, 0x14, 0x14, 0x14 }, // =
+	{ 0x00, 0x41, 0x22, 0x14, 0x08 }, // >
+	{ 0x02, 0x01, 0x51, 0x09, 0x06 }, // ?
+	{ 0x32, 0x49, 0x79, 0x41, 0x3e }, // @
+	{ 0x7e, 0x11, 0x11, 0x11, 0x7e }, // A
+	{ 0x7f, 0x49, 0x49, 0x49, 0x36 }, // B
+	{ 0x3e, 0x41, 0x41, 0x41, 0x22 }, // C
+	{ 0x7f, 0x41, 0x41, 0x22, 0x1c }, // D
+	{ 0x7f, 0x49, 0x49, 0x49, 0x41 }, // E
+	{ 0x7f, 0x09, 0x09, 0x09, 0x01 }, // F
+	{ 0x3e, 0x41, 0x49, 0x49, 0x7a }, // G
+	{ 0x7f, 0x08, 0x08, 0x08, 0x7f }, // H
+	{ 0x00, 0x41, 0x7f, 0x41, 0x00 }, // I
+	{ 0x20, 0x40, 0x41, 0x3f, 0x01 }, // J
+	{ 0x7f, 0x08, 0x14, 0x22, 0x41 }, // K
+	{ 0x7f, 0x40, 0x40, 0x40, 0x40 }, // L
+	{ 0x7f, 0x02, 0x0c, 0x02, 0x7f }, // M
+	{ 0x7f, 0x04, 0x08, 0x10, 0x7f }, // N
+	{ 0x3e, 0x41, 0x41, 0x41, 0x3e }, // O
+	{ 0x7f, 0x09, 0x09, 0x09, 0x06 }, // P
+	{ 0x3e, 0x41, 0x51, 0x21, 0x5e }, // Q
+	{ 0x7f, 0x09, 0x19, 0x29, 0x46 }, // R
+	{ 0x46, 0x49, 0x49, 0x49, 0x31 }, // S
+	{ 0x01, 0x01, 0x7f, 0x01, 0x01 }, // T
+	{ 0x3f, 0x40, 0x40, 0x40, 0x3f }, // U
+	{ 0x1f, 0x20, 0x40, 0x20, 0x1f }, // V
+	{ 0x3f, 0x40, 0x38, 0x40, 0x3f }, // W
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, // X
+	{ 0x07, 0x08, 0x70, 0x08, 0x07 }, // Y
+	{ 0x61, 0x51, 0x49, 0x45, 0x43 }, // Z
+	{ 0x00, 0x7f, 0x41, 0x41, 0x00 }, // [
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, // backslash
+	{ 0x00, 0x41, 0x41, 0x7f, 0x00 }, // ]
+	{ 0x04, 0x02, 0x01, 0x02, 0x04 }, // ^
+	{ 0x40, 0x40, 0x40, 0x40, 0x40 }, // _
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, // `
+	{ 0x20, 0x54, 0x54, 0x54, 0x78 }, // a
+	{ 0x7f, 0x48, 0x44, 0x44, 0x38 }, // b
+	{ 0x38, 0x44, 0x44, 0x44, 0x20 }, // c
+	{ 0x38, 0x44, 0x44, 0x48, 0x7f }, // d
+	{ 0x38, 0x54, 0x54, 0x54, 0x18 }, // e
+	{ 0x08, 0x7e, 0x09, 0x01, 0x02 }, // f
+	{ 0x0c, 0x52, 0x52, 0x52, 0x3e }, // g
+	{ 0x7f, 0x08, 0x04, 0x04, 0x78 }, // h
+	{ 0x00, 0x44, 0x7d, 0x40, 0x00 }, // i
+	{ 0x20, 0x40, 0x44, 0x3d, 0x00 }, // j
+	{ 0x7f, 0x10, 0x28, 0x44, 0x00 }, // k
+	{ 0x00, 0x41, 0x7f, 0x40, 0x00 }, // l
+	{ 0x7c, 0x04, 0x18, 0x04, 0x78 }, // m
+	{ 0x7c, 0x08, 0x04, 0x04, 0x78 }, // n
+	{ 0x38, 0x44, 0x44, 0x44, 0x38 }, // o
+	{ 0x7c, 0x14, 0x14, 0x14, 0x08 }, // p
+	{ 0x08, 0x14, 0x14, 0x18, 0x7c }, // q
+	{ 0x7c, 0x08, 0x04, 0x04, 0x08 }, // r
+	{ 0x48, 0x54, 0x54, 0x54, 0x20 }, // s
+	{ 0x04, 0x3f, 0x44, 0x40, 0x20 }, // t
+	{ 0x3c, 0x40, 0x40, 0x20, 0x7c }, // u
+	{ 0x1c, 0x20, 0x40, 0x20, 0x1c }, // v
+	{ 0x3c, 0x40, 0x30, 0x40, 0x3c }, // w
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, // x
+	{ 0x0c, 0x50, 0x50, 0x50, 0x3c }, // y
+	{ 0x44, 0x64, 0x54, 0x4c, 0x44 }, // z
+	{ 0x00, 0x08, 0x36, 0x41, 0x00 }, // {
+	{ 0x00, 0x00, 0x7f, 0x00, 0x00 }, // |
+	{ 0x00, 0x41, 0x36, 0x08, 0x00 }, // }
+	{ 0x08, 0x04, 0x08, 0x10, 0x08 }, // ~
+};
+
+// a glyph row at scale is a few runs of set pixels, drawn as fills
+struct run {
+	unsigned char x;
+	unsigned char n;
+};
+
+struct overlay_priv {
+	int scale;
+	int advance;    // glyph to glyph, (FONT_W + 1) * scale
+	int line;       // (FONT_H + 1) * scale
+	// runs of each row of each glyph, row r of glyph g starts at
+	// runs[starts[g * FONT_H + r]]
+	struct run* runs;
+	int* starts;    // FONT_N * FONT_H + 1
+};
+
+int init_overlay(struct overlay* o, int scale)
+{
+	struct overlay_priv* op;
+	int g, r, c, n_runs = 0;
+
+	if (scale < 1 || scale * FONT_W > 255)
+		return -1;
+
+	op = (struct overlay_priv*)calloc(1, sizeof(*op));
+	if (!op)
+		return -1;
+	// at most 3 runs in a row of 5
+	op->runs = (struct run*)malloc(FONT_N * FONT_H * 3 * sizeof(op->runs[0]));
+	op->starts = (int*)malloc((FONT_N * FONT_H + 1) * sizeof(op->starts[0]));
+	if (!op->runs || !op->starts) {
+		free(op->runs);
+		free(op->starts);
+		free(op);
+		return -1;
+	}
+
+	op->scale = scale;
+	op->advance = (FONT_W + 1) * scale;
+	op->line = (FONT_H + 1) * scale;
+
+	for (g = 0; g < FONT_N; g++) {
+		for (r = 0; r < FONT_H; r++) {
+			op->starts[g * FONT_H + r] = n_runs;
+			for (c = 0; c < FONT_W; ) {
+				int c0;
+
+				if (!(font[g][c] & (1 << r))) {
+					c++;
+					continue;
+				}
+				for (c0 = c; c < FONT_W && (font[g][c] & (1 << r)); c++)
+					;
+				op->runs[n_runs].x = c0 * scale;
+				op->runs[n_runs].n = (c - c0) * scale;
+				n_runs++;
+			}
+		}
+	}
+	op->starts[FONT_N * FONT_H] = n_runs;
+	o->priv = (void*)op;
+
+	return 0;
+}
+
+void close_overlay(struct overlay* o)
+{
+	struct overlay_priv* op = (struct overlay_priv*)o->priv;
+
+	free(op->runs);
+	free(op->starts);
+	free(op);
+}
+
+int overlay_line_height(struct overlay* o)
+{
+	struct overlay_priv* op = (struct overlay_priv*)o->priv;
+
+	return op->line;
+}
+
+// w x h of color at x, y, clipped
+static void fill(unsigned char* bgra, int width, int height,
+	int x, int y, int w, int h, unsigned int color)
+{
+	int i, j;
+
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > width)
+		w = width - x;
+	if (y + h > height)
+		h = height - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	for (j = y; j < y + h; j++) {
+		uint32_t* p = (uint32_t*)(bgra + (j * width + x) * 4);
+
+		for (i = 0; i < w; i++)
+			p[i] = color;
+	}
+}
+
+void overlay_rect(struct overlay* o, unsigned char* bgra, int width,
+	int height, int x, int y, int w, int h, int thickness,
+	unsigned int color)
+{
+	int t = thickness;
+
+	if (w <= 0 || h <= 0 || t <= 0)
+		return;
+	if (t * 2 >= w || t * 2 >= h) {
+		fill(bgra, width, height, x, y, w, h, color);
+		return;
+	}
+
+	fill(bgra, width, height, x, y, w, t, color);
+	fill(bgra, width, height, x, y + h - t, w, t, color);
+	fill(bgra, width, height, x, y + t, t, h - t * 2, color);
+	fill(bgra, width, height, x + w - t, y + t, t, h - t * 2, color);
+}
+
+int overlay_text(struct overlay* o, unsigned char* bgra, int width,
+	int height, int x, int y, const char* text, unsigned int color,
+	unsigned int bg)
+{
+	struct overlay_priv* op = (struct overlay_priv*)o->priv;
+	int len = strlen(text);
+	int i, r, s;
+
+	if (bg != OVERLAY_NONE)
+		fill(bgra, width, height, x, y, len * op->advance + op->scale,
+			op->line + op->scale, bg);
+	// glyphs sit a pixel of scale inside the box
+	x += op->scale;
+	y += op->scale;
+
+	for (i = 0; i < len; i++, x += op->advance) {
+		int c = (unsigned char)text[i];
+		int g = (c < FONT_FIRST || c > FONT_LAST ? '?' : c) - FONT_FIRST;
+
+		if (x >= width || x + op->advance <= 0)
+			continue;
+		for (r = 0; r < FONT_H; r++) {
+			const struct run* run = op->runs + op->starts[g * FONT_H + r];
+			const struct run* end = op->runs + op->starts[g * FONT_H + r + 1];
+
+			for (; run < end; run++)
+				for (s = 0; s < op->scale; s++)
+					fill(bgra, width, height, x + run->x,
+						y + r * op->scale + s, run->n, 1, color);
+		}
+	}
+
+	return len * op->advance + op->scale;
+}
+
+#ifdef OVERLAY_TEST
+#include <assert.h>
+#include <time.h>
+
+#define W 64
+#define H 48
+
+static uint32_t img[W * H];
+
+static uint32_t at(int x, int y)
+{
+	return img[y * W + x];
+}
+
+static int count(uint32_t color)
+{
+	int i, n = 0;
+
+	for (i = 0; i < W * H; i++)
+		n += img[i] == color;
+
+	return n;
+}
+
+static void clear(void)
+{
+	memset(img, 0, sizeof(img));
+}
+
+static double ms_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int red = OVERLAY_RGB(255, 0, 0);
+	unsigned char* bgra = (unsigned char*)img;
+	unsigned char* big;
+	struct overlay o, o2;
+	struct timespec t;
+	int x, y, i, c, w;
+
+	// BGRA byte order
+	img[0] = OVERLAY_RGB(1, 2, 3);
+	assert(bgra[0] == 3 && bgra[1] == 2 && bgra[2] == 1 && bgra[3] == 255);
+
+	assert(!init_overlay(&o, 1));
+	assert(!init_overlay(&o2, 3));
+	assert(init_overlay(&o, 0) == -1);
+
+	// outline only
+	clear();
+	overlay_rect(&o, bgra, W, H, 10, 5, 20, 10, 2, red);
+	assert(count(red) == 20 * 10 - 16 * 6);
+	assert(at(10, 5) == red && at(29, 14) == red && at(11, 6) == red);
+	assert(at(12, 7) == 0 && at(27, 12) == 0 && at(30, 5) == 0);
+
+	// partly and all outside
+	clear();
+	overlay_rect(&o, bgra, W, H, -5, -5, 10, 10, 1, red);
+	assert(count(red) == 5 + 4);
+	overlay_rect(&o, bgra, W, H, W - 3, H - 3, 10, 10, 1, red);
+	assert(at(W - 3, H - 3) == red && at(W - 1, H - 3) == red);
+	overlay_rect(&o, bgra, W, H, -50, 10, 20, 20, 1, red);
+	overlay_rect(&o, bgra, W, H, 10, H + 1, 20, 20, 1, red);
+	assert(count(red) == 9 + 3 + 2);
+
+	// every glyph against the font, on a background
+	for (c = FONT_FIRST; c <= FONT_LAST; c++) {
+		char s[2] = { (char)c, 0 };
+
+		clear();
+		w = overlay_text(&o, bgra, W, H, 3, 4, s, red, OVERLAY_RGB(0, 0, 1));
+		assert(w == 7);
+		for (y = 0; y < FONT_H; y++)
+			for (x = 0; x < FONT_W; x++)
+				assert((at(4 + x, 5 + y) == red) ==
+					!!(font[c - FONT_FIRST][x] & (1 << y)));
+		assert(at(3, 4) == OVERLAY_RGB(0, 0, 1));
+		assert(at(9, 12) == OVERLAY_RGB(0, 0, 1) && at(10, 12) == 0);
+	}
+
+	// scaled up, unknown characters, clipped at every side
+	clear();
+	overlay_text(&o2, bgra, W, H, 0, 0, "H", red, OVERLAY_NONE);
+	for (y = 0; y < FONT_H * 3; y++)
+		for (x = 0; x < FONT_W * 3; x++)
+			assert((at(3 + x, 3 + y) == red) ==
+				!!(font['H' - FONT_FIRST][x / 3] & (1 << (y / 3))));
+	clear();
+	overlay_text(&o, bgra, W, H, 0, 0, "\x01", red, OVERLAY_NONE);
+	for (i = 0; i < W * H; i++)
+		assert(img[i] == 0 || img[i] == red);
+	assert(count(red) > 0 && at(1 + 1, 1 + 0) == red); // '?' top bar
+	clear();
+	overlay_text(&o2, bgra, W, H, -10, -10, "clipped text", red, red);
+	overlay_text(&o2, bgra, W, H, W - 10, H - 10, "clipped text", red, red);
+	printf("overlay ok\n");
+
+	// an OSD line and a few labelled boxes on a VGA frame
+	big = (unsigned char*)calloc(640 * 480, 4);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < 1000; i++) {
+		overlay_text(&o2, big, 640, 480, 0, 0, "30 fps 33 ms 12:00:00",
+			OVERLAY_RGB(255, 255, 255), OVERLAY_RGB(0, 0, 0));
+		for (c = 0; c < 4; c++) {
+			overlay_rect(&o2, big, 640, 480, 100 + c * 100, 200, 80, 80, 2,
+				red);
+			overlay_text(&o, big, 640, 480, 100 + c * 100, 190, "face 12",
+				red, OVERLAY_NONE);
+		}
+	}
+	printf("  osd + 4 boxes %.3f ms\n", ms_since(&t) / 1000);
+	free(big);
+
+	close_overlay(&o);
+	close_overlay(&o2);
+
+	return 0;
+}
+#endif
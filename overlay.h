@@ -0,0 +1,36 @@
+#ifndef __OVERLAY_H__
+#define __OVERLAY_H__
+
+// boxes and text drawn straight into a BGRA image (xdisplay_image())
+// after the frame is converted into it, so the frame is never copied to
+// draw on. text is a 5x7 font, every glyph blown up to the scale once
+// at init
+
+struct overlay {
+	void* priv; //a hidden datastructure
+};
+
+// colors are 32 bit pixels as they sit in BGRA memory
+#define OVERLAY_RGB(r, g, b) \
+	(0xff000000u | ((unsigned int)(r) << 16) | \
+	 ((unsigned int)(g) << 8) | (unsigned int)(b))
+#define OVERLAY_NONE 0 // no background behind text
+
+// all return values are 0 if success
+
+int  init_overlay(struct overlay* o, int scale);
+	// glyphs are 5x7 pixels times scale on a 6x8 grid
+void overlay_rect(struct overlay* o, unsigned char* bgra, int width,
+	int height, int x, int y, int w, int h, int thickness,
+	unsigned int color);
+	// outline of w x h at x, y, thickness pixels inwards. bgra is
+	// width * 4 bytes per line, anything outside the image is left out
+int  overlay_text(struct overlay* o, unsigned char* bgra, int width,
+	int height, int x, int y, const char* text, unsigned int color,
+	unsigned int bg);
+	// text with its top left at x, y on a box of bg, characters outside
+	// printable ASCII show as '?'. returns the width of the text
+int  overlay_line_height(struct overlay* o);
+void close_overlay(struct overlay* o);
+
+#endif
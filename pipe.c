@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "pipe.h"
 
@@ -61,191 +70,743 @@ void iterate_queue(struct queue* q, void (*p)(void* elem))
 }
 
 // -----
+// waiting, src/dst only enter the kernel when somebody actually sleeps
+
+static void init_ev(struct pipe_ev* ev)
+{
+	ev->seq = 0;
+	ev->waiters = 0;
+}
+
+static void notify(struct pipe_ev* ev)
+{
+	__atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, 
+			NULL, NULL, 0);
+}
+
+static int ms_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + 
+		(now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// sleeps unless ev changed since seq was read, returns 0 once 
+// timeout_ms (counted from t_start) is over
+static int wait_ev(struct pipe_ev* ev, int seq, 
+	const struct timespec* t_start, int timeout_ms)
+{
+	struct timespec ts, *pts = NULL;
+
+	if (timeout_ms >= 0) {
+		int left = timeout_ms - ms_since(t_start);
+
+		if (left <= 0)
+			return 0;
+		ts.tv_sec = left / 1000;
+		ts.tv_nsec = (left % 1000) * 1000000;
+		pts = &ts;
+	}
+
+	__atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, pts, NULL, 0);
+	__atomic_sub_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+
+	return 1;
+}
+
+// -----
+// lock-free ring, one producer (src) and any number of consumers. head
+// and tail only ever grow, the slot is picked with mask
+// (storage is rounded up to a power of 2, max is the real capacity)
+
+static int init_ring(struct ring* r, int n)
+{
+	unsigned int sz = 1;
+
+	while (sz < (unsigned int)n)
+		sz <<= 1;
+
+	r->elems = (void**)malloc(sz * sizeof(r->elems[0]));
+	if (r->elems == NULL)
+		return -1;
+
+	r->head = 0;
+	r->tail = 0;
+	r->mask = sz - 1;
+	r->max = n;
+	r->efd = -1;
+	r->policy = PIPE_DROP_NEWEST;
+	r->active = 0;
+	r->busy = 0;
+	init_ev(&r->ev);
+	init_ev(&r->space);
+	return 0;
+}
+
+static void close_ring(struct ring* r)
+{
+	if (r->efd >= 0)
+		close(r->efd);
+	free(r->elems);
+}
+
+// src only
+static int ring_put(struct ring* r, void* elem)
+{
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= r->max)
+		return -1;
+
+	__atomic_store_n(&r->elems[tail & r->mask], elem, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// the slot may be overwritten while we read it, but then head has moved
+// on and the cas fails
+static int ring_get(struct ring* r, void** elem)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	do {
+		if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+			return -1;
+		*elem = __atomic_load_n(&r->elems[head & r->mask], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&r->head, &head, head + 1, 1, 
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (__atomic_load_n(&r->policy, __ATOMIC_ACQUIRE) == PIPE_BLOCK)
+		notify(&r->space);
+
+	return 0;
+}
+
+static void iterate_ring(struct ring* r, void (*p)(void* elem))
+{
+	unsigned int i;
+
+	for (i = r->head; i != r->tail; i++)
+		p(r->elems[i & r->mask]);
+}
+
+// -----
+
+// a derived representation of the frame, see pipe_derive(). mem stays
+// with the elem for the next frames, kind and state are reset on recycle
+struct pipe_derived {
+	unsigned int kind;     // 0 if the slot is free
+	int state;             // PIPE_DERIVE_*
+	struct pipe_ev ev;     // made (or failed)
+	void* mem;
+	int mem_sz;
+};
+
+#define PIPE_DERIVE_MAKING 0
+#define PIPE_DERIVE_READY  1
+#define PIPE_DERIVE_FAILED 2
 
 struct pipe_elem {
 	void* buf;
+	void* own; // buffer of the pool, NULL until first needed
+
+	// zero-copy : buf belongs to src and goes back through release()
+	void (*release)(void* arg, void* buf);
+	void* arg;
+
 	int seq;
 	int ref_cnt;
+	struct frame_info info;
+	struct pipe_derived derived[PIPE_MAX_DERIVED];
+
+	struct pipe_elem* next; // while on src
 };
 
-int init_pipe(struct pipe* p, int n_dst, int q_depth, int buf_sz)
+// free elems are kept on a lock-free stack. everybody pushes but only
+// src pops, so the top can't be popped and pushed back under our cas
+// (no ABA)
+
+static struct pipe_elem* pop_free(struct pipe* p)
+{
+	struct pipe_elem* top = (struct pipe_elem*)
+		__atomic_load_n(&p->src, __ATOMIC_ACQUIRE);
+
+	while (top && !__atomic_compare_exchange_n(&p->src, (void**)&top, 
+		(void*)top->next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		;
+
+	return top;
+}
+
+static void push_free(struct pipe* p, struct pipe_elem* elem)
+{
+	void* top = __atomic_load_n(&p->src, __ATOMIC_RELAXED);
+
+	do {
+		elem->next = (struct pipe_elem*)top;
+	} while (!__atomic_compare_exchange_n(&p->src, &top, (void*)elem, 1, 
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	notify(&p->src_ev);
+}
+
+// drops one reference, the last one sends elem back to src. release()
+// is called after elem is free again so it is read out beforehand
+static void unref(struct pipe* p, struct pipe_elem* elem)
+{
+	struct pipe_elem rel;
+	int i;
+
+	if (__atomic_sub_fetch(&elem->ref_cnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	rel = *elem;
+
+	// nobody else holds elem now
+	for (i = 0; i < PIPE_MAX_DERIVED; i++) {
+		elem->derived[i].kind = 0;
+		elem->derived[i].state = PIPE_DERIVE_MAKING;
+	}
+
+	elem->buf = elem->own;
+	elem->release = NULL;
+	elem->arg = NULL;
+	push_free(p, elem);
+
+	if (rel.release)
+		rel.release(rel.arg, rel.buf);
+}
+
+#define PIPE_ALIGN 4096
+#define ALIGN_UP(x) (((x) + PIPE_ALIGN - 1) & ~(PIPE_ALIGN - 1))
+
+// src only. takes a free elem, or a new one while the budget allows,
+// NULL if all n_bufs are in flight
+static struct pipe_elem* get_elem(struct pipe* p)
 {
-	int free_bufs = n_dst * q_depth;
-	struct pipe_elem* msg_all = (struct pipe_elem*)malloc(
-		free_bufs * (sizeof(msg_all[0]) + buf_sz));
-	void* buf_ptr;
-	int def_dst_n, i;
+	struct pipe_elem* elem = pop_free(p);
+
+	if (!elem && p->n_used < p->n_bufs) {
+		elem = &((struct pipe_elem*)p->priv)[p->n_used];
+		__atomic_store_n(&p->n_used, p->n_used + 1, __ATOMIC_RELAXED);
+	}
 
-	// allocate bufs
+	if (elem)
+		memset(&elem->info, 0, sizeof(elem->info));
+
+	return elem;
+}
+
+// src only. buffers are allocated the first time they are needed so
+// only what is really in flight takes memory. page aligned so they can
+// be handed to a driver (V4L2_MEMORY_USERPTR) and work well with SIMD
+static int alloc_own(struct pipe* p, struct pipe_elem* elem)
+{
+	if (elem->own || !p->buf_sz)
+		return 0;
+
+	if (posix_memalign(&elem->own, PIPE_ALIGN, ALIGN_UP(p->buf_sz))) {
+		elem->own = NULL;
+		return -1;
+	}
+	elem->buf = elem->own;
+	__atomic_add_fetch(&p->n_alloc, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static int init_pool(struct pipe* p, int n_bufs, int q_depth, int buf_sz,
+	int max_dst)
+{
+	struct pipe_elem* msg_all;
+	int i;
+
+	// only the handles, buffers come with alloc_own()
+	msg_all = (struct pipe_elem*)calloc(n_bufs, sizeof(msg_all[0]));
 	if (!msg_all)
 		return -1;
 	p->priv = (void*)msg_all;
 
-	// initialize src
-	if (init_queue(&p->src, free_bufs))
-		goto free_buf;
-	
-	// initialize dst
-	def_dst_n = sizeof(p->_dst) / sizeof(p->_dst[0]);
-	p->dst = n_dst < def_dst_n ? &p->_dst[0] :
-		(struct queue*)malloc(n_dst * sizeof(p->dst[0]));
+	// initialize dst, every slot only costs q_depth pointers
+	p->dst = max_dst <= PIPE_MAX_DST ? &p->_dst[0] :
+		(struct ring*)malloc(max_dst * sizeof(p->dst[0]));
 	if (!p->dst)
-		goto free_src;
-	for (i = 0; i < n_dst; i++) {
-		if (init_queue(&p->dst[i], q_depth))
+		goto free_buf;
+	p->max_dst = max_dst;
+	for (i = 0; i < max_dst; i++) {
+		if (init_ring(&p->dst[i], q_depth))
 			goto free_dst;
 	}
 
-	// init spinlock
-	if (pthread_spin_init(&p->lock, PTHREAD_PROCESS_PRIVATE)) 
-		goto free_dst;
-
-	// push buffers onto src
-	buf_ptr = (void*)&msg_all[free_bufs];
-	for (i = 0; i < free_bufs; i++) {
-		msg_all[i].buf = buf_ptr;
-		msg_all[i].seq = 0;
-		msg_all[i].ref_cnt = 0;
-		buf_ptr += buf_sz;
+	p->src = NULL;
+	init_ev(&p->src_ev);
+	p->n_bufs = n_bufs;
+	p->n_used = 0;
+	p->n_alloc = 0;
+	p->buf_sz = buf_sz;
+	p->exhausted = 0;
+	p->derive_failed = 0;
 
-		assert(!enqueue(&p->src, &msg_all[i]));
-	}
-
-	p->n_dst = n_dst;
+	p->n_dst = 0;
 	return 0;
 
 free_dst : 
 	for (i--; i >= 0; i--)
-		close_queue(&p->dst[i]);
-free_src : 
-	close_queue(&p->src);
+		close_ring(&p->dst[i]);
+	if (p->dst != &p->_dst[0])
+		free(p->dst);
 free_buf : 
 	free(msg_all);
-destroy_lock : 
-	pthread_spin_destroy(&p->lock);
 	
 	return -1;
 }
 
+int init_pipe_pool(struct pipe* p, int n_bufs, int q_depth, int buf_sz)
+{
+	return init_pool(p, n_bufs, q_depth, buf_sz, PIPE_MAX_DST);
+}
+
+int init_pipe(struct pipe* p, int n_dst, int q_depth, int buf_sz)
+{
+	int i;
+
+	// enough for every dst to hold one buffer on top of a full queue 
+	// and src to still have one, so PIPE_DROP_OLDEST always has a
+	// buffer to put the latest frame in
+	if (init_pool(p, n_dst * (q_depth + 1) + 1, q_depth, buf_sz,
+			n_dst > PIPE_MAX_DST ? n_dst : PIPE_MAX_DST))
+		return -1;
+
+	for (i = 0; i < n_dst; i++)
+		p->dst[i].active = 1;
+	p->n_dst = n_dst;
+
+	return 0;
+}
+
 void close_pipe(struct pipe* p)
 {
+	struct pipe_elem* msg_all = (struct pipe_elem*)p->priv;
 	int i;
 	
-	for (i = 0; i < p->n_dst; i++)
-		close_queue(&p->dst[i]);
+	for (i = 0; i < p->max_dst; i++)
+		close_ring(&p->dst[i]);
 	if (p->dst != &p->_dst[0])
 		free(p->dst);
-	close_queue(&p->src);
-	free(p->priv);
-	pthread_spin_destroy(&p->lock);
-	
+	for (i = 0; i < p->n_used; i++) {
+		int j;
+
+		free(msg_all[i].own);
+		for (j = 0; j < PIPE_MAX_DERIVED; j++)
+			free(msg_all[i].derived[j].mem);
+	}
+	free(msg_all);
 }
 
 void* get_buf(struct pipe* p, void** pbuf)
 {
-	struct pipe_elem* elem = NULL;
+	struct pipe_elem* elem = get_elem(p);
 
-	// lock
-	pthread_spin_lock(&p->lock);
-	if (!dequeue(&p->src, (void**)&elem))
-		*pbuf = elem->buf;
+	if (!elem) {
+		__atomic_add_fetch(&p->exhausted, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
 
-	//unlock
-	pthread_spin_unlock(&p->lock);
+	if (alloc_own(p, elem)) {
+		push_free(p, elem);
+		return NULL;
+	}
 
+	*pbuf = elem->buf;
 	return elem;
 }
 
-int push_buf(struct pipe* p, void* handle, int seq)
+void* get_buf_wait(struct pipe* p, void** pbuf, int timeout_ms)
+{
+	struct timespec t_start;
+	void* h;
+
+	// counts as one exhaustion however long we wait
+	if ((h = get_buf(p, pbuf)))
+		return h;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (;;) {
+		int seq = __atomic_load_n(&p->src_ev.seq, __ATOMIC_SEQ_CST);
+		struct pipe_elem* elem = get_elem(p);
+
+		if (elem) {
+			if (alloc_own(p, elem)) {
+				push_free(p, elem);
+				return NULL;
+			}
+			*pbuf = elem->buf;
+			return elem;
+		}
+		if (!wait_ev(&p->src_ev, seq, &t_start, timeout_ms))
+			return NULL;
+	}
+}
+
+void* get_buf_zc(struct pipe* p, void* buf, 
+	void (*release)(void* arg, void* buf), void* arg)
+{
+	struct pipe_elem* elem = get_elem(p);
+
+	if (!elem) {
+		__atomic_add_fetch(&p->exhausted, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	elem->buf = buf;
+	elem->release = release;
+	elem->arg = arg;
+
+	return elem;
+}
+
+struct frame_info* buf_info(void* handle)
+{
+	return &((struct pipe_elem*)handle)->info;
+}
+
+// the first one asking for kind claims a slot and makes it, everybody
+// else asking for the same kind waits for that
+const void* pipe_derive(struct pipe* p, void* handle, unsigned int kind,
+	int size, int (*make)(void* arg, void* handle, const void* buf, 
+	void* out), void* arg)
 {
 	struct pipe_elem* elem = (struct pipe_elem*)handle;
-	int i, ret;
+	struct pipe_derived* d = NULL;
+	struct timespec t_start;
+	int i, ok;
+
+	assert(kind);
+
+	for (i = 0; i < PIPE_MAX_DERIVED && !d; i++) {
+		unsigned int k = __atomic_load_n(&elem->derived[i].kind, 
+			__ATOMIC_ACQUIRE);
+
+		if (k == kind)
+			d = &elem->derived[i];
+		else if (!k && __atomic_compare_exchange_n(&elem->derived[i].kind,
+			&k, kind, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break; // ours to make
+		else if (k == kind) // claimed by someone else just now
+			d = &elem->derived[i];
+	}
 
-	assert(handle);
+	if (d) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		for (;;) {
+			int seq = __atomic_load_n(&d->ev.seq, __ATOMIC_SEQ_CST);
+			int state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
 
-	// lock
-	pthread_spin_lock(&p->lock);
+			if (state != PIPE_DERIVE_MAKING)
+				return state == PIPE_DERIVE_READY ? d->mem : NULL;
+			wait_ev(&d->ev, seq, &t_start, -1);
+		}
+	}
 
-	elem->seq = seq;
-	elem->ref_cnt = 0;
-	for (i = 0; i < p->n_dst; i++) {
-		if (!enqueue(&p->dst[i], elem))
-			elem->ref_cnt++;
+	if (i == PIPE_MAX_DERIVED) { // all slots taken by other kinds
+		__atomic_add_fetch(&p->derive_failed, 1, __ATOMIC_RELAXED);
+		return NULL;
 	}
+	d = &elem->derived[i];
+
+	// memory of an earlier frame is reused if it is big enough
+	ok = 1;
+	if (d->mem_sz < size) {
+		free(d->mem);
+		d->mem_sz = 0;
+		if (posix_memalign(&d->mem, PIPE_ALIGN, ALIGN_UP(size)))
+			d->mem = NULL;
+		else
+			d->mem_sz = ALIGN_UP(size);
+		ok = d->mem != NULL;
+		if (!ok)
+			__atomic_add_fetch(&p->derive_failed, 1, __ATOMIC_RELAXED);
+	}
+	ok = ok && !make(arg, handle, elem->buf, d->mem);
+
+	__atomic_store_n(&d->state, ok ? PIPE_DERIVE_READY : PIPE_DERIVE_FAILED,
+		__ATOMIC_RELEASE);
+	notify(&d->ev);
 
-	if (!elem->ref_cnt) {
-		// add back to free
-		assert(!enqueue(&p->src, elem));
+	return ok ? d->mem : NULL;
+}
+
+uint64_t pipe_clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// attached dst or NULL
+static struct ring* dst_ring(struct pipe* p, int id)
+{
+	if (id < 0 || id >= p->max_dst)
+		return NULL;
+	if (__atomic_load_n(&p->dst[id].active, __ATOMIC_ACQUIRE) != 1)
+		return NULL;
+	return &p->dst[id];
+}
+
+static int ring_put_policy(struct pipe* p, struct ring* r, void* elem)
+{
+	struct timespec t_start;
+	void* old;
+
+	switch (__atomic_load_n(&r->policy, __ATOMIC_ACQUIRE)) {
+	case PIPE_DROP_OLDEST : 
+		while (ring_put(r, elem)) {
+			// dst may have pulled it in the meantime, just retry
+			if (!ring_get(r, &old))
+				unref(p, (struct pipe_elem*)old);
+		}
+		return 0;
+
+	case PIPE_BLOCK : 
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		for (;;) {
+			int seq = __atomic_load_n(&r->space.seq, __ATOMIC_SEQ_CST);
+
+			if (!ring_put(r, elem))
+				return 0;
+			if (__atomic_load_n(&r->active, __ATOMIC_SEQ_CST) != 1)
+				return -1; // detached while we were waiting
+			wait_ev(&r->space, seq, &t_start, -1);
+		}
+
+	default : 
+		return ring_put(r, elem);
 	}
+}
+
+int push_buf(struct pipe* p, void* handle, int seq)
+{
+	struct pipe_elem* elem = (struct pipe_elem*)handle;
+	int i, n_dst, ret = 0;
+
+	assert(handle);
+
+	// hold our own reference while delivering so a fast dst can't
+	// recycle elem before the others got it
+	elem->seq = seq;
+	__atomic_store_n(&elem->ref_cnt, 1, __ATOMIC_RELAXED);
 
-	ret = elem->ref_cnt;
+	n_dst = __atomic_load_n(&p->n_dst, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n_dst; i++) {
+		struct ring* r = &p->dst[i];
+
+		// busy before active, detach_dst does it the other way round
+		__atomic_add_fetch(&r->busy, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->active, __ATOMIC_SEQ_CST) == 1) {
+			int efd;
+
+			__atomic_add_fetch(&elem->ref_cnt, 1, __ATOMIC_RELAXED);
+			if (!ring_put_policy(p, r, elem)) {
+				ret++;
+				notify(&r->ev);
+				efd = __atomic_load_n(&r->efd, __ATOMIC_ACQUIRE);
+				if (efd >= 0) {
+					uint64_t one = 1;
+					(void)!write(efd, &one, sizeof(one));
+				}
+			} else {
+				__atomic_sub_fetch(&elem->ref_cnt, 1, __ATOMIC_RELAXED);
+			}
+		}
+		__atomic_sub_fetch(&r->busy, 1, __ATOMIC_RELEASE);
+	}
 
-	// unlock
-	pthread_spin_unlock(&p->lock);
+	// if nobody took it, this adds it back to free
+	unref(p, elem);
 
 	return ret;
 }
 
+void drop_buf(struct pipe* p, void* handle)
+{
+	struct pipe_elem* elem = (struct pipe_elem*)handle;
+
+	assert(handle);
+
+	__atomic_store_n(&elem->ref_cnt, 1, __ATOMIC_RELAXED);
+	unref(p, elem);
+}
+
 void* pull_buf(struct pipe* p, int id, const void** buf, int* seq)
 {
 	struct pipe_elem* elem = NULL;
+	struct ring* r = dst_ring(p, id);
+
+	if (!r || ring_get(r, (void**)&elem))
+		return NULL;
 
-	// lock
-	pthread_spin_lock(&p->lock);
+	*buf = elem->buf;
+	*seq = elem->seq;
+
+	return elem;
+}
 
-	if (id < 0 || id >= p->n_dst)
-		goto unlock;
+void* pull_buf_wait(struct pipe* p, int id, const void** buf, int* seq, 
+	int timeout_ms)
+{
+	struct timespec t_start;
+	void* h;
 
-	if (!dequeue(&p->dst[id], (void**)&elem)) {
-		*buf = elem->buf;
-		*seq = elem->seq;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (;;) {
+		struct ring* r = dst_ring(p, id);
+		struct pipe_ev* ev;
+		int ev_seq;
+
+		if (!r)
+			return NULL;
+		ev = &r->ev;
+		ev_seq = __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+
+		if ((h = pull_buf(p, id, buf, seq)))
+			return h;
+		if (!wait_ev(ev, ev_seq, &t_start, timeout_ms))
+			return NULL;
 	}
+}
 
-	// unlock
-unlock : 
-	pthread_spin_unlock(&p->lock);
+int pipe_eventfd(struct pipe* p, int id)
+{
+	struct ring* r = dst_ring(p, id);
+	int efd, none = -1;
 
-	return elem;
+	if (!r)
+		return -1;
+
+	if ((efd = __atomic_load_n(&r->efd, __ATOMIC_ACQUIRE)) >= 0)
+		return efd;
+
+	// start readable so what is queued already isn't missed
+	efd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return -1;
+
+	if (!__atomic_compare_exchange_n(&r->efd, &none, efd, 0, 
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(efd);
+		efd = none;
+	}
+
+	return efd;
 }
 
 void put_buf(struct pipe* p, void* handle)
 {
 	struct pipe_elem* elem = (struct pipe_elem*)handle;
 
-	// lock
-	pthread_spin_lock(&p->lock);
+	assert(elem->ref_cnt > 0);
+	unref(p, elem);
+}
+
+void flush_buf(struct pipe* p, int id)
+{
+	struct pipe_elem* elem;
+	struct ring* r = dst_ring(p, id);
+
+	if (!r)
+		return;
+
+	while (!ring_get(r, (void**)&elem))
+		unref(p, elem);
+}
+
+int set_policy(struct pipe* p, int id, int policy)
+{
+	struct ring* r = dst_ring(p, id);
+
+	if (!r)
+		return -1;
+	if (policy < PIPE_DROP_NEWEST || policy > PIPE_BLOCK)
+		return -1;
+
+	__atomic_store_n(&r->policy, policy, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int attach_dst(struct pipe* p, int policy)
+{
+	int id, n_dst;
+
+	if (policy < PIPE_DROP_NEWEST || policy > PIPE_BLOCK)
+		return -1;
+
+	for (id = 0; id < p->max_dst; id++) {
+		struct ring* r = &p->dst[id];
+		int idle = 0;
+
+		// -1 reserves the slot until it is ready
+		if (!__atomic_compare_exchange_n(&r->active, &idle, -1, 0, 
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+
+		// left empty by detach_dst
+		__atomic_store_n(&r->policy, policy, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->active, 1, __ATOMIC_SEQ_CST);
+
+		n_dst = __atomic_load_n(&p->n_dst, __ATOMIC_RELAXED);
+		while (n_dst <= id && !__atomic_compare_exchange_n(&p->n_dst, 
+			&n_dst, id + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
 
-	elem->ref_cnt--;
-	if (elem->ref_cnt <= 0) {
-		assert(elem->ref_cnt >= 0);
-		assert(!enqueue(&p->src, elem));
+		return id;
 	}
 
-	// unlock
-	pthread_spin_unlock(&p->lock);
+	return -1;
 }
 
-void flush_buf(struct pipe* p, int id)
+void detach_dst(struct pipe* p, int id)
 {
+	struct ring* r = dst_ring(p, id);
 	struct pipe_elem* elem;
+	int efd;
 
-	// lock
-	pthread_spin_lock(&p->lock);
+	if (!r)
+		return;
 
-	if (id < 0 || id >= p->n_dst)
-		goto unlock;
+	// src either sees us inactive or we see it busy and wait, a src
+	// blocked on PIPE_BLOCK is woken up to notice
+	__atomic_store_n(&r->active, -1, __ATOMIC_SEQ_CST);
+	notify(&r->space);
+	while (__atomic_load_n(&r->busy, __ATOMIC_SEQ_CST))
+		sched_yield();
 
-	while (!dequeue(&p->dst[id], (void**)&elem)) {
-		elem->ref_cnt--;
-		if (elem->ref_cnt <= 0) {
-			assert(elem->ref_cnt >= 0);
-			assert(!enqueue(&p->src, elem));
-		}
-	}
+	while (!ring_get(r, (void**)&elem))
+		unref(p, elem);
+
+	efd = r->efd;
+	r->efd = -1;
+	if (efd >= 0)
+		close(efd);
 
-unlock : 
-	// unlock
-	pthread_spin_unlock(&p->lock);
+	// wake whoever still waits on id
+	notify(&r->ev);
+	__atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+}
+
+void pipe_stats(struct pipe* p, struct pipe_stats* st)
+{
+	st->n_bufs = p->n_bufs;
+	st->n_used = __atomic_load_n(&p->n_used, __ATOMIC_RELAXED);
+	st->n_alloc = __atomic_load_n(&p->n_alloc, __ATOMIC_RELAXED);
+	st->exhausted = __atomic_load_n(&p->exhausted, __ATOMIC_RELAXED);
+	st->derive_failed = __atomic_load_n(&p->derive_failed, __ATOMIC_RELAXED);
 }
 
 void print_pipe_elem(void* p)
@@ -256,20 +817,211 @@ void print_pipe_elem(void* p)
 		elem->seq, elem->ref_cnt);
 }
 
+// not thread safe, only for debugging
 void print_pipe(struct pipe* p)
 {
+	struct pipe_elem* elem;
 	int i;
 
-	printf("print src\n");
-	iterate_queue(&p->src, print_pipe_elem);
+	printf("print src (%d of %d used, %d allocated, exhausted %u)\n", 
+		p->n_used, p->n_bufs, p->n_alloc, p->exhausted);
+	for (elem = (struct pipe_elem*)p->src; elem; elem = elem->next)
+		print_pipe_elem(elem);
 	
 	for (i = 0; i < p->n_dst; i++) {
+		if (p->dst[i].active != 1)
+			continue;
 		printf("print dst %d\n", i);
-		iterate_queue(&p->dst[i], print_pipe_elem);
+		iterate_ring(&p->dst[i], print_pipe_elem);
 	}
 }
 
 #ifdef PIPE_TEST
+#include <unistd.h>
+
+void test_release(void* arg, void* buf)
+{
+	printf("release %s %p\n", (const char*)arg, buf);
+}
+
+#define STRESS_N  200000
+
+static struct pipe sp;
+static volatile int stress_done;
+
+// every dst must see strictly increasing seq
+void* stress_dst(void* arg)
+{
+	int id = (int)(long)arg, last = 0, n = 0;
+
+	for (;;) {
+		const void* b;
+		int s;
+		void* h = pull_buf_wait(&sp, id, &b, &s, 10);
+
+		if (!h) {
+			if (stress_done)
+				break;
+			continue;
+		}
+
+		assert(s > last);
+		assert(*(const int*)b == s);
+		last = s;
+		n++;
+
+		put_buf(&sp, h);
+	}
+
+	printf("dst %d got %d\n", id, n);
+	if (id == 2) // PIPE_BLOCK never drops
+		assert(n == STRESS_N);
+	return NULL;
+}
+
+// a dst that keeps coming and going while src pushes
+void* stress_churn(void* arg)
+{
+	int n = 0;
+
+	while (!stress_done) {
+		int id = attach_dst(&sp, n & 1 ? PIPE_DROP_OLDEST : PIPE_BLOCK);
+		const void* b;
+		int s, i;
+
+		assert(id >= 3);
+		for (i = 0; i < 8; i++) {
+			void* h = pull_buf_wait(&sp, id, &b, &s, 1);
+
+			if (h)
+				put_buf(&sp, h);
+		}
+		detach_dst(&sp, id);
+		n++;
+	}
+
+	printf("churn %d\n", n);
+	return NULL;
+}
+
+int stress(void)
+{
+	pthread_t t[4];
+	int i, seq, n_free;
+	struct pipe_elem* elem;
+
+	assert(!init_pipe(&sp, 3, 4, sizeof(int)));
+	set_policy(&sp, 1, PIPE_DROP_OLDEST);
+	set_policy(&sp, 2, PIPE_BLOCK);
+	for (i = 0; i < 3; i++)
+		pthread_create(&t[i], NULL, stress_dst, (void*)(long)i);
+	pthread_create(&t[3], NULL, stress_churn, NULL);
+
+	for (seq = 1; seq <= STRESS_N; ) {
+		void* b;
+		void* h = get_buf_wait(&sp, &b, -1);
+
+		*(int*)b = seq;
+		push_buf(&sp, h, seq++);
+	}
+
+	stress_done = 1;
+	for (i = 0; i < 4; i++)
+		pthread_join(t[i], NULL);
+	for (i = 0; i < 3; i++)
+		flush_buf(&sp, i);
+
+	// all buffers back on src
+	for (n_free = 0, elem = (struct pipe_elem*)sp.src; elem; elem = elem->next)
+		n_free++;
+	printf("stress free %d of %d\n", n_free, sp.n_used);
+	assert(n_free == sp.n_used && sp.n_alloc == sp.n_used);
+
+	close_pipe(&sp);
+	return 0;
+}
+
+// derived buffers are made once per frame whoever asks first
+static int n_made;
+
+static int make_copy(void* arg, void* handle, const void* buf, void* out)
+{
+	__atomic_add_fetch(&n_made, 1, __ATOMIC_SEQ_CST);
+	usleep(20000); // long enough for the others to ask meanwhile
+	memcpy(out, buf, sizeof(int));
+	*(int*)out += (int)(long)arg;
+	return (int)(long)arg < 0;
+}
+
+static struct pipe dp;
+static const void* derived[3];
+
+void* derive_dst(void* arg)
+{
+	int id = (int)(long)arg, s;
+	const void* b;
+	void* h = pull_buf_wait(&dp, id, &b, &s, -1);
+
+	derived[id] = pipe_derive(&dp, h, 0x1234, sizeof(int), make_copy, 
+		(void*)100);
+	put_buf(&dp, h);
+	return NULL;
+}
+
+int derive(void)
+{
+	pthread_t t[3];
+	void* b;
+	void* h;
+	const void* b0;
+	const void* d;
+	struct pipe_stats st;
+	int i, s0;
+
+	assert(!init_pipe(&dp, 3, 2, sizeof(int)));
+	h = get_buf(&dp, &b);
+	*(int*)b = 1;
+	push_buf(&dp, h, 1);
+	for (i = 0; i < 3; i++)
+		pthread_create(&t[i], NULL, derive_dst, (void*)(long)i);
+	for (i = 0; i < 3; i++)
+		pthread_join(t[i], NULL);
+	printf("derive made %d, same %d, value %d\n", n_made, 
+		derived[0] == derived[1] && derived[1] == derived[2],
+		*(const int*)derived[0]);
+	assert(n_made == 1 && derived[0] == derived[1] && 
+		derived[1] == derived[2] && *(const int*)derived[0] == 101);
+
+	// the next frame in the buffer is made again, other kinds apart,
+	// a failed make is NULL for everybody
+	h = get_buf(&dp, &b);
+	*(int*)b = 2;
+	push_buf(&dp, h, 2);
+	h = pull_buf(&dp, 0, &b0, &s0);
+	d = pipe_derive(&dp, h, 0x1234, sizeof(int), make_copy, (void*)100);
+	assert(d && *(const int*)d == 102 && n_made == 2);
+	assert(pipe_derive(&dp, h, 0x1234, sizeof(int), make_copy, 
+		(void*)100) == d && n_made == 2);
+	d = pipe_derive(&dp, h, 0x5678, 4096 * 2, make_copy, (void*)5);
+	assert(d && *(const int*)d == 7 && n_made == 3);
+	assert(!pipe_derive(&dp, h, 0x9abc, sizeof(int), make_copy, 
+		(void*)-1));
+	assert(!pipe_derive(&dp, h, 0x9abc, sizeof(int), make_copy, 
+		(void*)100) && n_made == 4);
+	assert(pipe_derive(&dp, h, 0xdef0, sizeof(int), make_copy, (void*)1));
+	assert(!pipe_derive(&dp, h, 0x1111, sizeof(int), make_copy, (void*)1));
+		// all PIPE_MAX_DERIVED kinds used
+	pipe_stats(&dp, &st);
+	assert(st.derive_failed == 1);
+	put_buf(&dp, h);
+	printf("derive again made %d\n", n_made);
+
+	for (i = 0; i < 3; i++)
+		flush_buf(&dp, i);
+	close_pipe(&dp);
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
 	struct pipe p;
@@ -279,6 +1031,9 @@ int main(int argc, char* argv[])
 	const void* b0, *b1, *b2;
 	int s0, s1, s2;
 
+	stress();
+	derive();
+
 	// init
 	printf("%d\n", init_pipe(&p, 3, 2, 0x1));
 
@@ -352,8 +1107,74 @@ int main(int argc, char* argv[])
 	h0 = pull_buf(&p, 0, &b0, &s0); 
 	printf("%p\n", h0);
 
-	print_pipe(&p); exit(0);
-		//should be src(0), dst0(0), dst1(2), dst2(2)
+	print_pipe(&p);
+		//should be src(1), dst0(0), dst1(2), dst2(2)
+
+	// zero-copy, released only after all 3 dst put it
+	close_pipe(&p);
+	init_pipe(&p, 3, 2, 0);
+	h = get_buf_zc(&p, (void*)0x2000, test_release, (void*)"dropped"); 
+	drop_buf(&p, h);
+		//should print release dropped 0x2000
+	h = get_buf_zc(&p, (void*)0x1000, test_release, (void*)"zc"); 
+	push_buf(&p, h, 8);
+	h0 = pull_buf(&p, 0, &b0, &s0); put_buf(&p, h0);
+	h1 = pull_buf(&p, 1, &b1, &s1); put_buf(&p, h1);
+	printf("not yet released\n");
+	printf("eventfd %d, timed out %p\n", pipe_eventfd(&p, 2) >= 0, 
+		pull_buf_wait(&p, 0, &b0, &s0, 20));
+	flush_buf(&p, 2);
+		//should print release zc 0x1000
+	close_pipe(&p);
+
+	// latest wins on dst 0, dst 1 keeps the oldest
+	init_pipe(&p, 2, 2, 0x1);
+	set_policy(&p, 0, PIPE_DROP_OLDEST);
+	for (s0 = 1; s0 <= 3; s0++) {
+		h = get_buf(&p, &b); push_buf(&p, h, s0);
+	}
+	h0 = pull_buf(&p, 0, &b0, &s0); put_buf(&p, h0);
+	h1 = pull_buf(&p, 1, &b1, &s1); put_buf(&p, h1);
+	printf("drop oldest %d, drop newest %d\n", s0, s1);
+		//should be drop oldest 2, drop newest 1
+
+	// frame info travels with the buffer and is reset for the next one
+	flush_buf(&p, 0); flush_buf(&p, 1);
+	h = get_buf(&p, &b);
+	buf_info(h)->sequence = 42;
+	buf_info(h)->t_capture = pipe_clock_ns();
+	push_buf(&p, h, 4);
+	h1 = pull_buf(&p, 1, &b1, &s1);
+	printf("info sequence %u, captured %d\n", buf_info(h1)->sequence, 
+		buf_info(h1)->t_capture <= pipe_clock_ns());
+		//should be info sequence 42, captured 1
+	put_buf(&p, h1); flush_buf(&p, 0);
+	h = get_buf(&p, &b);
+	assert(buf_info(h)->sequence == 0 && buf_info(h)->t_capture == 0);
+	push_buf(&p, h, 5);
+
+	// dst come and go, queued buffers of a detached dst are freed
+	detach_dst(&p, 0);
+	printf("detached %p, attached %d\n", pull_buf(&p, 0, &b0, &s0), 
+		attach_dst(&p, PIPE_DROP_NEWEST));
+		//should be detached (nil), attached 0
+	detach_dst(&p, 1);
+	detach_dst(&p, 0);
+	print_pipe(&p);
+		//should be src(7)
+	close_pipe(&p);
+
+	// more dst than the pipe has room for in itself
+	assert(!init_pipe(&p, PIPE_MAX_DST + 2, 2, 0x1));
+	h = get_buf(&p, &b);
+	printf("%d dst delivered\n", push_buf(&p, h, 1));
+		//should be 10 dst delivered
+	h0 = pull_buf(&p, PIPE_MAX_DST + 1, &b0, &s0); put_buf(&p, h0);
+	printf("last dst %d, attached %d\n", s0, 
+		attach_dst(&p, PIPE_DROP_NEWEST));
+		//should be last dst 1, attached -1
+	close_pipe(&p);
+	exit(0);
 
 #if 0
 	struct queue q;
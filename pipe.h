@@ -2,6 +2,7 @@
 #define __PIPE_H__
 
 #include <pthread.h>
+#include <stdint.h>
 
 struct queue { 
 	void* _elems[5];
@@ -21,36 +22,154 @@ void iterate_queue(struct queue* q, void (*p)(void* elem));
 
 // --------
 
+// futex based wait queue, seq changes on every event
+struct pipe_ev {
+	int seq;
+	int waiters;
+};
+
+struct ring {
+	void** elems;
+	unsigned int head; // advanced by dst
+	unsigned int tail; // advanced by src
+	unsigned int mask;
+	unsigned int max;
+
+	struct pipe_ev ev; // buffer pushed
+	struct pipe_ev space; // buffer pulled, for PIPE_BLOCK
+	int efd;           // eventfd, -1 until pipe_eventfd() asks for it
+	int policy;
+
+	int active;        // attached
+	int busy;          // src is delivering, detach waits for it
+};
+
+// what src knows about the frame in a buffer, travels with it from
+// get_buf to the last put_buf. zeroed by get_buf, times are in ns
+struct frame_info {
+	uint64_t t_driver;     // driver timestamp (buf.timestamp)
+	uint64_t t_capture;    // dequeued from the driver, pipe_clock_ns()
+	uint64_t t_convert;    // written into buf, pipe_clock_ns()
+	unsigned int sequence; // driver frame counter, gaps are driver drops
+	unsigned int fourcc;   // layout of buf, V4L2_PIX_FMT_*
+	int width;
+	int height;
+	int stride;            // bytes per line of the first plane
+	int bytesused;         // valid bytes in buf, varies for compressed
+};
+
+// what push_buf does when the queue of a dst is full
+#define PIPE_DROP_NEWEST 0 // skip that dst (default)
+#define PIPE_DROP_OLDEST 1 // latest frame wins, the oldest queued is dropped
+#define PIPE_BLOCK       2 // wait until dst pulls, for lossless dst
+
+// lock-free, a single src thread (get_buf & push_buf) and any number of
+// dst threads. buffers are shared by all dst and ref counted. dst can be
+// attached and detached at any time, an id stays valid until detached.
+// push_buf & drop_buf may come from other threads than get_buf as long
+// as they are serialized (e.g. decoder threads emitting under a lock)
+
+#define PIPE_MAX_DST 8 // dst slots in the pipe itself, init_pipe adds more
+#define PIPE_MAX_DERIVED 4 // derived representations per buffer
+
 struct pipe {
-	struct queue src;
-	struct queue _dst[3];
-	struct queue* dst;
-	int n_dst;
+	void* src; // free buffers
+	struct pipe_ev src_ev; // buffer freed
+	struct ring _dst[PIPE_MAX_DST];
+	struct ring* dst;
+	int max_dst; // slots in dst
+	int n_dst;   // highest id ever attached + 1
 
-	pthread_spinlock_t lock;
+	// pool, shared by all dst
+	int n_bufs;   // in-flight budget
+	int n_used;   // handles handed out so far
+	int n_alloc;  // buffers allocated so far
+	int buf_sz;
+	unsigned int exhausted; // get_buf found all n_bufs in flight
+	unsigned int derive_failed; // pipe_derive out of kinds or memory
 
 	void* priv; //a hidden datastructure
 };
 
+struct pipe_stats {
+	int n_bufs;
+	int n_used;
+	int n_alloc;
+	unsigned int exhausted;
+	unsigned int derive_failed;
+};
+
 // called from src
 void* get_buf(struct pipe* p, void** pbuf);
 	// returns handle to buffer
+void* get_buf_wait(struct pipe* p, void** pbuf, int timeout_ms);
+	// same as get_buf but waits up to timeout_ms (-1 forever) for a free
+	// buffer, NULL on timeout
+void* get_buf_zc(struct pipe* p, void* buf, 
+	void (*release)(void* arg, void* buf), void* arg);
+	// zero-copy : hands over a buffer owned by src instead of one from
+	// the pipe, release(arg, buf) is called once the last dst put it
 int push_buf(struct pipe* p, void* handle, int seq);
 	// returns number of messages successfully delivered
 	// if 0, then buffer is automatically recycled
+void drop_buf(struct pipe* p, void* handle);
+	// gives back a buffer from get_buf* without delivering it (e.g. 
+	// nothing valid got written into it)
 
 // called from dst
 void* pull_buf(struct pipe* p, int id, const void** buf, int* seq);
 	// returns handle of buffer (must use for return)
+void* pull_buf_wait(struct pipe* p, int id, const void** buf, int* seq, 
+	int timeout_ms);
+	// same as pull_buf but waits up to timeout_ms (-1 forever), NULL on
+	// timeout
+int   pipe_eventfd(struct pipe* p, int id);
+	// returns an eventfd that is readable while dst id may have buffers 
+	// (for poll/epoll), read it to clear and then pull_buf until NULL.
+	// -1 if failed
 void  put_buf(struct pipe* p, void* handle);
 void  flush_buf(struct pipe* p, int id);
+int   set_policy(struct pipe* p, int id, int policy);
+	// PIPE_DROP_NEWEST, PIPE_DROP_OLDEST or PIPE_BLOCK, returns 0 if success
+
+// called from src between get_buf* and push_buf (to fill it) or from
+// dst between pull_buf* and put_buf (to read it)
+struct frame_info* buf_info(void* handle);
+const void* pipe_derive(struct pipe* p, void* handle, unsigned int kind,
+	int size, int (*make)(void* arg, void* handle, const void* buf, 
+	void* out), void* arg);
+	// a representation of the buffer (e.g. converted to another format)
+	// shared by everyone holding it. the first call for a kind has 
+	// make(arg, handle, buf, out) write size bytes into out, later calls
+	// (from any thread) wait for that and get the same. valid until put,
+	// made again for the next frame in the buffer. kind is a nonzero key
+	// (a fourcc), up to PIPE_MAX_DERIVED kinds per buffer. NULL if make
+	// returned nonzero, the kinds are used up or no memory (the last two
+	// count in derive_failed of p)
+
+// called from anywhere
+uint64_t pipe_clock_ns(void);
+	// CLOCK_MONOTONIC, the clock of frame_info t_capture & t_convert
+int  attach_dst(struct pipe* p, int policy);
+	// returns id of the new dst, -1 if all max_dst slots are taken
+void detach_dst(struct pipe* p, int id);
+	// buffers still queued for id go back to src, pull_buf(id) fails
+	// from now on
 
 // called when start & destroy
+int  init_pipe_pool(struct pipe* p, int n_bufs, int q_depth, int buf_sz);
+	// no dst attached yet, room for PIPE_MAX_DST. at most n_bufs 
+	// buffers are in flight (queued, held by dst or src) whatever the 
+	// number of dst, they are only allocated once needed. returns 0 if 
+	// success
 int  init_pipe(struct pipe* p, int n_dst, int q_depth, int buf_sz);
-	// returns 0 if success
+	// dst 0 .. n_dst - 1 are attached already (any number, room for
+	// PIPE_MAX_DST at least) and the budget covers them all with full
+	// queues, returns 0 if success
 void close_pipe(struct pipe* p);
 
 // for debugging
+void pipe_stats(struct pipe* p, struct pipe_stats* st);
 void print_pipe(struct pipe* p);
 
 #endif
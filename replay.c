@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "convert.h"
+#include "replay.h"
+
+#define REPLAY_MJPG CONVERT_FOURCC('M', 'J', 'P', 'G')
+
+// where a frame is in the file
+struct span {
+	size_t off;
+	int len;
+};
+
+struct replay_priv {
+	const unsigned char* map;
+	size_t size;
+	struct span* frames;
+	int n_frames;
+	int max_frames;   // room in frames
+	int max_len;
+
+	unsigned int fourcc;
+	int width;
+	int height;
+	int stride;
+
+	uint64_t interval; // ns from frame to frame, 0 as fast as asked
+	int loop;
+	uint64_t t_start;  // frame 0 was due, 0 before it was asked for
+	unsigned int tick; // frames due so far, the sequence of the next
+};
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+		EINTR)
+		;
+}
+
+static int add_frame(struct replay_priv* rp, size_t off, int len)
+{
+	if (rp->n_frames == rp->max_frames) {
+		int max = rp->max_frames ? rp->max_frames * 2 : 64;
+		struct span* frames = (struct span*)realloc(rp->frames,
+			max * sizeof(frames[0]));
+
+		if (!frames)
+			return -1;
+		rp->frames = frames;
+		rp->max_frames = max;
+	}
+
+	rp->frames[rp->n_frames].off = off;
+	rp->frames[rp->n_frames].len = len;
+	rp->n_frames++;
+	if (len > rp->max_len)
+		rp->max_len = len;
+
+	return 0;
+}
+
+// bytes of a raw frame, -1 if the format isn't known
+static int frame_size(unsigned int fourcc, int width, int height,
+	int* stride)
+{
+	switch (fourcc) {
+	case CONVERT_YU12:
+	case CONVERT_NV12:
+		*stride = width;
+		return width * height * 3 / 2;
+	case CONVERT_422P:
+		*stride = width;
+		return width * height * 2;
+	case CONVERT_YUYV:
+	case CONVERT_UYVY:
+		*stride = width * 2;
+		return width * height * 2;
+	case CONVERT_GREY:
+	case CONVERT_BA81:
+		*stride = width;
+		return width * height;
+	case CONVERT_BGR3:
+		*stride = width * 3;
+		return width * height * 3;
+	}
+
+	return -1;
+}
+
+static int index_raw(struct replay_priv* rp)
+{
+	int len = frame_size(rp->fourcc, rp->width, rp->height, &rp->stride);
+	size_t off;
+
+	if (len <= 0)
+		return -1;
+	for (off = 0; off + len <= rp->size; off += len)
+		if (add_frame(rp, off, len))
+			return -1;
+
+	return 0;
+}
+
+// "YUV4MPEG2 W640 H480 F30:1 Ip A1:1 C420jpeg\n", then "FRAME\n" (maybe
+// with parameters) before each frame
+static int index_y4m(struct replay_priv* rp, int* num, int* den)
+{
+	const unsigned char* nl = (const unsigned char*)memchr(rp->map, '\n',
+		rp->size < 256 ? rp->size : 256);
+	char header[256];
+	char* save;
+	char* tok;
+	size_t off;
+	int len;
+
+	if (!nl || memcmp(rp->map, "YUV4MPEG2 ", 10))
+		return -1;
+	memcpy(header, rp->map, nl - rp->map);
+	header[nl - rp->map] = 0;
+
+	rp->fourcc = CONVERT_YU12; // C420jpeg unless it says otherwise
+	for (tok = strtok_r(header + 10, " ", &save); tok;
+			tok = strtok_r(NULL, " ", &save)) {
+		switch (tok[0]) {
+		case 'W':
+			rp->width = atoi(tok + 1);
+			break;
+		case 'H':
+			rp->height = atoi(tok + 1);
+			break;
+		case 'F':
+			if (sscanf(tok + 1, "%d:%d", num, den) != 2)
+				*num = *den = 0;
+			break;
+		case 'C':
+			if (!strncmp(tok + 1, "420", 3))
+				rp->fourcc = CONVERT_YU12;
+			else if (!strcmp(tok + 1, "422"))
+				rp->fourcc = CONVERT_422P;
+			else if (!strcmp(tok + 1, "mono"))
+				rp->fourcc = CONVERT_GREY;
+			else
+				return -1;
+			break;
+		}
+	}
+
+	len = frame_size(rp->fourcc, rp->width, rp->height, &rp->stride);
+	if (rp->width <= 0 || rp->height <= 0 || len <= 0)
+		return -1;
+
+	for (off = nl - rp->map + 1; off + 5 < rp->size &&
+			!memcmp(rp->map + off, "FRAME", 5); off += len) {
+		nl = (const unsigned char*)memchr(rp->map + off, '\n',
+			rp->size - off);
+		if (!nl)
+			break;
+		off = nl - rp->map + 1;
+		if (off + len > rp->size)
+			break;
+		if (add_frame(rp, off, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+// end of the JPEG starting at off (on its SOI), 0 if it's broken. the
+// size comes from the first frame of the file
+static size_t jpeg_end(struct replay_priv* rp, size_t off)
+{
+	const unsigned char* m = rp->map;
+	size_t end = rp->size;
+
+	off += 2;
+	while (off + 2 <= end) {
+		int marker, len;
+
+		if (m[off] != 0xff)
+			return 0;
+		marker = m[off + 1];
+		if (marker == 0xff) { // fill
+			off++;
+			continue;
+		}
+		if (marker == 0xd9)
+			return off + 2;
+		if ((marker >= 0xd0 && marker <= 0xd7) || marker == 0x01) {
+			off += 2;
+			continue;
+		}
+
+		if (off + 4 > end) // no room for the length
+			return 0;
+		len = (m[off + 2] << 8) | m[off + 3];
+		if (len < 2 || off + 2 + len > end)
+			return 0;
+		// SOF0..15 but DHT (c4), JPG (c8) and DAC (cc)
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+				marker != 0xc8 && marker != 0xcc && !rp->width &&
+				len >= 7) {
+			rp->height = (m[off + 5] << 8) | m[off + 6];
+			rp->width = (m[off + 7] << 8) | m[off + 8];
+		}
+		off += 2 + len;
+		if (marker != 0xda)
+			continue;
+
+		// entropy coded data, up to the next marker that isn't a stuffed
+		// 0xff or a restart
+		while (off + 1 < end && (m[off] != 0xff || !m[off + 1] ||
+				(m[off + 1] >= 0xd0 && m[off + 1] <= 0xd7)))
+			off += m[off] == 0xff ? 2 : 1;
+	}
+
+	return 0;
+}
+
+static int index_jpeg(struct replay_priv* rp)
+{
+	const unsigned char* m = rp->map;
+	size_t off = 0;
+
+	rp->fourcc = REPLAY_MJPG;
+	rp->stride = 0;
+	rp->width = rp->height = 0;
+
+	while (off + 2 <= rp->size) {
+		size_t end;
+
+		// anything between frames is skipped
+		if (m[off] != 0xff || m[off + 1] != 0xd8) {
+			off++;
+			continue;
+		}
+		if (!(end = jpeg_end(rp, off)))
+			break;
+		if (add_frame(rp, off, end - off))
+			return -1;
+		off = end;
+	}
+
+	return rp->width > 0 && rp->height > 0 ? 0 : -1;
+}
+
+int init_replay(struct replay* r, int fd, const char* name,
+	unsigned int fourcc, int width, int height, int timing, int fps,
+	int loop)
+{
+	struct replay_priv* rp;
+	const char* ext = strrchr(name, '.');
+	struct stat st;
+	int num = 0, den = 0, ret;
+
+	if (fstat(fd, &st) || !st.st_size)
+		return -1;
+
+	rp = (struct replay_priv*)calloc(1, sizeof(*rp));
+	if (!rp)
+		return -1;
+	rp->size = st.st_size;
+	rp->map = (const unsigned char*)mmap(NULL, rp->size, PROT_READ,
+		MAP_SHARED, fd, 0);
+	if (rp->map == MAP_FAILED) {
+		free(rp);
+		return -1;
+	}
+	// played front to back
+	madvise((void*)rp->map, rp->size, MADV_SEQUENTIAL);
+
+	rp->fourcc = fourcc;
+	rp->width = width;
+	rp->height = height;
+	if (ext && !strcasecmp(ext, ".y4m"))
+		ret = index_y4m(rp, &num, &den);
+	else if (ext && (!strcasecmp(ext, ".mjpg") ||
+			!strcasecmp(ext, ".mjpeg") || !strcasecmp(ext, ".jpg")))
+		ret = index_jpeg(rp);
+	else
+		ret = index_raw(rp);
+
+	if (ret || !rp->n_frames) {
+		r->priv = (void*)rp;
+		close_replay(r);
+		return -1;
+	}
+
+	if (timing == REPLAY_ORIGINAL && num > 0 && den > 0)
+		rp->interval = (uint64_t)1000000000 * den / num;
+	else if (timing != REPLAY_FAST && fps > 0)
+		rp->interval = 1000000000 / fps;
+	rp->loop = loop;
+	r->priv = (void*)rp;
+
+	return 0;
+}
+
+void replay_format(struct replay* r, unsigned int* fourcc, int* width,
+	int* height, int* stride, int* max_len)
+{
+	struct replay_priv* rp = (struct replay_priv*)r->priv;
+
+	*fourcc = rp->fourcc;
+	*width = rp->width;
+	*height = rp->height;
+	*stride = rp->stride;
+	*max_len = rp->max_len;
+}
+
+int replay_next(struct replay* r, struct replay_frame* f)
+{
+	struct replay_priv* rp = (struct replay_priv*)r->priv;
+	uint64_t now = clock_ns();
+	struct span* s;
+
+	if (!rp->t_start)
+		rp->t_start = now;
+
+	if (rp->interval) {
+		uint64_t due = rp->t_start + (uint64_t)rp->tick * rp->interval;
+
+		if (now < due)
+			sleep_until(due);
+		else // the ones due since then are gone, as with a driver
+			rp->tick += (now - due) / rp->interval;
+	}
+
+	if (!rp->loop && rp->tick >= (unsigned int)rp->n_frames)
+		return 1;
+
+	s = &rp->frames[rp->tick % rp->n_frames];
+	f->data = rp->map + s->off;
+	f->len = s->len;
+	f->sequence = rp->tick;
+	f->t_due = rp->interval ?
+		rp->t_start + (uint64_t)rp->tick * rp->interval : now;
+	rp->tick++;
+
+	return 0;
+}
+
+uint64_t replay_due(struct replay* r)
+{
+	struct replay_priv* rp = (struct replay_priv*)r->priv;
+
+	if (!rp->interval || !rp->t_start)
+		return 0;
+
+	return rp->t_start + (uint64_t)rp->tick * rp->interval;
+}
+
+void close_replay(struct replay* r)
+{
+	struct replay_priv* rp = (struct replay_priv*)r->priv;
+
+	munmap((void*)rp->map, rp->size);
+	free(rp->frames);
+	free(rp);
+}
+
+#ifdef REPLAY_TEST
+#include <assert.h>
+#include <unistd.h>
+
+// a file of len bytes of data, open for reading
+static int file_of(const void* data, int len)
+{
+	char path[] = "/tmp/replay_test_XXXXXX";
+	int fd = mkstemp(path);
+
+	assert(fd >= 0);
+	unlink(path);
+	assert(write(fd, data, len) == len);
+
+	return fd;
+}
+
+static double ms_since(uint64_t t)
+{
+	return (clock_ns() - t) / 1e6;
+}
+
+// SOI, an APP0 with an EOI in it, SOF0 of 16x8, SOS and entropy data
+// with a stuffed 0xff and a restart marker, EOI
+static int jpeg_of(unsigned char* j, int n)
+{
+	static const unsigned char head[] = {
+		0xff, 0xd8,
+		0xff, 0xe0, 0x00, 0x06, 0xff, 0xd9, 0x00, 0x00,
+		0xff, 0xc0, 0x00, 0x0b, 0x08, 0x00, 0x08, 0x00, 0x10, 0x01,
+			0x01, 0x11, 0x00,
+		0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,
+	};
+	int len = sizeof(head);
+
+	memcpy(j, head, len);
+	j[len++] = n;
+	j[len++] = 0xff;
+	j[len++] = 0x00;
+	j[len++] = 0xff;
+	j[len++] = 0xd3;
+	j[len++] = n;
+	j[len++] = 0xff;
+	j[len++] = 0xd9;
+
+	return len;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned char data[4096];
+	struct replay r;
+	struct replay_frame f;
+	unsigned int fourcc;
+	int fd, i, len, w, h, stride, max_len;
+	uint64_t t;
+
+	// raw YU12 8x4, frame i filled with i, a partial frame at the end
+	for (i = 0; i < 5 * 48 + 20; i++)
+		data[i] = i / 48;
+	fd = file_of(data, 5 * 48 + 20);
+	assert(!init_replay(&r, fd, "x.yuv", CONVERT_YU12, 8, 4, REPLAY_FAST,
+		30, 0));
+	replay_format(&r, &fourcc, &w, &h, &stride, &max_len);
+	assert(fourcc == CONVERT_YU12 && w == 8 && h == 4 && stride == 8 &&
+		max_len == 48);
+	for (i = 0; i < 5; i++) {
+		assert(!replay_next(&r, &f));
+		assert(f.len == 48 && f.sequence == (unsigned int)i);
+		assert(f.data[0] == i && f.data[47] == i);
+	}
+	assert(replay_next(&r, &f) == 1);
+	close_replay(&r);
+	// formats that can't be raw, frames bigger than the file
+	assert(init_replay(&r, fd, "x.yuv", REPLAY_MJPG, 8, 4, REPLAY_FAST,
+		30, 0) == -1);
+	assert(init_replay(&r, fd, "x.yuv", CONVERT_BGR3, 64, 64, REPLAY_FAST,
+		30, 0) == -1);
+	close(fd);
+	printf("raw ok\n");
+
+	// Y4M at 50 fps, played at its own rate and looped
+	len = sprintf((char*)data, "YUV4MPEG2 W4 H2 F50:1 Ip A0:0 C420jpeg "
+		"XYSCSS=420JPEG\n");
+	for (i = 0; i < 3; i++) {
+		len += sprintf((char*)data + len, i == 1 ? "FRAME Ixyz\n" :
+			"FRAME\n");
+		memset(data + len, 'a' + i, 12);
+		len += 12;
+	}
+	fd = file_of(data, len);
+	assert(!init_replay(&r, fd, "x.Y4M", 0, 0, 0, REPLAY_ORIGINAL, 5, 1));
+	replay_format(&r, &fourcc, &w, &h, &stride, &max_len);
+	assert(fourcc == CONVERT_YU12 && w == 4 && h == 2 && max_len == 12);
+	t = clock_ns();
+	for (i = 0; i < 7; i++) {
+		assert(!replay_next(&r, &f));
+		assert(f.len == 12 && f.data[0] == 'a' + i % 3 &&
+			f.data[11] == 'a' + i % 3);
+		assert(f.sequence == (unsigned int)i);
+	}
+	assert(ms_since(t) >= 6 * 20 - 1);
+	printf("  7 frames at 50 fps in %.1f ms\n", ms_since(t));
+	// late, the frames due meanwhile are skipped
+	usleep(70000);
+	assert(!replay_next(&r, &f));
+	assert(f.sequence >= 9 && f.data[0] == 'a' + f.sequence % 3);
+	close_replay(&r);
+	// at a fixed rate instead
+	assert(!init_replay(&r, fd, "x.y4m", 0, 0, 0, REPLAY_FIXED, 100, 0));
+	assert(!replay_due(&r));
+	t = clock_ns();
+	for (i = 0; i < 3; i++)
+		assert(!replay_next(&r, &f));
+	assert(ms_since(t) >= 2 * 10 - 1 && ms_since(t) < 40);
+	assert(replay_due(&r) > clock_ns() && replay_due(&r) - clock_ns() <=
+		10000000);
+	assert(replay_next(&r, &f) == 1);
+	close_replay(&r);
+	close(fd);
+
+	// other chroma, broken headers
+	len = sprintf((char*)data, "YUV4MPEG2 W4 H2 C422\nFRAME\n");
+	fd = file_of(data, len + 16);
+	assert(!init_replay(&r, fd, "x.y4m", 0, 0, 0, REPLAY_FAST, 0, 0));
+	replay_format(&r, &fourcc, &w, &h, &stride, &max_len);
+	assert(fourcc == CONVERT_422P && max_len == 16);
+	close_replay(&r);
+	close(fd);
+	len = sprintf((char*)data, "YUV4MPEG2 W4 H2 C444\nFRAME\n");
+	fd = file_of(data, len + 24);
+	assert(init_replay(&r, fd, "x.y4m", 0, 0, 0, REPLAY_FAST, 0, 0) == -1);
+	close(fd);
+	len = sprintf((char*)data, "YUV4MPEG W4 H2\nFRAME\n");
+	fd = file_of(data, len + 12);
+	assert(init_replay(&r, fd, "x.y4m", 0, 0, 0, REPLAY_FAST, 0, 0) == -1);
+	close(fd);
+	printf("y4m ok\n");
+
+	// JPEGs with junk in between and a broken one at the end
+	len = 0;
+	for (i = 0; i < 3; i++) {
+		len += jpeg_of(data + len, i);
+		data[len++] = 0;
+	}
+	len += jpeg_of(data + len, 3) - 4;
+	fd = file_of(data, len);
+	assert(!init_replay(&r, fd, "x.mjpg", 0, 0, 0, REPLAY_FAST, 0, 0));
+	replay_format(&r, &fourcc, &w, &h, &stride, &max_len);
+	assert(fourcc == REPLAY_MJPG && w == 16 && h == 8 && stride == 0);
+	for (i = 0; i < 3; i++) {
+		assert(!replay_next(&r, &f));
+		assert(f.len == max_len && f.data[0] == 0xff && f.data[1] == 0xd8);
+		assert(f.data[f.len - 2] == 0xff && f.data[f.len - 1] == 0xd9);
+		assert(f.data[f.len - 3] == i);
+	}
+	assert(replay_next(&r, &f) == 1);
+	close_replay(&r);
+	close(fd);
+	// back to back, the last one ends the file
+	len = jpeg_of(data, 0);
+	len += jpeg_of(data + len, 1);
+	fd = file_of(data, len);
+	assert(!init_replay(&r, fd, "x.mjpeg", 0, 0, 0, REPLAY_FAST, 0, 0));
+	for (i = 0; i < 2; i++) {
+		assert(!replay_next(&r, &f));
+		assert(f.data[f.len - 3] == i);
+	}
+	assert(replay_next(&r, &f) == 1);
+	close_replay(&r);
+	close(fd);
+	// a single picture
+	fd = file_of(data, jpeg_of(data, 5));
+	assert(!init_replay(&r, fd, "x.jpg", 0, 0, 0, REPLAY_FAST, 0, 0));
+	assert(!replay_next(&r, &f) && f.data[f.len - 3] == 5);
+	assert(replay_next(&r, &f) == 1);
+	close_replay(&r);
+	close(fd);
+	printf("mjpeg ok\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+// frames played from a file as a camera would deliver them, for runs
+// without a camera (video_device "file:<path>", see vid_v4l2_start). the
+// file is mapped and frames are handed out in place. late frames are
+// skipped like a driver drops them, their numbers are left out of the
+// sequence
+
+// how frames are paced
+#define REPLAY_ORIGINAL 0 // at the rate in the file (Y4M), else at fps
+#define REPLAY_FIXED    1 // at fps
+#define REPLAY_FAST     2 // as fast as they are asked for, none skipped
+
+struct replay {
+	void* priv; //a hidden datastructure
+};
+
+struct replay_frame {
+	const unsigned char* data; // in the file, valid until close_replay
+	int len;
+	unsigned int sequence;     // frames since the start, across loops
+	uint64_t t_due;            // CLOCK_MONOTONIC ns it was due
+};
+
+// all return values are 0 if success
+
+int  init_replay(struct replay* r, int fd, const char* name,
+	unsigned int fourcc, int width, int height, int timing, int fps,
+	int loop);
+	// the extension of name says what fd holds: .y4m, .mjpg, .mjpeg or
+	// .jpg (JPEGs one after the other), anything else raw frames of
+	// fourcc (YU12, NV12, YUYV, UYVY, 422P, GREY, BA81 or BGR3) and
+	// width x height. a part of a frame at the end is left out. fd is
+	// mapped, not closed. loop starts over at the end of the file
+void replay_format(struct replay* r, unsigned int* fourcc, int* width,
+	int* height, int* stride, int* max_len);
+	// what the frames are, stride is bytes per line of the first plane
+	// (0 for JPEG), max_len the size of the largest frame
+int  replay_next(struct replay* r, struct replay_frame* f);
+	// waits until the next frame is due and returns it, 1 at the end of
+	// the file if not looping
+uint64_t replay_due(struct replay* r);
+	// CLOCK_MONOTONIC ns the next frame is due, 0 if right away. for
+	// callers that wait themselves (e.g. with a timerfd)
+void close_replay(struct replay* r);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "result.h"
+
+#define RESULT_WORDS (int)(sizeof(struct result) / sizeof(int))
+
+// lock is odd while the slot is written, 0 if it never was
+struct result_slot {
+	int lock;
+	int words[RESULT_WORDS]; // a struct result, word by word
+};
+
+struct results_priv {
+	unsigned int head; // results published
+	struct result_slot slots[RESULT_SLOTS];
+};
+
+int init_results(struct results* r)
+{
+	struct results_priv* rp;
+
+	rp = (struct results_priv*)calloc(1, sizeof(*rp));
+	if (!rp)
+		return -1;
+	r->priv = (void*)rp;
+
+	return 0;
+}
+
+void publish_result(struct results* r, const struct result* res)
+{
+	struct results_priv* rp = (struct results_priv*)r->priv;
+	unsigned int head = __atomic_load_n(&rp->head, __ATOMIC_RELAXED);
+	struct result_slot* s = &rp->slots[head % RESULT_SLOTS];
+	const int* w = (const int*)res;
+	int lock = __atomic_load_n(&s->lock, __ATOMIC_RELAXED);
+	int i;
+
+	// a reader seeing any new word sees the odd lock after it, plain
+	// moves on x86
+	__atomic_store_n(&s->lock, lock + 1, __ATOMIC_RELAXED);
+	for (i = 0; i < RESULT_WORDS; i++)
+		__atomic_store_n(&s->words[i], w[i], __ATOMIC_RELEASE);
+	__atomic_store_n(&s->lock, lock + 2, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&rp->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// -1 if the slot is being written (or was while reading) or empty
+static int read_slot(struct result_slot* s, struct result* res)
+{
+	int* w = (int*)res;
+	int lock, i;
+
+	lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+	if (!lock || (lock & 1))
+		return -1;
+	for (i = 0; i < RESULT_WORDS; i++)
+		w[i] = __atomic_load_n(&s->words[i], __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->lock, __ATOMIC_RELAXED) == lock ? 0 : -1;
+}
+
+// boxes of res seen in prev too go on at the same speed to seq, no
+// further ahead than the two results are apart
+static void extrapolate_to(struct result* res, const struct result* prev,
+	int seq)
+{
+	int dt = res->seq - prev->seq;
+	int ds = seq - res->seq;
+	int i, j;
+
+	if (ds > dt)
+		ds = dt;
+	for (i = 0; i < res->n; i++) {
+		struct result_rect* a = &res->rects[i];
+
+		for (j = 0; j < prev->n; j++) {
+			const struct result_rect* b = &prev->rects[j];
+
+			if (a->id != b->id)
+				continue;
+			a->x += (a->x - b->x) * ds / dt;
+			a->y += (a->y - b->y) * ds / dt;
+			a->width += (a->width - b->width) * ds / dt;
+			a->height += (a->height - b->height) * ds / dt;
+			break;
+		}
+	}
+}
+
+int result_at(struct results* r, int seq, int extrapolate,
+	struct result* res)
+{
+	struct results_priv* rp = (struct results_priv*)r->priv;
+	unsigned int head = __atomic_load_n(&rp->head, __ATOMIC_ACQUIRE);
+	struct result prev;
+	int i, found = 0;
+
+	// newest first, slots lapped by the publisher meanwhile are skipped
+	for (i = 1; i <= RESULT_SLOTS && i <= (int)head; i++) {
+		struct result_slot* s = &rp->slots[(head - i) % RESULT_SLOTS];
+
+		if (read_slot(s, found ? &prev : res))
+			continue;
+		if (!found) {
+			if (res->seq - seq > 0)
+				continue;
+			found = 1;
+			if (!extrapolate)
+				break;
+		} else if (prev.seq - res->seq < 0) {
+			extrapolate_to(res, &prev, seq);
+			break;
+		}
+	}
+
+	if (!found)
+		return -1;
+	if (extrapolate)
+		res->seq = seq;
+
+	return 0;
+}
+
+void close_results(struct results* r)
+{
+	free(r->priv);
+}
+
+#ifdef RESULT_TEST
+#include <assert.h>
+#include <pthread.h>
+
+#define N_RESULTS 200000
+
+static struct results results;
+static int last_seq; // published
+static volatile int done;
+
+// every field follows from seq, a torn read shows
+static void fill(struct result* res, int seq)
+{
+	int i;
+
+	res->seq = seq;
+	res->n = seq % (RESULT_MAX_RECTS + 1);
+	for (i = 0; i < RESULT_MAX_RECTS; i++) {
+		res->rects[i].id = i;
+		res->rects[i].x = seq + i;
+		res->rects[i].y = seq * 2 + i;
+		res->rects[i].width = seq * 3;
+		res->rects[i].height = seq ^ i;
+	}
+}
+
+static void* publisher(void* argv)
+{
+	struct result res;
+	int seq;
+
+	// every other frame, as a slow detector would
+	for (seq = 2; seq <= N_RESULTS * 2; seq += 2) {
+		fill(&res, seq);
+		publish_result(&results, &res);
+		__atomic_store_n(&last_seq, seq, __ATOMIC_RELAXED);
+	}
+	done = 1;
+
+	return NULL;
+}
+
+static void* reader(void* argv)
+{
+	struct result res, ref;
+	int n_reads = 0, n_found = 0;
+
+	while (!done) {
+		// frames around the newest result
+		int seq = __atomic_load_n(&last_seq, __ATOMIC_RELAXED) + 
+			2 - (n_reads % 5);
+
+		n_reads++;
+		if (result_at(&results, seq, 0, &res))
+			continue;
+		n_found++;
+		assert(res.seq <= seq && !(res.seq & 1));
+		fill(&ref, res.seq);
+		assert(!memcmp(&res, &ref, sizeof(res)));
+	}
+	printf("  reader %d reads, %d found\n", n_reads, n_found);
+
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct result res;
+	pthread_t threads[3];
+	int i;
+
+	assert(!init_results(&results));
+
+	// nothing yet, nothing old enough
+	assert(result_at(&results, 10, 0, &res) == -1);
+	res.n = 1;
+	res.rects[0].id = 7;
+	res.rects[0].x = 100;
+	res.rects[0].y = 50;
+	res.rects[0].width = 40;
+	res.rects[0].height = 40;
+	res.seq = 10;
+	publish_result(&results, &res);
+	assert(result_at(&results, 9, 0, &res) == -1);
+	assert(!result_at(&results, 10, 0, &res) && res.seq == 10);
+	assert(!result_at(&results, 13, 0, &res) && res.seq == 10);
+	// one result can't be extrapolated
+	assert(!result_at(&results, 13, 1, &res) && res.seq == 13 &&
+		res.rects[0].x == 100);
+
+	// moving right 4 per frame and growing 1 per frame
+	res.seq = 12;
+	res.rects[0].x = 108;
+	res.rects[0].width = 42;
+	res.rects[0].height = 42;
+	publish_result(&results, &res);
+	assert(!result_at(&results, 13, 1, &res) && res.seq == 13);
+	assert(res.rects[0].x == 112 && res.rects[0].y == 50 &&
+		res.rects[0].width == 43);
+	// at most as far ahead as the results are apart
+	assert(!result_at(&results, 20, 1, &res) && res.rects[0].x == 116);
+	// another object isn't moved
+	res.seq = 14;
+	res.rects[0].id = 8;
+	res.rects[0].x = 108;
+	publish_result(&results, &res);
+	assert(!result_at(&results, 15, 1, &res) && res.rects[0].x == 108);
+	// older results are still there
+	assert(!result_at(&results, 11, 0, &res) && res.seq == 10);
+	close_results(&results);
+	printf("result lookup and extrapolation ok\n");
+
+	assert(!init_results(&results));
+	for (i = 0; i < 3; i++)
+		assert(!pthread_create(&threads[i], NULL,
+			i ? reader : publisher, NULL));
+	for (i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+	assert(!result_at(&results, N_RESULTS * 2, 0, &res) &&
+		res.seq == N_RESULTS * 2);
+	close_results(&results);
+	printf("%d results, no torn reads\n", N_RESULTS);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,43 @@
+#ifndef __RESULT_H__
+#define __RESULT_H__
+
+// results of a consumer (face boxes) handed to another (render) without
+// locks. one thread publishes, each result stamped with the seq of the
+// frame it was computed on, any thread reads the one that goes with the
+// frame it is showing. the last RESULT_SLOTS are kept, a seqlock per
+// slot so a reader never waits and never sees half a result
+
+#define RESULT_SLOTS 8
+#define RESULT_MAX_RECTS 16
+
+struct result_rect {
+	int id;       // same object in results of different frames
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+struct result {
+	int seq;      // buf_seq of the frame
+	int n;
+	struct result_rect rects[RESULT_MAX_RECTS];
+};
+
+struct results {
+	void* priv; //a hidden datastructure
+};
+
+// all return values are 0 if success
+
+int  init_results(struct results* r);
+void publish_result(struct results* r, const struct result* res);
+	// from one thread only, seq going up
+int  result_at(struct results* r, int seq, int extrapolate,
+	struct result* res);
+	// the newest result computed on frame seq or before it, -1 if there
+	// is none. with extrapolate boxes found in the two newest results
+	// move on at the same speed to seq, and res->seq is seq
+void close_results(struct results* r);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tpool.h"
+
+struct tpool_priv {
+	pthread_mutex_t busy; // held by the caller of the job in the pool
+	pthread_mutex_t lock;
+	pthread_cond_t work;  // job posted or stopping
+	pthread_cond_t done;  // last band finished
+
+	// the job, bands are taken in order under lock
+	void (*fn)(void* arg, int h0, int h1);
+	void* arg;
+	int height;
+	int rows;             // per band, a multiple of align
+	int n_bands;
+	int next;             // band to take next
+	int left;             // bands not finished
+	int stop;
+
+	pthread_t* threads;
+	int n_threads;        // workers, the caller makes one more
+};
+
+// takes a band and runs it, 0 if there was none left. lock is held
+static int run_band(struct tpool_priv* tpp)
+{
+	void (*fn)(void* arg, int h0, int h1) = tpp->fn;
+	void* arg = tpp->arg;
+	int h0, h1;
+
+	if (tpp->next >= tpp->n_bands)
+		return 0;
+
+	h0 = tpp->next++ * tpp->rows;
+	h1 = h0 + tpp->rows < tpp->height ? h0 + tpp->rows : tpp->height;
+	pthread_mutex_unlock(&tpp->lock);
+
+	fn(arg, h0, h1);
+
+	pthread_mutex_lock(&tpp->lock);
+	if (!--tpp->left)
+		pthread_cond_signal(&tpp->done);
+
+	return 1;
+}
+
+static void* worker_thread(void* argv)
+{
+	struct tpool_priv* tpp = (struct tpool_priv*)argv;
+
+	pthread_mutex_lock(&tpp->lock);
+	for (;;) {
+		while (!tpp->stop && tpp->next >= tpp->n_bands)
+			pthread_cond_wait(&tpp->work, &tpp->lock);
+		if (tpp->stop)
+			break;
+		run_band(tpp);
+	}
+	pthread_mutex_unlock(&tpp->lock);
+
+	return NULL;
+}
+
+int init_tpool(struct tpool* tp, int n_threads)
+{
+	struct tpool_priv* tpp;
+	int i;
+
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads <= 0)
+		n_threads = 1;
+
+	tpp = (struct tpool_priv*)calloc(1, sizeof(*tpp));
+	if (!tpp)
+		return -1;
+	tpp->threads = (pthread_t*)calloc(n_threads, sizeof(tpp->threads[0]));
+	if (!tpp->threads) {
+		free(tpp);
+		return -1;
+	}
+
+	pthread_mutex_init(&tpp->busy, NULL);
+	pthread_mutex_init(&tpp->lock, NULL);
+	pthread_cond_init(&tpp->work, NULL);
+	pthread_cond_init(&tpp->done, NULL);
+	tp->priv = (void*)tpp;
+
+	for (i = 0; i < n_threads - 1; i++) {
+		if (pthread_create(&tpp->threads[i], NULL, worker_thread, tpp)) {
+			close_tpool(tp);
+			return -1;
+		}
+		tpp->n_threads++;
+	}
+
+	return 0;
+}
+
+int tpool_threads(struct tpool* tp)
+{
+	struct tpool_priv* tpp = (struct tpool_priv*)tp->priv;
+
+	return tpp->n_threads + 1;
+}
+
+void tpool_bands(struct tpool* tp, int height, int align,
+	void (*fn)(void* arg, int h0, int h1), void* arg)
+{
+	struct tpool_priv* tpp = (struct tpool_priv*)tp->priv;
+	int n = tpp->n_threads + 1;
+	int rows;
+
+	if (height <= 0)
+		return;
+	if (align < 1)
+		align = 1;
+	// bands no smaller than align, the last one may be short
+	rows = (height + n - 1) / n;
+	rows = (rows + align - 1) / align * align;
+
+	if (n == 1 || height <= rows || pthread_mutex_trylock(&tpp->busy)) {
+		fn(arg, 0, height);
+		return;
+	}
+
+	pthread_mutex_lock(&tpp->lock);
+	tpp->fn = fn;
+	tpp->arg = arg;
+	tpp->height = height;
+	tpp->rows = rows;
+	tpp->n_bands = (height + rows - 1) / rows;
+	tpp->left = tpp->n_bands;
+	tpp->next = 0;
+	pthread_cond_broadcast(&tpp->work);
+
+	while (run_band(tpp))
+		;
+	while (tpp->left)
+		pthread_cond_wait(&tpp->done, &tpp->lock);
+	pthread_mutex_unlock(&tpp->lock);
+
+	pthread_mutex_unlock(&tpp->busy);
+}
+
+void close_tpool(struct tpool* tp)
+{
+	struct tpool_priv* tpp = (struct tpool_priv*)tp->priv;
+	int i;
+
+	// a job in the pool finishes first, its caller still uses tpp
+	pthread_mutex_lock(&tpp->busy);
+	pthread_mutex_lock(&tpp->lock);
+	tpp->stop = 1;
+	pthread_cond_broadcast(&tpp->work);
+	pthread_mutex_unlock(&tpp->lock);
+
+	for (i = 0; i < tpp->n_threads; i++)
+		pthread_join(tpp->threads[i], NULL);
+
+	pthread_mutex_unlock(&tpp->busy);
+	pthread_mutex_destroy(&tpp->busy);
+	pthread_mutex_destroy(&tpp->lock);
+	pthread_cond_destroy(&tpp->work);
+	pthread_cond_destroy(&tpp->done);
+	free(tpp->threads);
+	free(tpp);
+}
+
+#ifdef TPOOL_TEST
+#include <assert.h>
+#include <string.h>
+
+#define H_MAX 4096
+
+struct cover {
+	int rows[H_MAX]; // times each row was handed out
+	int align;
+	int n_calls;
+};
+
+static void mark(void* arg, int h0, int h1)
+{
+	struct cover* c = (struct cover*)arg;
+	int h;
+
+	assert(h0 % c->align == 0);
+	assert(h0 < h1);
+	for (h = h0; h < h1; h++)
+		c->rows[h]++;
+	__atomic_add_fetch(&c->n_calls, 1, __ATOMIC_RELAXED);
+}
+
+static void check(struct tpool* tp, int height, int align)
+{
+	static struct cover c;
+	int h;
+
+	memset(&c, 0, sizeof(c));
+	c.align = align;
+	tpool_bands(tp, height, align, mark, &c);
+
+	for (h = 0; h < height; h++)
+		assert(c.rows[h] == 1);
+	assert(c.n_calls <= tpool_threads(tp));
+}
+
+// several threads posting jobs at once, the ones finding the pool busy
+// run theirs alone
+static void* poster(void* argv)
+{
+	struct tpool* tp = (struct tpool*)argv;
+	struct cover* c = (struct cover*)calloc(1, sizeof(*c));
+	int i, h;
+
+	c->align = 2;
+	for (i = 0; i < 200; i++) {
+		memset(c->rows, 0, sizeof(c->rows));
+		tpool_bands(tp, 2160, 2, mark, c);
+		for (h = 0; h < 2160; h++)
+			assert(c->rows[h] == 1);
+	}
+	free(c);
+
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct tpool tp;
+	pthread_t threads[3];
+	int i, n;
+
+	for (n = 1; n <= 8; n++) {
+		assert(!init_tpool(&tp, n));
+		assert(tpool_threads(&tp) == n);
+
+		check(&tp, 2160, 2);
+		check(&tp, 1080, 2);
+		check(&tp, 7, 2);   // fewer rows than bands
+		check(&tp, 1, 1);
+		check(&tp, 0, 2);
+		check(&tp, 4095, 16);
+		for (i = 0; i < 1000; i++)
+			check(&tp, 480, 2);
+
+		for (i = 0; i < 3; i++)
+			assert(!pthread_create(&threads[i], NULL, poster, &tp));
+		for (i = 0; i < 3; i++)
+			pthread_join(threads[i], NULL);
+
+		close_tpool(&tp);
+	}
+
+	assert(!init_tpool(&tp, 0));
+	printf("%d threads by default\n", tpool_threads(&tp));
+	close_tpool(&tp);
+
+	printf("tpool ok\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+#ifndef __TPOOL_H__
+#define __TPOOL_H__
+
+// persistent threads splitting one job into bands of rows, for work on
+// a frame too big for one core (color conversion of 4K frames). the
+// calling thread takes bands too and returns once all are done
+
+struct tpool {
+	void* priv; //a hidden datastructure
+};
+
+// all return values are 0 if success
+
+int  init_tpool(struct tpool* tp, int n_threads);
+	// n_threads run a job including the caller, 0 for one per core
+int  tpool_threads(struct tpool* tp);
+	// threads a job is split across
+void tpool_bands(struct tpool* tp, int height, int align,
+	void (*fn)(void* arg, int h0, int h1), void* arg);
+	// fn(arg, h0, h1) for bands of rows [h0, h1) covering [0, height),
+	// each starting at a multiple of align. runs it all on the caller
+	// if another thread's job is in the pool already, so it never waits
+	// for someone else's frame
+void close_tpool(struct tpool* tp);
+	// waits for a job in the pool, but no tpool_bands may be called
+	// meanwhile or after, join the threads calling it first
+
+#endif
@@ -50,6 +50,10 @@
 #ifdef MOTION_V4L2
 
 #include "global.h"
+#include "pipe.h"
+#include "mjpeg.h"
+#include "convert.h"
+#include "replay.h"
 //#include "motion.h"
 //#include "netcam.h"
 //#include "video.h"
@@ -62,6 +66,7 @@
 
 #include <linux/videodev2.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <linux/v4l2-controls.h>
 #include <stdint.h>
 #include <signal.h>
@@ -77,8 +82,8 @@
 #define u32 unsigned int
 #define s32 signed int
 
-#define MMAP_BUFFERS        4
-#define MIN_MMAP_BUFFERS    2
+#define MMAP_BUFFERS        4   /* unless conf.v4l2_buffers says otherwise */
+#define MIN_MMAP_BUFFERS    2   /* and conf.low_latency */
 
 #ifndef V4L2_PIX_FMT_SBGGR8
 /* see http://www.siliconimaging.com/RGB%20Bayer.htm */
@@ -120,6 +125,7 @@ typedef struct netcam_image_buff {
     size_t size;                    /* total allocated size */                                           
     size_t used;                    /* bytes already used */                                             
     struct timeval image_time;      /* time this image was received */                                   
+    void *priv;                     /* USERPTR: pipe handle while queued */
 } netcam_buff;                                                                                           
 typedef netcam_buff *netcam_buff_ptr; 
 
@@ -136,6 +142,16 @@ typedef struct {
     netcam_buff *buffers;
 
     s32 pframe;
+    u32 n_buffers;                  /* to request, see conf.v4l2_buffers */
+    u32 queued;                     /* USERPTR: buffers owned by the driver */
+    char streaming;
+
+    uint64_t t_dqbuf;               /* last frame dequeued, pipe_clock_ns() */
+    uint64_t t_convert;             /* last frame converted by v4l2_next */
+    char converted;                 /* last frame went through v4l2_next */
+    char passthrough;               /* frames are handed on in the driver format */
+
+    struct mjpeg mjpeg;             /* (M)JPEG decoder, only for those formats */
 
     u32 ctrl_flags;
     struct v4l2_queryctrl *controls;
@@ -370,6 +386,23 @@ static int v4l2_do_set_pix_format(u32 pixformat, src_v4l2_t * s,
     return -1;
 }
 
+/*
+ * Note that this array MUST exactly match the config file list.
+ * A higher index means better chance to be used 
+ */
+static const u32 supported_formats[] = {
+    V4L2_PIX_FMT_SN9C10X,
+    V4L2_PIX_FMT_SBGGR8,
+    V4L2_PIX_FMT_MJPEG,
+    V4L2_PIX_FMT_JPEG,
+    V4L2_PIX_FMT_RGB24,
+    V4L2_PIX_FMT_UYVY,
+    V4L2_PIX_FMT_YUYV,
+    V4L2_PIX_FMT_YUV422P,
+    V4L2_PIX_FMT_YUV420,	/* most efficient for motion */
+    V4L2_PIX_FMT_NV12
+};
+
 /* This routine is called by the startup code to do the format setting */
 static int v4l2_set_pix_format(struct context *cnt, src_v4l2_t * s,
 			       int *width, int *height)
@@ -377,22 +410,6 @@ static int v4l2_set_pix_format(struct context *cnt, src_v4l2_t * s,
     struct v4l2_fmtdesc fmt;
     short int v4l2_pal;
 
-    /* 
-     * Note that this array MUST exactly match the config file list.
-     * A higher index means better chance to be used 
-     */
-    static const u32 supported_formats[] = {
-        V4L2_PIX_FMT_SN9C10X,
-        V4L2_PIX_FMT_SBGGR8,
-        V4L2_PIX_FMT_MJPEG,
-        V4L2_PIX_FMT_JPEG,
-        V4L2_PIX_FMT_RGB24,
-        V4L2_PIX_FMT_UYVY,
-        V4L2_PIX_FMT_YUYV,
-        V4L2_PIX_FMT_YUV422P,
-        V4L2_PIX_FMT_YUV420	/* most efficient for motion */
-    };
-    
     int array_size = sizeof(supported_formats) / sizeof(supported_formats[0]);
     short int index_format = -1;	/* -1 says not yet chosen */
 
@@ -482,7 +499,7 @@ static int v4l2_set_mmap(src_v4l2_t * s)
 
     memset(&s->req, 0, sizeof(struct v4l2_requestbuffers));
 
-    s->req.count = MMAP_BUFFERS;
+    s->req.count = s->n_buffers;
     s->req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     s->req.memory = V4L2_MEMORY_MMAP;
 
@@ -533,6 +550,7 @@ static int v4l2_set_mmap(src_v4l2_t * s)
     }
 
     s->map = -1;
+    s->streaming = 1;
 
     for (b = 0; b < s->req.count; b++) {
         memset(&s->buf, 0, sizeof(struct v4l2_buffer));
@@ -557,6 +575,50 @@ static int v4l2_set_mmap(src_v4l2_t * s)
     return 0;
 }
 
+/**
+ * v4l2_set_userptr
+ *
+ * Only negotiates the buffer slots, the memory itself comes from the pipe
+ * through v4l2_queue and streaming starts with the first queued buffer.
+ */
+static int v4l2_set_userptr(src_v4l2_t * s)
+{
+    /* Does the device support streaming? */
+    if (!(s->cap.capabilities & V4L2_CAP_STREAMING))
+        return -1;
+
+    memset(&s->req, 0, sizeof(struct v4l2_requestbuffers));
+
+    s->req.count = s->n_buffers;
+    s->req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    s->req.memory = V4L2_MEMORY_USERPTR;
+
+    if (xioctl(s->fd, VIDIOC_REQBUFS, &s->req) == -1) {
+        motion_log(LOG_ERR, 1, "Error requesting buffers %d for user pointers. VIDIOC_REQBUFS", s->req.count);
+        return -1;
+    }
+
+    motion_log(LOG_DEBUG, 0, "userptr information:");
+    motion_log(LOG_DEBUG, 0, "frames=%d", s->req.count);
+
+    if (s->req.count < MIN_MMAP_BUFFERS) {
+        motion_log(LOG_ERR, 0, "Insufficient buffer slots.");
+        return -1;
+    }
+
+    s->buffers = (netcam_buff*)calloc(s->req.count, sizeof(netcam_buff));
+    if (!s->buffers) {
+        motion_log(LOG_ERR, 1, "%s: Out of memory.", __FUNCTION__);
+        return -1;
+    }
+
+    s->map = -1;
+    s->queued = 0;
+    s->streaming = 0;
+
+    return 0;
+}
+
 static int v4l2_scan_controls(src_v4l2_t * s)
 {
     int count, i;
@@ -740,6 +802,13 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
     s->fps = cnt->conf.frame_limit;
     s->pframe = -1;
 
+    /* every buffer queued ahead is a frame of latency once the consumer
+     * can't keep up, the fewer the fresher */
+    s->n_buffers = cnt->conf.low_latency ? MIN_MMAP_BUFFERS :
+                   cnt->conf.v4l2_buffers > 0 ? (u32) cnt->conf.v4l2_buffers : MMAP_BUFFERS;
+    if (s->n_buffers < MIN_MMAP_BUFFERS)
+        s->n_buffers = MIN_MMAP_BUFFERS;
+
     if (v4l2_get_capability(s)) 
         goto err;
     
@@ -751,11 +820,39 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
   
     if (v4l2_scan_controls(s))
         goto err;
+
+    if ((s->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG ||
+         s->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_JPEG) && init_mjpeg(&s->mjpeg)) {
+        motion_log(LOG_ERR, 0, "%s: unable to setup the jpeg decoder", __FUNCTION__);
+        goto err;
+    }
+
+    /* Consumers convert frames themselves if they know the format */
+    s->passthrough = cnt->conf.passthrough &&
+                     convert_supported(s->fmt.fmt.pix.pixelformat, CONVERT_BGR4);
+    if (cnt->conf.passthrough && !s->passthrough)
+        motion_log(LOG_INFO, 0, "Palette can't be passed through, converting to YUV420P");
+
+    /* Consumers read what the driver wrote in zero-copy and USERPTR mode,
+     * so it has to be exactly the YUV420P image they would get from v4l2_next 
+     * unless it is passed through anyway
+     */
+    if (cnt->conf.io_method != IO_METHOD_MMAP && !s->passthrough &&
+        (s->fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420 ||
+         s->fmt.fmt.pix.bytesperline != (unsigned int) width)) {
+        motion_log(LOG_INFO, 0, "Zero-copy needs unpadded YU12, falling back to copy");
+        cnt->conf.io_method = IO_METHOD_MMAP;
+    }
+
+    if (cnt->conf.io_method == IO_METHOD_USERPTR && v4l2_set_userptr(s)) {
+        motion_log(LOG_INFO, 0, "USERPTR not supported, falling back to copy");
+        cnt->conf.io_method = IO_METHOD_MMAP;
+    }
    
 #if 0
     v4l2_set_fps(s);
 #endif
-    if (v4l2_set_mmap(s)) 
+    if (cnt->conf.io_method != IO_METHOD_USERPTR && v4l2_set_mmap(s)) 
         goto err;
     
     viddev->size_map = 0;
@@ -764,7 +861,9 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
     viddev->v4l_curbuffer = 0;
 
     viddev->v4l_fmt = VIDEO_PALETTE_YUV420P;
-    viddev->v4l_bufsize = (width * height * 3) / 2;
+    /* what v4l2_next writes into map */
+    viddev->v4l_bufsize = s->passthrough ? (int) s->fmt.fmt.pix.sizeimage :
+                                           (width * height * 3) / 2;
 
 
     /* Update width and height with supported values from camera driver */
@@ -774,8 +873,11 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
     return (unsigned char *) 1;
 
 err:
-    if (s)
+    if (s) {
+        if (s->mjpeg.priv)
+            close_mjpeg(&s->mjpeg);
         free(s);
+    }
 
     viddev->v4l2_private = NULL;
     viddev->v4l2 = 0;
@@ -846,110 +948,6 @@ void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char
 }
 
 
-void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
-{
-    unsigned char *y, *u, *v;
-    unsigned char *r, *g, *b;
-    int i, loop;
-
-    b = cap_map;
-    g = b + 1;
-    r = g + 1;
-    y = map;
-    u = y + width * height;
-    v = u + (width * height) / 4;
-    memset(u, 0, width * height / 4);
-    memset(v, 0, width * height / 4);
-
-    for (loop = 0; loop < height; loop++) {
-        for (i = 0; i < width; i += 2) {
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            u++;
-            v++;
-        }
-
-        if ((loop & 1) == 0) {
-            u -= width / 2;
-            v -= width / 2;
-        }
-    }
-}
-
-void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height)
-{
-    uint8_t *pY = map;
-    uint8_t *pU = pY + (width * height);
-    uint8_t *pV = pU + (width * height) / 4;
-    uint32_t uv_offset = width * 2 * sizeof(uint8_t);
-    uint32_t ix, jx;
-
-    for (ix = 0; ix < height; ix++) {
-        for (jx = 0; jx < width; jx += 2) {
-            uint16_t calc;
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pU++ = (uint8_t) calc;
-            }
-            cap_map++;
-            *pY++ = *cap_map++;
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pV++ = (uint8_t) calc;
-            }
-            cap_map++;
-            *pY++ = *cap_map++;
-        }
-    }
-}
-
-void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
-{
-    unsigned char *src, *dest, *src2, *dest2;
-    int i, j;
-
-    /* Create the Y plane */
-    src = cap_map;
-    dest = map;
-    for (i = width * height; i > 0; i--) {
-        *dest++ = *src;
-        src += 2;
-    }
-    /* Create U and V planes */
-    src = cap_map + 1;
-    src2 = cap_map + width * 2 + 1;
-    dest = map + width * height;
-    dest2 = dest + (width * height) / 4;
-    for (i = height / 2; i > 0; i--) {
-        for (j = width / 2; j > 0; j--) {
-            *dest = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest++;
-            *dest2 = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest2++;
-        }
-        src += width * 2;
-        src2 += width * 2;
-    }
-}
-
 void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long int height)
 {
     long int i;
@@ -1022,14 +1020,10 @@ void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long in
     }
 }
 
-int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height)
+static int v4l2_dqbuf(src_v4l2_t *s)
 {
     sigset_t set, old;
-    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
-
-    if (viddev->v4l_fmt != VIDEO_PALETTE_YUV420P)
-        return V4L_FATAL_ERROR;
-
+    int ret = 0;
 
     /* Block signals during IOCTL */
     sigemptyset(&set);
@@ -1043,88 +1037,348 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
     if (s->pframe >= 0) {
         if (xioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1) {
             motion_log(LOG_ERR, 1, "%s: VIDIOC_QBUF", __FUNCTION__);
-            return -1;
+            ret = -1;
+            goto out;
         }
     }
 
     memset(&s->buf, 0, sizeof(struct v4l2_buffer));
 
     s->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    s->buf.memory = V4L2_MEMORY_MMAP;
+    s->buf.memory = s->req.memory;
 
     if (xioctl(s->fd, VIDIOC_DQBUF, &s->buf) == -1) {
 
+        /* non-blocking (vid_nonblock) and nothing captured yet, the
+           previous buffer is back with the driver already */
+        if (errno == EAGAIN) {
+            s->pframe = -1;
+            ret = 1;
+            goto out;
+        }
+
         /* some drivers return EIO when there is no signal, 
            driver might dequeue an (empty) buffer despite
-           returning an error, or even stop capturing.
+           returning an error, or even stop capturing. a buffer given
+           back already (v4l2_requeue, zero-copy, USERPTR) says nothing
+           about which one, nothing is guessed then
         */
         if (errno == EIO) {
-            s->pframe++; 
-            if ((u32)s->pframe >= s->req.count) s->pframe = 0;
-            s->buf.index = s->pframe;
+            if (s->pframe >= 0) {
+                s->pframe++; 
+                if ((u32)s->pframe >= s->req.count) s->pframe = 0;
+                s->buf.index = s->pframe;
+            }
 
             motion_log(LOG_ERR, 1, "%s: VIDIOC_DQBUF: EIO (s->pframe %d)", __FUNCTION__, s->pframe);
 
-            return 1;
+            ret = 1;
+            goto out;
         }
 
         motion_log(LOG_ERR, 1, "%s: VIDIOC_DQBUF", __FUNCTION__);
 
-        return -1;
+        ret = -1;
+        goto out;
     }
 
+    s->t_dqbuf = pipe_clock_ns();
     s->pframe = s->buf.index;
     s->buffers[s->buf.index].used = s->buf.bytesused;
     s->buffers[s->buf.index].content_length = s->buf.bytesused;
 
-    pthread_sigmask(SIG_UNBLOCK, &old, NULL);    /*undo the signal blocking */
+out:
+    pthread_sigmask(SIG_SETMASK, &old, NULL);    /*undo the signal blocking */
+
+    return ret;
+}
+
+/**
+ * v4l2_requeue
+ *
+ * The frame last dequeued was read out of its buffer, give it back to the
+ * driver now instead of at the next v4l2_dqbuf so the driver has it for the
+ * frame being captured meanwhile. s->buf stays as it is for v4l2_frame_info.
+ */
+static void v4l2_requeue(src_v4l2_t *s)
+{
+    struct v4l2_buffer buf;
+
+    if (s->pframe < 0)
+        return;
+
+    buf = s->buf;
+    if (xioctl(s->fd, VIDIOC_QBUF, &buf) == -1)
+        motion_log(LOG_ERR, 1, "%s: VIDIOC_QBUF", __FUNCTION__);
+    s->pframe = -1;
+}
+
+int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+    int ret;
+
+    if (viddev->v4l_fmt != VIDEO_PALETTE_YUV420P)
+        return V4L_FATAL_ERROR;
+
+    if ((ret = v4l2_dqbuf(s)))
+        return ret;
+
+    if (s->passthrough) {
+        /* copied as delivered, v4l2_frame_info describes the driver format */
+        memcpy(map, s->buffers[s->buf.index].ptr, viddev->v4l_bufsize);
+        v4l2_requeue(s);
+        s->converted = 0;
+        return 0;
+    }
 
     {
         netcam_buff *the_buffer = &s->buffers[s->buf.index];
 
         switch (s->fmt.fmt.pix.pixelformat) {
         case V4L2_PIX_FMT_RGB24:
-            conv_rgb24toyuv420p(map, (unsigned char *) the_buffer->ptr, width, height);
-            return 0;
+            convert_bgr24_yuv420((unsigned char *) the_buffer->ptr, map, width, height);
+            break;
 
         case V4L2_PIX_FMT_UYVY:
-            conv_uyvyto420p(map, (unsigned char *) the_buffer->ptr, (unsigned)width, (unsigned)height);
-            return 0;
+            convert_uyvy_yuv420((unsigned char *) the_buffer->ptr, s->fmt.fmt.pix.bytesperline,
+                                map, width, height);
+            break;
 
         case V4L2_PIX_FMT_YUYV:
+            convert_yuyv_yuv420((unsigned char *) the_buffer->ptr, s->fmt.fmt.pix.bytesperline,
+                                map, width, height);
+            break;
+
         case V4L2_PIX_FMT_YUV422P:
-            conv_yuv422to420p(map, (unsigned char *) the_buffer->ptr, width, height);
-            return 0;
+            convert_yuv422p_yuv420((unsigned char *) the_buffer->ptr, s->fmt.fmt.pix.bytesperline,
+                                   map, width, height);
+            break;
 
         case V4L2_PIX_FMT_YUV420:
             memcpy(map, the_buffer->ptr, viddev->v4l_bufsize);
-            return 0;
+            break;
+
+        case V4L2_PIX_FMT_NV12:
+            convert_frame(CONVERT_NV12, (unsigned char *) the_buffer->ptr, s->fmt.fmt.pix.bytesperline,
+                          CONVERT_YU12, map, width, height);
+            break;
 
         case V4L2_PIX_FMT_JPEG:            
         case V4L2_PIX_FMT_MJPEG:
-			assert(0); //not using this feature
-/*            
-            return mjpegtoyuv420p(map, (unsigned char *) the_buffer->ptr, width, height, 
-                                   s->buffers[s->buf.index].content_length);
-            return 0;
-        case V4L2_PIX_FMT_JPEG:
-            return conv_jpeg2yuv420(cnt, map, the_buffer, width, height);
-*/
-        case V4L2_PIX_FMT_SBGGR8:    /* bayer */
-            bayer2rgb24(cnt->imgs.common_buffer, (unsigned char *) the_buffer->ptr, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            /* Decoded straight into YUV420P, a broken frame is skipped */
+            if (mjpeg_decode(&s->mjpeg, (unsigned char *) the_buffer->ptr,
+                             the_buffer->content_length, map, width, height, 1)) {
+                v4l2_requeue(s);
+                return 1;
+            }
+            break;
+
+        case V4L2_PIX_FMT_SBGGR8:    /* bayer, demosaiced straight into YUV420P */
+            convert_bggr8_yuv420((unsigned char *) the_buffer->ptr, map, width, height);
+            break;
 
         case V4L2_PIX_FMT_SN9C10X:
 			assert(0); //not using this feature
             //sonix_decompress(map, (unsigned char *) the_buffer->ptr, width, height);
             bayer2rgb24(cnt->imgs.common_buffer, map, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            convert_bgr24_yuv420(cnt->imgs.common_buffer, map, width, height);
+            break;
+
+        default:
+            v4l2_requeue(s);
+            return 1;
         }
     }
 
-    return 1;
+    v4l2_requeue(s);
+    s->t_convert = pipe_clock_ns();
+    s->converted = 1;
+
+    return 0;
+}
+
+/**
+ * v4l2_next_ref
+ *
+ * Zero-copy variant of v4l2_next, the dequeued driver buffer is returned
+ * as is and stays owned by the caller until it is handed back with 
+ * v4l2_release.
+ */
+int v4l2_next_ref(struct context *cnt, struct video_dev *viddev, unsigned char **map)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+    int ret;
+
+    ret = v4l2_dqbuf(s);
+
+    /* not ours to requeue in the next v4l2_dqbuf anymore, and after an
+     * error (EIO) the buffer it guessed may be held by a consumer or be
+     * queued already */
+    s->pframe = -1;
+
+    if (ret)
+        return ret;
+
+    *map = (unsigned char *) s->buffers[s->buf.index].ptr;
+    s->converted = 0;
+
+    return 0;
+}
+
+void v4l2_release(struct video_dev *viddev, unsigned char *map)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+    struct v4l2_buffer buf;
+    u32 b;
+
+    for (b = 0; b < s->req.count; b++)
+        if ((unsigned char *) s->buffers[b].ptr == map)
+            break;
+
+    if (b == s->req.count) {
+        motion_log(LOG_ERR, 0, "%s: %p is not a driver buffer", __FUNCTION__, map);
+        return;
+    }
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = b;
+
+    if (xioctl(s->fd, VIDIOC_QBUF, &buf) == -1)
+        motion_log(LOG_ERR, 1, "%s: VIDIOC_QBUF", __FUNCTION__);
+}
+
+/**
+ * v4l2_queue
+ *
+ * USERPTR mode, hands a pipe buffer to the driver which captures straight 
+ * into it. handle comes back from v4l2_next_userptr once it is filled.
+ *
+ * Returns:  0  queued
+ *           1  all slots are queued already, try again later
+ *          -1  error
+ */
+int v4l2_queue(struct video_dev *viddev, void *handle, unsigned char *map, int len)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+    struct v4l2_buffer buf;
+    u32 b, slot = s->req.count;
+
+    if ((u32) len < s->fmt.fmt.pix.sizeimage) {
+        motion_log(LOG_ERR, 0, "%s: buffer of %d bytes, need %d", __FUNCTION__, 
+                   len, s->fmt.fmt.pix.sizeimage);
+        return -1;
+    }
+
+    /* Keep a buffer on the slot it had before so the driver can reuse its
+     * mapping, otherwise prefer a slot that was never used */
+    for (b = 0; b < s->req.count; b++) {
+        if ((unsigned char *) s->buffers[b].ptr == map) {
+            slot = b;
+            break;
+        }
+
+        if (s->buffers[b].priv)
+            continue;
+
+        if (slot == s->req.count || (s->buffers[slot].ptr && !s->buffers[b].ptr))
+            slot = b;
+    }
+
+    if (slot == s->req.count)
+        return 1;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_USERPTR;
+    buf.index = slot;
+    buf.m.userptr = (unsigned long) map;
+    buf.length = len;
+
+    if (xioctl(s->fd, VIDIOC_QBUF, &buf) == -1) {
+        motion_log(LOG_ERR, 1, "%s: VIDIOC_QBUF", __FUNCTION__);
+        return -1;
+    }
+
+    s->buffers[slot].ptr = (char *) map;
+    s->buffers[slot].size = len;
+    s->buffers[slot].priv = handle;
+    s->queued++;
+
+    if (!s->streaming) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (xioctl(s->fd, VIDIOC_STREAMON, &type) == -1) {
+            motion_log(LOG_ERR, 1, "Error starting stream VIDIOC_STREAMON");
+            return -1;
+        }
+        s->streaming = 1;
+    }
+
+    return 0;
+}
+
+int v4l2_next_userptr(struct context *cnt, struct video_dev *viddev, void **handle)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+    int ret;
+
+    /* nothing to wait for, DQBUF would block forever */
+    if (!s->queued)
+        return 1;
+
+    ret = v4l2_dqbuf(s);
+
+    /* buffers only go back to the driver through v4l2_queue */
+    s->pframe = -1;
+
+    if (ret)
+        return ret;
+
+    *handle = s->buffers[s->buf.index].priv;
+    s->buffers[s->buf.index].priv = NULL;
+    s->queued--;
+    s->converted = 0;
+
+    return 0;
+}
+
+/**
+ * v4l2_frame_info
+ *
+ * Describes the frame last returned by v4l2_next (as converted into map), 
+ * v4l2_next_ref or v4l2_next_userptr (as the driver delivered it).
+ */
+void v4l2_frame_info(struct video_dev *viddev, struct frame_info *info)
+{
+    src_v4l2_t *s = (src_v4l2_t *) viddev->v4l2_private;
+
+    /* CLOCK_MONOTONIC unless the driver says otherwise in buf.flags */
+    info->t_driver = (uint64_t) s->buf.timestamp.tv_sec * 1000000000 +
+                     (uint64_t) s->buf.timestamp.tv_usec * 1000;
+    info->t_capture = s->t_dqbuf;
+    info->sequence = s->buf.sequence;
+
+    if (s->converted) {
+        info->t_convert = s->t_convert;
+        info->fourcc = V4L2_PIX_FMT_YUV420;
+        info->width = viddev->width;
+        info->height = viddev->height;
+        info->stride = viddev->width;
+        info->bytesused = viddev->v4l_bufsize;
+    } else {
+        /* nothing to convert */
+        info->t_convert = s->t_dqbuf;
+        info->fourcc = s->fmt.fmt.pix.pixelformat;
+        info->width = s->fmt.fmt.pix.width;
+        info->height = s->fmt.fmt.pix.height;
+        info->stride = s->fmt.fmt.pix.bytesperline;
+        info->bytesused = s->buf.bytesused;
+    }
 }
 
 void v4l2_close(struct video_dev *viddev)
@@ -1145,7 +1399,8 @@ void v4l2_cleanup(struct video_dev *viddev)
     if (s->buffers) {
         unsigned int i;
 
-        for (i = 0; i < s->req.count; i++)
+        /* USERPTR buffers belong to the pipe */
+        for (i = 0; i < s->req.count && s->req.memory == V4L2_MEMORY_MMAP; i++)
             munmap(s->buffers[i].ptr, s->buffers[i].size);
 
         free(s->buffers);
@@ -1157,10 +1412,242 @@ void v4l2_cleanup(struct video_dev *viddev)
         s->controls = NULL;
     }
 
+    if (s->mjpeg.priv)
+        close_mjpeg(&s->mjpeg);
+
     free(s);
     viddev->v4l2_private = NULL;
 }
 
+/**
+ * file_start / file_next / file_next_ref / file_frame_info / file_cleanup
+ *
+ * video_device "file:<path>" plays a file (see replay.h) instead of a
+ * camera. Frames come out of the same vid_* calls with the same frame_info,
+ * zero-copy hands out the frames in the file mapping, so the pipe and its
+ * consumers can't tell the difference.
+ */
+typedef struct {
+    struct replay replay;
+    struct replay_frame frame;      /* last one handed out */
+    struct mjpeg mjpeg;             /* JPEG files, for file_next */
+
+    u32 fourcc;
+    int stride;
+    uint64_t t_capture;             /* last frame handed out, pipe_clock_ns() */
+    uint64_t t_convert;             /* last frame converted by file_next */
+    char converted;                 /* last frame went through file_next */
+    char passthrough;               /* frames are handed on as in the file */
+    int timer_fd;                   /* vid_nonblock, readable once a frame is due */
+} src_file_t;
+
+static int file_start(struct context *cnt, struct video_dev *viddev)
+{
+    const char *path = viddev->video_device + 5;
+    int array_size = sizeof(supported_formats) / sizeof(supported_formats[0]);
+    src_file_t *s;
+    u32 raw_fourcc = V4L2_PIX_FMT_YUV420;
+    int width, height, max_len;
+
+    /* raw frames are in the configured palette and size. RGB24 is read as
+     * the camera path reads it (convert_bgr24_yuv420), SN9C10X and the JPEG
+     * palettes can't be raw and init_replay refuses them
+     */
+    if (cnt->conf.v4l2_palette >= array_size) {
+        motion_log(LOG_ERR, 0, "%s: palette index %d out of range", __FUNCTION__,
+                   cnt->conf.v4l2_palette);
+        return -1;
+    }
+    if (cnt->conf.v4l2_palette >= 0)
+        raw_fourcc = supported_formats[cnt->conf.v4l2_palette];
+    if (raw_fourcc == V4L2_PIX_FMT_RGB24)
+        raw_fourcc = V4L2_PIX_FMT_BGR24;
+
+    if (!(s = (src_file_t *) calloc(sizeof(src_file_t), 1))) {
+        motion_log(LOG_ERR, 1, "%s: Out of memory.", __FUNCTION__);
+        return -1;
+    }
+    s->timer_fd = -1;
+
+    if (init_replay(&s->replay, viddev->fd, path, raw_fourcc,
+                    viddev->width, viddev->height, cnt->conf.replay_timing,
+                    cnt->conf.frame_limit, cnt->conf.replay_loop)) {
+        motion_log(LOG_ERR, 0, "%s: unable to play %s", __FUNCTION__, path);
+        free(s);
+        return -1;
+    }
+    replay_format(&s->replay, &s->fourcc, &width, &height, &s->stride, &max_len);
+
+    /* consumers work at the configured size */
+    if (width != viddev->width || height != viddev->height) {
+        motion_log(LOG_ERR, 0, "%s: %s is %dx%d, not %dx%d", __FUNCTION__, path,
+                   width, height, viddev->width, viddev->height);
+        goto err;
+    }
+
+    if (s->fourcc == V4L2_PIX_FMT_MJPEG && init_mjpeg(&s->mjpeg)) {
+        motion_log(LOG_ERR, 0, "%s: unable to setup the jpeg decoder", __FUNCTION__);
+        goto err;
+    }
+
+    s->passthrough = cnt->conf.passthrough && convert_supported(s->fourcc, CONVERT_BGR4);
+
+    /* nothing captures into pipe buffers, and zero-copy frames have to be
+     * what file_next would give unless they are passed through
+     */
+    if (cnt->conf.io_method == IO_METHOD_USERPTR ||
+        (cnt->conf.io_method == IO_METHOD_MMAP_ZC && !s->passthrough &&
+         (s->fourcc != V4L2_PIX_FMT_YUV420 || s->stride != width))) {
+        motion_log(LOG_INFO, 0, "Zero-copy of %s needs unpadded YU12 or passthrough, "
+                   "falling back to copy", path);
+        cnt->conf.io_method = IO_METHOD_MMAP;
+    }
+
+    viddev->file_private = s;
+    viddev->v4l_fmt = VIDEO_PALETTE_YUV420P;
+    /* what file_next writes into map */
+    viddev->v4l_bufsize = s->passthrough ? max_len : (width * height * 3) / 2;
+
+    return 0;
+
+err:
+    if (s->mjpeg.priv)
+        close_mjpeg(&s->mjpeg);
+    close_replay(&s->replay);
+    free(s);
+    return -1;
+}
+
+/* arms timer_fd for the next frame, which also clears it */
+static void file_arm(src_file_t *s)
+{
+    struct itimerspec its;
+    uint64_t due = replay_due(&s->replay);
+
+    memset(&its, 0, sizeof(its));
+    /* 0 would disarm it, a time long past fires right away */
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due ? due % 1000000000 : 1;
+    timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* the next frame of the file, 1 if it isn't due yet in non-blocking mode */
+static int file_frame(src_file_t *s)
+{
+    if (s->timer_fd >= 0 && replay_due(&s->replay) > pipe_clock_ns())
+        return 1;
+
+    if (replay_next(&s->replay, &s->frame))
+        return VID_END;
+    s->t_capture = pipe_clock_ns();
+
+    if (s->timer_fd >= 0)
+        file_arm(s);
+
+    return 0;
+}
+
+static int file_next(struct video_dev *viddev, unsigned char *map)
+{
+    src_file_t *s = (src_file_t *) viddev->file_private;
+    int width = viddev->width;
+    int height = viddev->height;
+    int ret;
+
+    if ((ret = file_frame(s)))
+        return ret;
+
+    if (s->passthrough) {
+        /* copied as is, file_frame_info describes the file format */
+        memcpy(map, s->frame.data, s->frame.len);
+        s->converted = 0;
+        return 0;
+    }
+
+    switch (s->fourcc) {
+    case V4L2_PIX_FMT_YUV420:
+        memcpy(map, s->frame.data, s->frame.len);
+        break;
+
+    case V4L2_PIX_FMT_MJPEG:
+        /* a broken frame is skipped */
+        if (mjpeg_decode(&s->mjpeg, s->frame.data, s->frame.len, map, width, height, 1))
+            return 1;
+        break;
+
+    case V4L2_PIX_FMT_BGR24:        /* raw in palette RGB24 */
+        convert_bgr24_yuv420(s->frame.data, map, width, height);
+        break;
+
+    case V4L2_PIX_FMT_GREY:         /* Y4M mono */
+        memcpy(map, s->frame.data, width * height);
+        memset(map + width * height, 128, (width * height) / 2);
+        break;
+
+    default:
+        if (convert_frame(s->fourcc, s->frame.data, s->stride, CONVERT_YU12,
+                          map, width, height))
+            return 1;
+    }
+
+    s->t_convert = pipe_clock_ns();
+    s->converted = 1;
+
+    return 0;
+}
+
+static int file_next_ref(struct video_dev *viddev, unsigned char **map)
+{
+    src_file_t *s = (src_file_t *) viddev->file_private;
+    int ret;
+
+    if ((ret = file_frame(s)))
+        return ret;
+
+    /* consumers only read, the mapping stays until file_cleanup */
+    *map = (unsigned char *) s->frame.data;
+    s->converted = 0;
+
+    return 0;
+}
+
+static void file_frame_info(struct video_dev *viddev, struct frame_info *info)
+{
+    src_file_t *s = (src_file_t *) viddev->file_private;
+
+    /* when the frame was due, where a driver puts the capture time */
+    info->t_driver = s->frame.t_due;
+    info->t_capture = s->t_capture;
+    info->sequence = s->frame.sequence;
+    info->width = viddev->width;
+    info->height = viddev->height;
+
+    if (s->converted) {
+        info->t_convert = s->t_convert;
+        info->fourcc = V4L2_PIX_FMT_YUV420;
+        info->stride = viddev->width;
+        info->bytesused = viddev->v4l_bufsize;
+    } else {
+        info->t_convert = s->t_capture;
+        info->fourcc = s->fourcc;
+        info->stride = s->stride;
+        info->bytesused = s->frame.len;
+    }
+}
+
+static void file_cleanup(struct video_dev *viddev)
+{
+    src_file_t *s = (src_file_t *) viddev->file_private;
+
+    if (s->mjpeg.priv)
+        close_mjpeg(&s->mjpeg);
+    if (s->timer_fd >= 0)
+        close(s->timer_fd);
+    close_replay(&s->replay);
+    free(s);
+    viddev->file_private = NULL;
+}
+
 /**
  * vid_v4lx_start
  *
@@ -1190,7 +1677,7 @@ int vid_v4l2_start(struct context *cnt)
     int fd = -1;
     struct video_dev *dev;
 
-    int width, height, input, norm, tuner_number;
+    int width, height, input, norm, tuner_number, is_file;
     unsigned long frequency;
 
     /* We use width and height from conf in this function. They will be assigned
@@ -1252,7 +1739,12 @@ case VIDEO_PALETTE_YUV422:
                 cnt->imgs.size = (width * height * 3) / 2;
                 break;
             }
+            /* native frames can be larger, see conf.passthrough */
+            if (dev->v4l_bufsize > cnt->imgs.size)
+                cnt->imgs.size = dev->v4l_bufsize;
             pthread_mutex_unlock(&vid_mutex);
+            cnt->video_dev = dev->fd;
+            cnt->dev = dev;
             return dev->fd;
         }
         dev = dev->next;
@@ -1263,7 +1755,9 @@ case VIDEO_PALETTE_YUV422:
 
     dev->video_device = conf->video_device;
 
-    fd = open(dev->video_device, O_RDWR);
+    /* "file:<path>" is played by file_start & co instead */
+    is_file = !strncmp(dev->video_device, "file:", 5);
+    fd = is_file ? open(dev->video_device + 5, O_RDONLY) : open(dev->video_device, O_RDWR);
 
     if (fd < 0) {
         motion_log(LOG_ERR, 1, "Failed to open video device %s", conf->video_device);
@@ -1295,9 +1789,10 @@ case VIDEO_PALETTE_YUV422:
     dev->fps = 0;
     /* First lets try V4L2 and if it's not supported V4L1 */
 
-    dev->v4l2 = 1;
+    dev->v4l2 = !is_file;
 
-    if (!v4l2_start(cnt, dev, width, height, input, norm, frequency, tuner_number)) {
+    if (is_file ? file_start(cnt, dev) :
+        !v4l2_start(cnt, dev, width, height, input, norm, frequency, tuner_number)) {
 		//return fail
         close(dev->fd);
         pthread_mutexattr_destroy(&dev->attr);
@@ -1308,7 +1803,10 @@ case VIDEO_PALETTE_YUV422:
         return -1;
     }
 
-    motion_log(-1, 0, "Using V4L2");
+    if (is_file)
+        motion_log(-1, 0, "Playing %s", dev->video_device + 5);
+    else
+        motion_log(-1, 0, "Using V4L2");
     /* Update width & height because could be changed in v4l2_start () */
     width = dev->width;
     height = dev->height;
@@ -1331,6 +1829,9 @@ case VIDEO_PALETTE_YUV422:
         cnt->imgs.motionsize = width * height;
         break;
     }
+    /* native frames can be larger, see conf.passthrough */
+    if (dev->v4l_bufsize > cnt->imgs.size)
+        cnt->imgs.size = dev->v4l_bufsize;
 
     /* Insert into linked list */
     dev->next = viddevs;
@@ -1339,37 +1840,189 @@ case VIDEO_PALETTE_YUV422:
     pthread_mutex_unlock(&vid_mutex);
 
 	cnt->video_dev = fd;
+	cnt->dev = dev;
 
 	return fd;
 }
 
-int vid_next(struct context* cnt, unsigned char* map)
+/* the device of cnt, set once by vid_v4l2_start so capturing a frame
+ * doesn't walk viddevs under vid_mutex */
+static struct video_dev *vid_find(struct context *cnt)
 {
-	struct video_dev *dev;                                                                           
-	int width, height, ret;
+    struct video_dev *dev;
+
+    if (cnt->dev)
+        return cnt->dev;
 
-    //width = cnt->rotate_data.cap_width;                                                              
-    //height = cnt->rotate_data.cap_height;                                                            
+    pthread_mutex_lock(&vid_mutex);
+    dev = viddevs;
+    while (dev) {
+        if (dev->fd == cnt->video_dev)
+            break;
+        dev = dev->next;
+    }
+    pthread_mutex_unlock(&vid_mutex);
+
+    return dev;
+}
+
+int vid_next(struct context* cnt, unsigned char* map)
+{
+	struct video_dev *dev = vid_find(cnt);
+	int width, height;
 
 	width = cnt->imgs.width;
 	height = cnt->imgs.height;
 
-    pthread_mutex_lock(&vid_mutex);                                                                  
-    dev = viddevs;                                                                                   
-    while (dev) {                                                                                    
-    	if (dev->fd == cnt->video_dev)                                                               
-        	break;                                                                                   
-        dev = dev->next;                                                                             
-    }                                                                                                
-    pthread_mutex_unlock(&vid_mutex);                                                                
-                                                                                                         
-    if (dev == NULL)                                                                                 
-    	return V4L_FATAL_ERROR;                                                                      
-                                                                                                         
+	if (dev == NULL)
+		return V4L_FATAL_ERROR;
+
+	if (dev->file_private)
+		return file_next(dev, map);
+
 	v4l2_set_input(cnt, dev, map, width, height, &cnt->conf);
-    ret = v4l2_next(cnt, dev, map, width, height);
-	
-	return ret;
+
+	return v4l2_next(cnt, dev, map, width, height);
+}
+
+/**
+ * vid_next_ref
+ *
+ * Zero-copy capture (conf.io_method == IO_METHOD_MMAP_ZC), map is set to
+ * the driver buffer holding the frame. The buffer must be given back 
+ * with vid_release, which fits the release callback of get_buf_zc.
+ */
+int vid_next_ref(struct context *cnt, unsigned char **map)
+{
+    struct video_dev *dev = vid_find(cnt);
+
+    if (dev == NULL)
+        return V4L_FATAL_ERROR;
+
+    if (dev->file_private)
+        return file_next_ref(dev, map);
+
+    v4l2_picture_controls(cnt, dev);
+
+    return v4l2_next_ref(cnt, dev, map);
+}
+
+void vid_release(void *cnt, void *map)
+{
+    struct video_dev *dev = vid_find((struct context *) cnt);
+
+    /* frames of a file stay in its mapping */
+    if (dev == NULL || dev->file_private)
+        return;
+
+    v4l2_release(dev, (unsigned char *) map);
+}
+
+/**
+ * vid_queue / vid_next_userptr
+ *
+ * USERPTR capture (conf.io_method == IO_METHOD_USERPTR), pipe buffers from
+ * get_buf are queued to the driver with vid_queue and come back filled,
+ * identified by their handle, from vid_next_userptr.
+ */
+int vid_queue(struct context *cnt, void *handle, void *map, int len)
+{
+    struct video_dev *dev = vid_find(cnt);
+
+    if (dev == NULL || dev->file_private)
+        return V4L_FATAL_ERROR;
+
+    return v4l2_queue(dev, handle, (unsigned char *) map, len);
+}
+
+int vid_next_userptr(struct context *cnt, void **handle)
+{
+    struct video_dev *dev = vid_find(cnt);
+
+    if (dev == NULL || dev->file_private)
+        return V4L_FATAL_ERROR;
+
+    v4l2_picture_controls(cnt, dev);
+
+    return v4l2_next_userptr(cnt, dev, handle);
+}
+
+/**
+ * vid_frame_info
+ *
+ * Fills info (see pipe.h) for the frame last returned by vid_next, 
+ * vid_next_ref or vid_next_userptr, to be called before the next one.
+ */
+void vid_frame_info(struct context *cnt, struct frame_info *info)
+{
+    struct video_dev *dev = vid_find(cnt);
+
+    if (dev == NULL)
+        return;
+
+    if (dev->file_private)
+        file_frame_info(dev, info);
+    else
+        v4l2_frame_info(dev, info);
+}
+
+/**
+ * vid_pixformat
+ *
+ * The V4L2 fourcc the driver delivers, i.e. what vid_next_ref hands out.
+ * 0 if the device isn't started.
+ */
+unsigned int vid_pixformat(struct context *cnt)
+{
+    struct video_dev *dev = vid_find(cnt);
+
+    if (dev == NULL)
+        return 0;
+
+    if (dev->file_private)
+        return ((src_file_t *) dev->file_private)->fourcc;
+
+    return ((src_v4l2_t *) dev->v4l2_private)->fmt.fmt.pix.pixelformat;
+}
+
+/**
+ * vid_nonblock
+ *
+ * From now on vid_next, vid_next_ref and vid_next_userptr return 1 instead
+ * of waiting when there is no frame yet, for capturing from several devices
+ * on one thread. Returns an fd that polls readable (EPOLLIN) while a frame
+ * may be there, the device itself or a timerfd for when the next frame of
+ * a file is due. -1 if failed.
+ */
+int vid_nonblock(struct context *cnt)
+{
+    struct video_dev *dev = vid_find(cnt);
+    src_file_t *s;
+    int flags;
+
+    if (dev == NULL)
+        return -1;
+
+    if (!dev->file_private) {
+        flags = fcntl(dev->fd, F_GETFL);
+        if (flags == -1 || fcntl(dev->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            motion_log(LOG_ERR, 1, "%s: O_NONBLOCK", __FUNCTION__);
+            return -1;
+        }
+        return dev->fd;
+    }
+
+    s = (src_file_t *) dev->file_private;
+    if (s->timer_fd < 0) {
+        s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (s->timer_fd < 0) {
+            motion_log(LOG_ERR, 1, "%s: timerfd_create", __FUNCTION__);
+            return -1;
+        }
+        file_arm(s);
+    }
+
+    return s->timer_fd;
 }
 
 /**
@@ -1394,6 +2047,7 @@ void vid_close(struct context *cnt)
 
     /* Set it as closed in thread context */
     cnt->video_dev = -1;
+    cnt->dev = NULL;
 
     if (dev == NULL) { 
         motion_log(LOG_ERR, 0, "vid_close: Unable to find video device");
@@ -1401,8 +2055,12 @@ void vid_close(struct context *cnt)
     }
 
     motion_log(LOG_INFO, 0, "Closing video device %s", dev->video_device);
-    v4l2_close(dev);
-    v4l2_cleanup(dev);
+    if (dev->file_private) {
+        file_cleanup(dev);
+    } else {
+        v4l2_close(dev);
+        v4l2_cleanup(dev);
+    }
 
 	close(dev->fd);
 	munmap(viddevs->v4l_buffers[0], dev->size_map);
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "xdisplay.h"
+
+// XShmAttach fails asynchronously (e.g. remote display), caught here
+static int shm_error;
+
+static int shm_error_handler(Display* display, XErrorEvent* ev)
+{
+	shm_error = 1;
+	return 0;
+}
+
+static int init_shm(struct xdisplay* xd, Visual* visual, int depth)
+{
+	int (*handler)(Display*, XErrorEvent*);
+
+	if (!XShmQueryExtension(xd->display))
+		return -1;
+
+	xd->ximage = XShmCreateImage(xd->display, visual, depth, ZPixmap, NULL,
+		&xd->shminfo, xd->width, xd->height);
+	if (!xd->ximage)
+		return -1;
+
+	xd->shminfo.shmid = shmget(IPC_PRIVATE,
+		xd->ximage->bytes_per_line * xd->ximage->height, IPC_CREAT | 0600);
+	if (xd->shminfo.shmid < 0)
+		goto destroy_image;
+
+	xd->shminfo.shmaddr = xd->ximage->data =
+		(char*)shmat(xd->shminfo.shmid, NULL, 0);
+	if (xd->shminfo.shmaddr == (char*)-1)
+		goto remove_shm;
+	xd->shminfo.readOnly = False;
+
+	XSync(xd->display, False);
+	shm_error = 0;
+	handler = XSetErrorHandler(shm_error_handler);
+	XShmAttach(xd->display, &xd->shminfo);
+	XSync(xd->display, False);
+	XSetErrorHandler(handler);
+	if (shm_error)
+		goto detach_shm;
+
+	// gone once both sides detached
+	shmctl(xd->shminfo.shmid, IPC_RMID, NULL);
+
+	xd->completion = XShmGetEventBase(xd->display) + ShmCompletion;
+	xd->shm = 1;
+	return 0;
+
+detach_shm :
+	shmdt(xd->shminfo.shmaddr);
+remove_shm :
+	shmctl(xd->shminfo.shmid, IPC_RMID, NULL);
+destroy_image :
+	xd->ximage->data = NULL;
+	XDestroyImage(xd->ximage);
+	xd->ximage = NULL;
+
+	return -1;
+}
+
+int init_xdisplay(struct xdisplay* xd, int width, int height, int shm)
+{
+	Visual* visual;
+	int depth;
+
+	memset(xd, 0, sizeof(*xd));
+	xd->width = width;
+	xd->height = height;
+
+	xd->display = XOpenDisplay(NULL);
+	if (!xd->display)
+		return -1;
+
+	visual = DefaultVisual(xd->display, 0);
+	depth = DefaultDepth(xd->display, 0);
+#if defined(__cplusplus) || defined(c_plusplus)
+	if (visual->c_class != TrueColor || depth < 24) {
+#else
+	if (visual->class != TrueColor || depth < 24) {
+#endif
+		fprintf(stderr, "Cannot handle non true color visual ...\n");
+		goto close_display;
+	}
+
+	if (!shm || init_shm(xd, visual, depth)) {
+		char* data = (char*)malloc(width * height * 4);
+
+		if (!data)
+			goto close_display;
+		xd->ximage = XCreateImage(xd->display, visual, depth, ZPixmap, 0,
+			data, width, height, 32, 0);
+		if (!xd->ximage) {
+			free(data);
+			goto close_display;
+		}
+	}
+
+	xd->window = XCreateSimpleWindow(xd->display,
+		RootWindow(xd->display, 0), 0, 0, width, height, 1, 0, 0);
+	xd->gc = DefaultGC(xd->display, 0);
+	XMapWindow(xd->display, xd->window);
+
+	return 0;
+
+close_display :
+	XCloseDisplay(xd->display);
+	return -1;
+}
+
+unsigned char* xdisplay_image(struct xdisplay* xd)
+{
+	// normally long done by the time the next frame is ready
+	while (xd->pending) {
+		XEvent ev;
+
+		XNextEvent(xd->display, &ev);
+		if (ev.type == xd->completion)
+			xd->pending = 0;
+	}
+
+	return (unsigned char*)xd->ximage->data;
+}
+
+void xdisplay_put(struct xdisplay* xd)
+{
+	if (xd->shm) {
+		XShmPutImage(xd->display, xd->window, xd->gc, xd->ximage,
+			0, 0, 0, 0, xd->width, xd->height, True);
+		xd->pending = 1;
+		XFlush(xd->display);
+	} else {
+		XPutImage(xd->display, xd->window, xd->gc, xd->ximage,
+			0, 0, 0, 0, xd->width, xd->height);
+		XFlush(xd->display);
+	}
+}
+
+void close_xdisplay(struct xdisplay* xd)
+{
+	if (xd->shm) {
+		XShmDetach(xd->display, &xd->shminfo);
+		XSync(xd->display, False);
+		shmdt(xd->shminfo.shmaddr);
+		xd->ximage->data = NULL;
+	}
+	XDestroyImage(xd->ximage); // frees data without MIT-SHM
+	XDestroyWindow(xd->display, xd->window);
+	XCloseDisplay(xd->display);
+}
+
+#ifdef XDISPLAY_TEST
+#include <time.h>
+
+// shows a moving gradient with and without MIT-SHM, needs $DISPLAY
+static void run(int shm, int n_frames)
+{
+	struct xdisplay xd;
+	struct timespec t_start, t_now;
+	int i, x, y;
+	double ms;
+
+	if (init_xdisplay(&xd, 640, 480, shm)) {
+		fprintf(stderr, "unable to open display\n");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (i = 0; i < n_frames; i++) {
+		unsigned char* p = xdisplay_image(&xd);
+
+		for (y = 0; y < xd.height; y++) {
+			for (x = 0; x < xd.width; x++) {
+				*p++ = x + i;
+				*p++ = y + i;
+				*p++ = i;
+				*p++ = 255;
+			}
+		}
+		xdisplay_put(&xd);
+	}
+	xdisplay_image(&xd);
+	XSync(xd.display, False);
+	clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+	ms = (t_now.tv_sec - t_start.tv_sec) * 1e3 +
+		(t_now.tv_nsec - t_start.tv_nsec) / 1e6;
+	printf("%s : %d frames, %.3f ms per frame\n",
+		xd.shm ? "MIT-SHM" : "XPutImage", n_frames, ms / n_frames);
+		//should be MIT-SHM first (if the server has it) then XPutImage
+
+	close_xdisplay(&xd);
+}
+
+int main(int argc, char* argv[])
+{
+	if (!getenv("DISPLAY")) {
+		printf("no DISPLAY, skipped\n");
+		return 0;
+	}
+
+	run(1, 300);
+	run(0, 300);
+
+	return 0;
+}
+#endif
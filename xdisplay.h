@@ -0,0 +1,37 @@
+#ifndef __XDISPLAY_H__
+#define __XDISPLAY_H__
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+// a window showing one BGRA (32 bpp TrueColor) image. the image lives
+// in a MIT-SHM segment when the server supports it so frames don't go
+// through the socket, otherwise it falls back to XPutImage
+
+struct xdisplay {
+	Display* display;
+	Window window;
+	GC gc;
+	XImage* ximage;
+	int width;
+	int height;
+
+	int shm;                   // 1 if MIT-SHM is used
+	XShmSegmentInfo shminfo;
+	int completion;            // event type of ShmCompletion
+	int pending;               // server may still be reading ximage
+};
+
+// all return values are 0 if success
+
+int  init_xdisplay(struct xdisplay* xd, int width, int height, int shm);
+	// opens $DISPLAY and maps a window, shm 0 never tries MIT-SHM
+unsigned char* xdisplay_image(struct xdisplay* xd);
+	// where to write the next frame, width * 4 bytes per line. waits for
+	// the server to be done with the previous one
+void xdisplay_put(struct xdisplay* xd);
+	// shows what was written into xdisplay_image()
+void close_xdisplay(struct xdisplay* xd);
+
+#endif